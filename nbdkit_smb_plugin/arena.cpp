@@ -0,0 +1,171 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <functional>
+#include <system_error>
+#include <thread>
+
+#include <nbdkit_smb_plugin/arena.hpp>
+#include <nbdkit_smb_plugin/log.hpp>
+
+static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+static size_t free_list_index()
+{
+	static thread_local const size_t index =
+	    std::hash<std::thread::id>()(std::this_thread::get_id());
+	return index;
+}
+
+Arena::Arena(size_t buffer_size, size_t capacity, HugePages huge_pages)
+    : m_mem(nullptr),
+      m_mem_size(0),
+      m_buffer_size(buffer_size),
+      m_n_buffers(std::max<size_t>(1, capacity / buffer_size)),
+      m_explicit(false),
+      m_n_carved(0),
+      m_n_used(0),
+      m_n_waiting(0)
+{
+	// Explicit huge pages require the mapping to be a multiple of the huge
+	// page size
+	m_mem_size = m_n_buffers * m_buffer_size;
+	if (huge_pages != NONE) {
+		m_mem_size = (m_mem_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+		             HUGE_PAGE_SIZE;
+	}
+
+	// Explicit huge pages are reserved when mapped, so that the mapping
+	// fails if there are not enough of them instead of faulting later
+	void *mem = MAP_FAILED;
+	if (huge_pages == EXPLICIT) {
+		mem = mmap(nullptr, m_mem_size, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem == MAP_FAILED) {
+			SMB_LOG(MEMORY, WARNING,
+			        "Cannot map %zu bytes of huge pages, using transparent "
+			        "huge pages",
+			        m_mem_size);
+			huge_pages = TRANSPARENT;
+		}
+		m_explicit = mem != MAP_FAILED;
+	}
+	if (mem == MAP_FAILED) {
+		mem = mmap(nullptr, m_mem_size, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mem == MAP_FAILED) {
+			throw std::system_error(errno, std::system_category());
+		}
+#ifdef MADV_HUGEPAGE
+		if (huge_pages == TRANSPARENT) {
+			madvise(mem, m_mem_size, MADV_HUGEPAGE);
+		}
+#endif
+	}
+	m_mem = static_cast<uint8_t *>(mem);
+
+	// Released buffers are spread over the lists, which grow on demand if a
+	// thread releases more than its share
+	for (FreeList &list : m_free) {
+		list.buffers.reserve((m_n_buffers + N_FREE_LISTS - 1) / N_FREE_LISTS);
+	}
+}
+
+Arena::~Arena()
+{
+	munmap(m_mem, m_mem_size);
+}
+
+Arena::Buffer Arena::try_allocate()
+{
+	// Reuse a buffer released by this thread
+	const size_t index = free_list_index() % N_FREE_LISTS;
+	{
+		FreeList &list = m_free[index];
+		std::lock_guard<std::mutex> lock(list.mutex);
+		if (!list.buffers.empty()) {
+			uint8_t *data = list.buffers.back();
+			list.buffers.pop_back();
+			m_n_used++;
+			return Buffer(this, data);
+		}
+	}
+
+	// Take a buffer that was never used before
+	size_t n = m_n_carved.load(std::memory_order_relaxed);
+	while (n < m_n_buffers) {
+		if (m_n_carved.compare_exchange_weak(n, n + 1)) {
+			m_n_used++;
+			return Buffer(this, m_mem + n * m_buffer_size);
+		}
+	}
+
+	// Take a buffer released by another thread
+	for (size_t i = 1; i < N_FREE_LISTS; i++) {
+		FreeList &list = m_free[(index + i) % N_FREE_LISTS];
+		std::lock_guard<std::mutex> lock(list.mutex);
+		if (!list.buffers.empty()) {
+			uint8_t *data = list.buffers.back();
+			list.buffers.pop_back();
+			m_n_used++;
+			return Buffer(this, data);
+		}
+	}
+	return Buffer();
+}
+
+Arena::Buffer Arena::allocate()
+{
+	Buffer buf = try_allocate();
+	if (!buf) {
+		std::unique_lock<std::mutex> lock(m_wait_mutex);
+		m_n_waiting++;
+		while (!(buf = try_allocate())) {
+			m_wait_cond.wait(lock);
+		}
+		m_n_waiting--;
+	}
+	return buf;
+}
+
+// Reserved huge pages stay with the mapping; all other memory is faulted in
+// again when the buffer is reused
+void Arena::discard(uint8_t *data)
+{
+	if (!m_explicit) {
+		madvise(data, m_buffer_size, MADV_DONTNEED);
+	}
+	release(data);
+}
+
+void Arena::release(uint8_t *data)
+{
+	{
+		FreeList &list = m_free[free_list_index() % N_FREE_LISTS];
+		std::lock_guard<std::mutex> lock(list.mutex);
+		list.buffers.push_back(data);
+		m_n_used--;
+	}
+	if (m_n_waiting > 0) {
+		std::lock_guard<std::mutex> lock(m_wait_mutex);
+		m_wait_cond.notify_all();
+	}
+}
@@ -0,0 +1,144 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/**
+ * Fixed-size buffers (e.g. superblocks) carved from a single memory mapping
+ * of at most a given size. The mapping is reserved up front but only backed
+ * by memory once buffers are used, and can be backed by huge pages to reduce
+ * TLB pressure for large caches. Released buffers are kept on free lists,
+ * one per thread (threads are hashed onto a fixed number of lists), from
+ * which the same thread allocates first.
+ */
+class Arena {
+public:
+	enum HugePages { NONE, TRANSPARENT, EXPLICIT };
+
+	/**
+	 * A buffer allocated from the arena; returned to the arena when
+	 * destroyed. Empty if the arena was exhausted.
+	 */
+	class Buffer {
+	private:
+		Arena *m_arena;
+		uint8_t *m_data;
+
+	public:
+		Buffer() : m_arena(nullptr), m_data(nullptr) {}
+		Buffer(Arena *arena, uint8_t *data) : m_arena(arena), m_data(data) {}
+		~Buffer() { reset(); }
+
+		Buffer(const Buffer &) = delete;
+		Buffer &operator=(const Buffer &) = delete;
+
+		Buffer(Buffer &&o) noexcept : m_arena(o.m_arena), m_data(o.m_data)
+		{
+			o.m_data = nullptr;
+		}
+
+		Buffer &operator=(Buffer &&o) noexcept
+		{
+			if (this != &o) {
+				reset();
+				m_arena = o.m_arena;
+				m_data = o.m_data;
+				o.m_data = nullptr;
+			}
+			return *this;
+		}
+
+		void reset()
+		{
+			if (m_data) {
+				m_arena->release(m_data);
+				m_data = nullptr;
+			}
+		}
+
+		// Releases the buffer and returns its memory to the system
+		void discard()
+		{
+			if (m_data) {
+				m_arena->discard(m_data);
+				m_data = nullptr;
+			}
+		}
+
+		uint8_t *data() const { return m_data; }
+		size_t size() const { return m_data ? m_arena->buffer_size() : 0; }
+		explicit operator bool() const { return m_data != nullptr; }
+	};
+
+private:
+	static constexpr size_t N_FREE_LISTS = 16;
+
+	struct alignas(64) FreeList {
+		std::mutex mutex;
+		std::vector<uint8_t *> buffers;
+	};
+
+	uint8_t *m_mem;
+	size_t m_mem_size;
+	size_t m_buffer_size;
+	size_t m_n_buffers;
+	bool m_explicit;  // Backed by reserved huge pages
+
+	// Number of buffers handed out from the mapping so far
+	std::atomic<size_t> m_n_carved;
+	std::atomic<size_t> m_n_used;
+
+	FreeList m_free[N_FREE_LISTS];
+
+	// Threads waiting for a buffer to be released
+	std::atomic<size_t> m_n_waiting;
+	std::mutex m_wait_mutex;
+	std::condition_variable m_wait_cond;
+
+	void release(uint8_t *data);
+	void discard(uint8_t *data);
+
+public:
+	/**
+	 * Creates an arena of buffers of the given size, using at most capacity
+	 * bytes, but at least one buffer. Falls back to regular pages if huge
+	 * pages are not available.
+	 */
+	Arena(size_t buffer_size, size_t capacity, HugePages huge_pages);
+	~Arena();
+
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	size_t buffer_size() const { return m_buffer_size; }
+	size_t capacity() const { return m_n_buffers; }
+	size_t used() const { return m_n_used.load(std::memory_order_relaxed); }
+
+	// Returns an empty buffer if all buffers are in use
+	Buffer try_allocate();
+
+	// Waits for a buffer to be released if all buffers are in use
+	Buffer allocate();
+};
@@ -0,0 +1,118 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Growable bitmap with one bit per superblock. Not thread-safe.
+ */
+class Bitmap {
+private:
+	std::vector<uint64_t> m_words;
+	size_t m_size = 0;
+
+public:
+	static constexpr size_t npos = size_t(-1);
+
+	Bitmap() = default;
+	explicit Bitmap(size_t size) { resize(size); }
+
+	size_t size() const { return m_size; }
+
+	void resize(size_t size)
+	{
+		m_words.resize((size + 63) / 64);
+		if (size < m_size && (size % 64)) {
+			m_words.back() &= (uint64_t(1) << (size % 64)) - 1;
+		}
+		m_size = size;
+	}
+
+	void clear() { std::fill(m_words.begin(), m_words.end(), 0); }
+
+	bool test(size_t i) const
+	{
+		return (i < m_size) && ((m_words[i / 64] >> (i % 64)) & 1);
+	}
+
+	// Sets bit i, growing the bitmap if necessary. Returns the old value.
+	bool set(size_t i)
+	{
+		if (i >= m_size) {
+			resize(i + 1);
+		}
+		const uint64_t mask = uint64_t(1) << (i % 64);
+		const bool res = m_words[i / 64] & mask;
+		m_words[i / 64] |= mask;
+		return res;
+	}
+
+	// Clears bit i. Returns the old value.
+	bool reset(size_t i)
+	{
+		if (i >= m_size) {
+			return false;
+		}
+		const uint64_t mask = uint64_t(1) << (i % 64);
+		const bool res = m_words[i / 64] & mask;
+		m_words[i / 64] &= ~mask;
+		return res;
+	}
+
+	// Returns the index of the first set bit at or after i, or npos
+	size_t find_next(size_t i) const
+	{
+		while (i < m_size) {
+			const uint64_t w = m_words[i / 64] >> (i % 64);
+			if (w) {
+				return i + __builtin_ctzll(w);
+			}
+			i = (i / 64 + 1) * 64;
+		}
+		return npos;
+	}
+
+	// Sets all bits that are set in o
+	void merge(const Bitmap &o)
+	{
+		if (o.m_size > m_size) {
+			resize(o.m_size);
+		}
+		for (size_t i = 0; i < o.m_words.size(); i++) {
+			m_words[i] |= o.m_words[i];
+		}
+	}
+
+	size_t count() const
+	{
+		size_t res = 0;
+		for (uint64_t w : m_words) {
+			res += __builtin_popcountll(w);
+		}
+		return res;
+	}
+
+	const uint64_t *data() const { return m_words.data(); }
+	uint64_t *data() { return m_words.data(); }
+	size_t n_words() const { return m_words.size(); }
+};
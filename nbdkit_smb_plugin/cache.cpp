@@ -0,0 +1,353 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+
+#include <nbdkit_smb_plugin/cache.hpp>
+#include <nbdkit_smb_plugin/io_class.hpp>
+#include <nbdkit_smb_plugin/log.hpp>
+
+/******************************************************************************
+ * Class Cache                                                                *
+ ******************************************************************************/
+
+Cache::Cache(size_t capacity, Arena::HugePages huge_pages, size_t n_threads,
+             size_t fetch_pages, Fetch fetch)
+    : m_arena(PAGE_SIZE, capacity, huge_pages),
+      m_limit(m_arena.capacity()),
+      m_fetch_pages(std::max<size_t>(1, fetch_pages)),
+      m_fetch(std::move(fetch)),
+      m_writes(0),
+      m_done(false)
+{
+	for (size_t i = 0; i < n_threads; i++) {
+		m_threads.emplace_back([this]() { worker(); });
+	}
+}
+
+Cache::~Cache()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_done = true;
+	}
+	m_cond.notify_all();
+	for (std::thread &thread : m_threads) {
+		thread.join();
+	}
+}
+
+Arena::Buffer Cache::allocate()
+{
+	Arena::Buffer buf;
+	if (m_pages.size() < m_limit) {
+		buf = m_arena.try_allocate();
+	}
+	return buf ? std::move(buf) : evict();
+}
+
+Arena::Buffer Cache::evict()
+{
+	auto it = m_pages.find(m_lru.back());
+	Arena::Buffer buf = std::move(it->second.buf);
+	m_pages.erase(it);
+	m_lru.pop_back();
+	m_stats.evicted++;
+	return buf;
+}
+
+Cache::Page &Cache::insert(uint64_t page, const uint8_t *data)
+{
+	auto it = m_pages.find(page);
+	if (it == m_pages.end()) {
+		Arena::Buffer buf = allocate();
+		m_lru.push_front(page);
+		it = m_pages.emplace(page, Page{std::move(buf), m_lru.begin(), 0})
+		         .first;
+	}
+	else {
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+	}
+	memcpy(it->second.buf.data(), data, PAGE_SIZE);
+	return it->second;
+}
+
+bool Cache::next_warm(uint64_t &page, size_t &count)
+{
+	const auto full = [this]() {
+		return m_pages.size() + m_fetching.size() >= m_limit;
+	};
+	while (!m_warm.empty()) {
+		// Warming never evicts pages
+		if (full()) {
+			m_warm.clear();
+			return false;
+		}
+		page = m_warm.front();
+		m_warm.pop_front();
+		if (m_pages.count(page) || !m_fetching.emplace(page, false).second) {
+			continue;
+		}
+		count = 1;
+		while (!m_warm.empty() && m_warm.front() == page + count &&
+		       (page + count) % m_fetch_pages != 0 && !full() &&
+		       !m_pages.count(page + count) &&
+		       m_fetching.emplace(page + count, false).second) {
+			m_warm.pop_front();
+			count++;
+		}
+		return true;
+	}
+	return false;
+}
+
+void Cache::worker()
+{
+	IOClassScope scope(IOClass::BACKGROUND);
+	std::vector<uint8_t> buf(m_fetch_pages * PAGE_SIZE);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_cond.wait(lock, [this]() {
+			return m_done || !m_queue.empty() || !m_warm.empty();
+		});
+		if (m_done) {
+			return;
+		}
+		uint64_t page;
+		size_t count = 1;
+		const bool warming = m_queue.empty();
+		if (warming) {
+			if (!next_warm(page, count)) {
+				continue;
+			}
+		}
+		else {
+			page = m_queue.front();
+			m_queue.pop_front();
+			while (!m_queue.empty() && m_queue.front() == page + count &&
+			       (page + count) % m_fetch_pages != 0) {
+				m_queue.pop_front();
+				count++;
+			}
+		}
+
+		lock.unlock();
+		bool ok = true;
+		try {
+			m_fetch(page, count, buf.data());
+		}
+		catch (std::exception &e) {
+			// Not fatal; the page is read on demand instead
+			SMB_LOG(IO, WARNING, "Cannot prefetch page %llu: %s",
+			        (unsigned long long)page, e.what());
+			ok = false;
+		}
+		lock.lock();
+
+		for (size_t i = 0; i < count; i++) {
+			auto it = m_fetching.find(page + i);
+			if (ok && !it->second && warming) {
+				// Restored pages stay part of the working set until they
+				// are evicted
+				insert(page + i, buf.data() + i * PAGE_SIZE).reads = 1;
+				m_stats.warmed++;
+			}
+			else if (ok && !it->second) {
+				insert(page + i, buf.data() + i * PAGE_SIZE);
+				m_stats.prefetched++;
+			}
+			m_fetching.erase(it);
+		}
+	}
+}
+
+bool Cache::read(uint64_t offs, size_t size, uint8_t *buf)
+{
+	const uint64_t first = offs / PAGE_SIZE;
+	const uint64_t last = (offs + size - 1) / PAGE_SIZE;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (uint64_t page = first; page <= last; page++) {
+		if (m_pages.find(page) == m_pages.end()) {
+			m_stats.misses++;
+			return false;
+		}
+	}
+	for (uint64_t page = first; page <= last; page++) {
+		Page &p = m_pages.find(page)->second;
+		m_lru.splice(m_lru.begin(), m_lru, p.lru);
+		p.reads += (p.reads < UINT32_MAX);
+		const uint64_t begin = std::max(offs, page * PAGE_SIZE);
+		const uint64_t end = std::min(offs + size, (page + 1) * PAGE_SIZE);
+		memcpy(buf + (begin - offs), p.buf.data() + (begin - page * PAGE_SIZE),
+		       end - begin);
+	}
+	m_stats.hits++;
+	return true;
+}
+
+uint64_t Cache::generation()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_writes;
+}
+
+void Cache::fill(uint64_t offs, size_t size, const uint8_t *buf,
+                 uint64_t generation)
+{
+	const uint64_t first = (offs + PAGE_SIZE - 1) / PAGE_SIZE;
+	const uint64_t end = (offs + size) / PAGE_SIZE;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (generation != m_writes) {
+		return;
+	}
+	for (uint64_t page = first; page < end; page++) {
+		Page &p = insert(page, buf + (page * PAGE_SIZE - offs));
+		p.reads += (p.reads < UINT32_MAX);
+	}
+}
+
+void Cache::write(uint64_t offs, size_t size, const uint8_t *buf)
+{
+	const uint64_t first = offs / PAGE_SIZE;
+	const uint64_t last = (offs + size - 1) / PAGE_SIZE;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_writes++;
+	for (uint64_t page = first; page <= last; page++) {
+		auto fetching = m_fetching.find(page);
+		if (fetching != m_fetching.end()) {
+			fetching->second = true;
+		}
+		auto it = m_pages.find(page);
+		if (it == m_pages.end()) {
+			continue;
+		}
+		const uint64_t begin = std::max(offs, page * PAGE_SIZE);
+		const uint64_t end = std::min(offs + size, (page + 1) * PAGE_SIZE);
+		uint8_t *dst = it->second.buf.data() + (begin - page * PAGE_SIZE);
+		if (buf) {
+			memcpy(dst, buf + (begin - offs), end - begin);
+		}
+		else {
+			memset(dst, 0, end - begin);
+		}
+	}
+}
+
+void Cache::invalidate(uint64_t offs, size_t size)
+{
+	const uint64_t first = offs / PAGE_SIZE;
+	const uint64_t last = (offs + size - 1) / PAGE_SIZE;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_writes++;
+	for (uint64_t page = first; page <= last; page++) {
+		auto fetching = m_fetching.find(page);
+		if (fetching != m_fetching.end()) {
+			fetching->second = true;
+		}
+		auto it = m_pages.find(page);
+		if (it != m_pages.end()) {
+			m_lru.erase(it->second.lru);
+			m_pages.erase(it);
+		}
+	}
+}
+
+void Cache::prefetch(uint64_t offs, size_t size)
+{
+	if (size == 0) {
+		return;
+	}
+	const uint64_t first = offs / PAGE_SIZE;
+	const uint64_t last = (offs + size - 1) / PAGE_SIZE;
+	{
+		// Pages queued beyond the capacity of the cache would only evict
+		// each other
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (uint64_t page = first; page <= last; page++) {
+			if (m_fetching.size() >= m_limit) {
+				break;
+			}
+			if (m_pages.find(page) == m_pages.end() &&
+			    m_fetching.emplace(page, false).second) {
+				m_queue.push_back(page);
+			}
+		}
+	}
+	m_cond.notify_all();
+}
+
+void Cache::warm(std::vector<uint64_t> pages)
+{
+	{
+		// Consecutive pages are fetched together
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (pages.size() > m_limit) {
+			pages.resize(m_limit);
+		}
+		std::sort(pages.begin(), pages.end());
+		m_warm.assign(pages.begin(), pages.end());
+	}
+	m_cond.notify_all();
+}
+
+void Cache::resize(size_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_limit = std::min(std::max<size_t>(1, size / PAGE_SIZE),
+	                   m_arena.capacity());
+	while (m_pages.size() > m_limit) {
+		evict().discard();
+	}
+}
+
+std::vector<uint64_t> Cache::hot_pages()
+{
+	std::vector<std::pair<uint32_t, uint64_t>> reads;
+	std::vector<uint64_t> res;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (uint64_t page : m_lru) {
+		Page &p = m_pages.find(page)->second;
+		if (p.reads > 0) {
+			reads.emplace_back(p.reads, page);
+			p.reads = (p.reads + 1) / 2;
+		}
+	}
+
+	// Pages read equally often are ordered by their last read
+	std::stable_sort(reads.begin(), reads.end(),
+	                 [](const std::pair<uint32_t, uint64_t> &a,
+	                    const std::pair<uint32_t, uint64_t> &b) {
+		                 return a.first > b.first;
+	                 });
+	for (const std::pair<uint32_t, uint64_t> &r : reads) {
+		res.push_back(r.second);
+	}
+	res.insert(res.end(), m_warm.begin(), m_warm.end());
+	return res;
+}
+
+SMB::CacheStats Cache::stats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	SMB::CacheStats res = m_stats;
+	res.pages = m_pages.size();
+	res.limit = m_limit * PAGE_SIZE;
+	return res;
+}
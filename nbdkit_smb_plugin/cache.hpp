@@ -0,0 +1,151 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <nbdkit_smb_plugin/arena.hpp>
+#include <nbdkit_smb_plugin/smb.hpp>
+
+/**
+ * In-process read cache of fixed-size pages of the disk, evicted in LRU
+ * order. Pages are filled by reads that cover them entirely and fetched by
+ * background threads when they are prefetched. Writes update cached pages in
+ * place, so the cache never returns stale data. The number of reads of each
+ * page is counted, so that the working set can be restored after a restart.
+ */
+class Cache {
+public:
+	// Reads consecutive pages from the disk
+	using Fetch =
+	    std::function<void(uint64_t page, size_t count, uint8_t *buf)>;
+
+	static constexpr size_t PAGE_SIZE = 64 * 1024;
+
+private:
+	struct Page {
+		Arena::Buffer buf;
+		std::list<uint64_t>::iterator lru;
+		uint32_t reads;
+	};
+
+	Arena m_arena;
+	size_t m_limit;  // Maximum number of pages, at most the arena capacity
+	size_t m_fetch_pages;
+	Fetch m_fetch;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::unordered_map<uint64_t, Page> m_pages;
+	std::list<uint64_t> m_lru;  // Most recently used first
+
+	// Number of writes so far; reads only fill the cache if no write
+	// happened while they were in flight
+	uint64_t m_writes;
+
+	// Pages waiting to be fetched, and pages queued or being fetched, which
+	// are marked stale if they are written in the meantime
+	std::deque<uint64_t> m_queue;
+	std::map<uint64_t, bool> m_fetching;
+
+	// Pages of a working set to restore, fetched once the queue is empty
+	std::deque<uint64_t> m_warm;
+
+	SMB::CacheStats m_stats;
+	bool m_done;
+	std::vector<std::thread> m_threads;
+
+	// Returns a buffer for a new page, evicting the least recently used page
+	// if necessary; the mutex must be held
+	Arena::Buffer allocate();
+
+	// Evicts the least recently used page and returns its buffer; the mutex
+	// must be held
+	Arena::Buffer evict();
+
+	// Inserts a page; the mutex must be held
+	Page &insert(uint64_t page, const uint8_t *data);
+
+	// Takes the next consecutive pages to warm and marks them as being
+	// fetched. Returns false once none are left or the cache is full; the
+	// mutex must be held.
+	bool next_warm(uint64_t &page, size_t &count);
+
+	void worker();
+
+public:
+	/**
+	 * Creates a cache of at most "capacity" bytes (but at least one page)
+	 * that prefetches pages on n_threads background threads. Consecutive
+	 * queued pages are fetched together if they lie in the same aligned
+	 * group of fetch_pages pages.
+	 */
+	Cache(size_t capacity, Arena::HugePages huge_pages, size_t n_threads,
+	      size_t fetch_pages, Fetch fetch);
+
+	// Stops the background threads; queued pages are discarded
+	~Cache();
+
+	/**
+	 * Copies the given range into buf if all of its pages are cached.
+	 * Returns false and counts a miss otherwise.
+	 */
+	bool read(uint64_t offs, size_t size, uint8_t *buf);
+
+	// Returns the value to pass to fill() for a read that is about to start
+	uint64_t generation();
+
+	// Inserts the pages that are covered entirely by data read from the disk
+	void fill(uint64_t offs, size_t size, const uint8_t *buf,
+	          uint64_t generation);
+
+	// Updates the cached pages after a write; a null buf writes zeros
+	void write(uint64_t offs, size_t size, const uint8_t *buf);
+
+	// Drops the cached pages of a range whose contents are unknown
+	void invalidate(uint64_t offs, size_t size);
+
+	// Queues the pages of the range that are not cached for fetching
+	void prefetch(uint64_t offs, size_t size);
+
+	// Fetches the given pages in the background after the prefetched ones,
+	// as long as the cache has room for them
+	void warm(std::vector<uint64_t> pages);
+
+	// Limits the cache to the given number of bytes, at most the capacity it
+	// was created with, and returns the memory of evicted pages
+	void resize(size_t size);
+
+	// Returns the cached pages that were read, most often read first,
+	// followed by the pages still waiting to be warmed. Halves the read
+	// counts, so that earlier reads count less than recent ones.
+	std::vector<uint64_t> hot_pages();
+
+	SMB::CacheStats stats();
+};
@@ -0,0 +1,183 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <exception>
+#include <system_error>
+#include <utility>
+
+#include <nbdkit_smb_plugin/changes.hpp>
+#include <nbdkit_smb_plugin/checksum.hpp>
+#include <nbdkit_smb_plugin/log.hpp>
+
+struct ChangeMapHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t sequence;
+	uint64_t generation;
+	uint64_t superblock_bytes;
+	uint64_t n_superblocks;
+	uint64_t checksum;  // Of the header and the bitmap
+};
+
+static const char MAP_MAGIC[8] = {'N', 'B', 'D', 'S', 'M', 'B', 'C', 'T'};
+
+// Maps alternate between two files, so that a torn map never destroys the
+// previous one. The map with sequence number i is written to file i % 2.
+static const char *MAP_FILES[2] = {"changes.0.map", "changes.1.map"};
+
+/******************************************************************************
+ * Class ChangeTracker                                                        *
+ ******************************************************************************/
+
+bool ChangeTracker::load(Context &ctx, const SMB::URL &url, Map &map)
+{
+	bool found = false;
+	for (const char *name : MAP_FILES) {
+		std::string data;
+		if (!ctx.read_file(url.str() + name, data)) {
+			continue;
+		}
+		ChangeMapHeader hdr{};
+		const bool valid = read_header(data, hdr);
+		const size_t n_words = (hdr.n_superblocks + 63) / 64;
+		if (!valid || memcmp(hdr.magic, MAP_MAGIC, sizeof(MAP_MAGIC)) != 0 ||
+		    hdr.version != 1 ||
+		    data.size() != sizeof(hdr) + n_words * sizeof(uint64_t)) {
+			SMB_LOG(DISK, WARNING, "Ignoring invalid %s in %s", name,
+			        url.str().c_str());
+			continue;
+		}
+		if (found && hdr.sequence <= map.sequence) {
+			continue;
+		}
+		map.sequence = hdr.sequence;
+		map.generation = hdr.generation;
+		map.superblock_bytes = hdr.superblock_bytes;
+		map.changed = Bitmap(hdr.n_superblocks);
+		memcpy(map.changed.data(), data.data() + sizeof(hdr),
+		       n_words * sizeof(uint64_t));
+		found = true;
+	}
+	return found;
+}
+
+void ChangeTracker::remove(Context &ctx, const SMB::URL &url)
+{
+	for (const char *name : MAP_FILES) {
+		const std::string path = url.str() + name;
+		if (ctx.unlink(path.c_str()) < 0 && errno != ENOENT) {
+			err(-1);
+		}
+	}
+}
+
+ChangeTracker::ChangeTracker(ContextPool &pool, const SMB::URL &url, Map map,
+                             uint64_t superblock_bytes)
+    : m_pool(pool),
+      m_url(url),
+      m_superblock_bytes(superblock_bytes),
+      m_changed(std::move(map.changed)),
+      m_generation(map.generation),
+      m_sequence(map.sequence + 1),
+      m_version(0),
+      m_recorded(0),
+      m_saving(false)
+{
+	SMB_LOG(DISK, INFO,
+	        "Tracking changes of %s: generation %llu, %zu superblocks "
+	        "changed",
+	        m_url.str().c_str(), (unsigned long long)m_generation,
+	        m_changed.count());
+}
+
+void ChangeTracker::record(std::unique_lock<std::mutex> &lock,
+                           uint64_t version)
+{
+	while (m_recorded < version) {
+		// Wait for the map being written; it may not include this version
+		if (m_saving) {
+			m_cond.wait(lock);
+			continue;
+		}
+
+		// Record all modifications made so far at once
+		const uint64_t recorded = m_version;
+		const uint64_t sequence = m_sequence;
+		const size_t n_words = m_changed.n_words();
+		ChangeMapHeader hdr;
+		memcpy(hdr.magic, MAP_MAGIC, sizeof(MAP_MAGIC));
+		hdr.version = 1;
+		hdr.reserved = 0;
+		hdr.sequence = sequence;
+		hdr.generation = m_generation;
+		hdr.superblock_bytes = m_superblock_bytes;
+		hdr.n_superblocks = m_changed.size();
+		std::string data(sizeof(hdr) + n_words * sizeof(uint64_t), '\0');
+		memcpy(&data[sizeof(hdr)], m_changed.data(),
+		       n_words * sizeof(uint64_t));
+		write_header(data, hdr);
+		m_saving = true;
+		lock.unlock();
+
+		// A failed write may have destroyed the file, so the next attempt
+		// writes the same file again instead of the intact one
+		std::exception_ptr error;
+		try {
+			ContextPool::Lease ctx = m_pool.acquire();
+			ctx->write_file(m_url.str() + MAP_FILES[sequence % 2], data);
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		lock.lock();
+		m_saving = false;
+		m_cond.notify_all();
+		if (error) {
+			std::rethrow_exception(error);
+		}
+		m_sequence = sequence + 1;
+		m_recorded = recorded;
+	}
+}
+
+void ChangeTracker::mark(size_t first, size_t last)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	bool changed = false;
+	for (size_t sb = first; sb <= last; sb++) {
+		changed = !m_changed.set(sb) || changed;
+	}
+	if (changed) {
+		m_version++;
+	}
+
+	// Superblocks that are already marked may still be waiting for their
+	// map to be recorded
+	record(lock, m_version);
+}
+
+uint64_t ChangeTracker::reset()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_changed = Bitmap();
+	const uint64_t generation = ++m_generation;
+	record(lock, ++m_version);
+	return generation;
+}
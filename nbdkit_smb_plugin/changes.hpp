@@ -0,0 +1,92 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include <nbdkit_smb_plugin/bitmap.hpp>
+#include <nbdkit_smb_plugin/context.hpp>
+#include <nbdkit_smb_plugin/smb.hpp>
+
+/**
+ * Records which superblocks were written, zeroed or trimmed since the start
+ * of the current backup generation, so that incremental backups only need to
+ * read these. The map is stored in the disk folder and is updated before a
+ * superblock that is not marked yet is modified, so it never misses a change,
+ * not even after a crash. Concurrent updates are recorded together.
+ *
+ * Change tracking is enabled for a disk once a map exists in its folder.
+ */
+class ChangeTracker {
+public:
+	struct Map {
+		uint64_t sequence = 0;    // Number of the update that wrote the map
+		uint64_t generation = 0;  // Backup generation, see reset()
+		uint64_t superblock_bytes = 0;
+		Bitmap changed;
+	};
+
+private:
+	ContextPool &m_pool;
+	SMB::URL m_url;
+	uint64_t m_superblock_bytes;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+
+	Bitmap m_changed;
+	uint64_t m_generation;
+
+	// Sequence number of the next map, which selects one of two files
+	uint64_t m_sequence;
+
+	// Number of modifications of the map, the number included in the last
+	// map that was recorded, and whether a map is being written
+	uint64_t m_version;
+	uint64_t m_recorded;
+	bool m_saving;
+
+	// Returns once a map including the given modification is recorded, or
+	// throws if writing the map failed; the lock must be held
+	void record(std::unique_lock<std::mutex> &lock, uint64_t version);
+
+public:
+	// Loads the most recent valid map of the disk folder at the given URL.
+	// Returns false if there is none.
+	static bool load(Context &ctx, const SMB::URL &url, Map &map);
+
+	// Deletes the map from the disk folder, disabling change tracking
+	static void remove(Context &ctx, const SMB::URL &url);
+
+	// Continues the given map. A new map is only recorded by reset().
+	ChangeTracker(ContextPool &pool, const SMB::URL &url, Map map,
+	              uint64_t superblock_bytes);
+
+	// Marks the superblocks first to last as changed. Returns once this is
+	// recorded, so the superblocks may be modified afterwards.
+	void mark(size_t first, size_t last);
+
+	// Clears the map and starts the next backup generation, which is
+	// returned
+	uint64_t reset();
+};
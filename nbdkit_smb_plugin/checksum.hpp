@@ -0,0 +1,78 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ * FNV-1a style hash over 64-bit words, used to detect torn or corrupted
+ * metadata files. A checksum over several buffers is computed by passing the
+ * checksum of the previous buffers as h.
+ */
+inline uint64_t checksum(const void *data, size_t size,
+                         uint64_t h = 14695981039346656037ULL)
+{
+	const uint8_t *p = static_cast<const uint8_t *>(data);
+	for (; size >= 8; p += 8, size -= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		h = (h ^ v) * 1099511628211ULL;
+	}
+	for (; size > 0; p++, size--) {
+		h = (h ^ *p) * 1099511628211ULL;
+	}
+	return h;
+}
+
+/**
+ * Metadata files consist of a header with a "checksum" field followed by
+ * data. The checksum covers the header, with the field set to zero, and the
+ * data.
+ */
+template <typename Header>
+uint64_t header_checksum(Header hdr, const std::string &data)
+{
+	hdr.checksum = 0;
+	return checksum(data.data() + sizeof(hdr), data.size() - sizeof(hdr),
+	                checksum(&hdr, sizeof(hdr)));
+}
+
+// Copies the header from the start of data. Returns false if data is too
+// short or its checksum does not match.
+template <typename Header>
+bool read_header(const std::string &data, Header &hdr)
+{
+	if (data.size() < sizeof(hdr)) {
+		return false;
+	}
+	memcpy(&hdr, data.data(), sizeof(hdr));
+	return header_checksum(hdr, data) == hdr.checksum;
+}
+
+// Stores the header with its checksum at the start of data, which must
+// already contain the data following the header
+template <typename Header>
+void write_header(std::string &data, Header hdr)
+{
+	hdr.checksum = header_checksum(hdr, data);
+	memcpy(&data[0], &hdr, sizeof(hdr));
+}
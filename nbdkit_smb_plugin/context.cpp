@@ -0,0 +1,337 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <nbdkit_smb_plugin/context.hpp>
+#include <nbdkit_smb_plugin/log.hpp>
+
+/******************************************************************************
+ * Class Context                                                              *
+ ******************************************************************************/
+
+void Context::auth_data_callback(SMBCCTX *ctx, const char *server,
+                                 const char *share, char *workgroup,
+                                 int max_len_workgroup, char *username,
+                                 int max_len_username, char *password,
+                                 int max_len_password)
+{
+	SMB_LOG(SMBCLIENT, DEBUG, "Authentication request for \\\\%s\\%s",
+	        server, share);
+
+	// Fetch a reference at the context object
+	Context *self = static_cast<Context *>(smbc_getOptionUserData(ctx));
+
+	// Reset the workgroup, username and password
+	std::memset(workgroup, 0, max_len_workgroup);
+	std::memset(username, 0, max_len_username);
+	std::memset(password, 0, max_len_password);
+
+	// Copy the data from the URL into the provided memory regions
+	const SMB::URL &url = self->m_url;
+	if (!url.workgroup.empty()) {
+		std::strncpy(workgroup, url.workgroup.c_str(), max_len_workgroup);
+	}
+	std::strncpy(username, url.user.c_str(), max_len_username);
+	std::strncpy(password, url.password.c_str(), max_len_password);
+}
+
+void Context::log_callback(void *private_ptr, int level, const char *msg)
+{
+	static const Log::Level LEVELS[] = {Log::ERROR, Log::WARNING, Log::INFO,
+	                                    Log::INFO,  Log::DEBUG,   Log::DEBUG,
+	                                    Log::DEBUG};
+	const Log::Level log_level =
+	    (level >= 0 && level < 7) ? LEVELS[level] : Log::TRACE;
+	if (Log::enabled(Log::SMBCLIENT, log_level)) {
+		Log::write(Log::SMBCLIENT, log_level, "%s", msg);
+	}
+}
+
+void Context::update_debug_level()
+{
+	const unsigned int generation = Log::generation();
+	if (generation != m_log_generation) {
+		m_log_generation = generation;
+		smbc_setDebug(m_ctx, Log::smbclient_debug_level());
+	}
+}
+
+void Context::apply_options(const SMB::Options &options)
+{
+	m_log_generation = Log::generation();
+	smbc_setDebug(m_ctx, Log::smbclient_debug_level());
+	if (!options.config.empty() &&
+	    smbc_setConfiguration(m_ctx, options.config.c_str()) < 0) {
+		throw std::runtime_error("Cannot read SMB configuration file '" +
+		                         options.config + "'");
+	}
+	if ((!options.protocol_min.empty() || !options.protocol_max.empty()) &&
+	    !smbc_setOptionProtocols(
+	        m_ctx,
+	        options.protocol_min.empty() ? nullptr : options.protocol_min.c_str(),
+	        options.protocol_max.empty() ? nullptr
+	                                     : options.protocol_max.c_str())) {
+		throw std::runtime_error("Cannot set the SMB protocol range");
+	}
+	if (options.encryption == "none") {
+		smbc_setOptionSmbEncryptionLevel(m_ctx, SMBC_ENCRYPTLEVEL_NONE);
+	}
+	else if (options.encryption == "request") {
+		smbc_setOptionSmbEncryptionLevel(m_ctx, SMBC_ENCRYPTLEVEL_REQUEST);
+	}
+	else if (options.encryption == "require") {
+		smbc_setOptionSmbEncryptionLevel(m_ctx, SMBC_ENCRYPTLEVEL_REQUIRE);
+	}
+	if (options.timeout > 0) {
+		smbc_setTimeout(m_ctx, options.timeout);
+	}
+	if (options.port > 0) {
+		smbc_setPort(m_ctx, options.port);
+	}
+}
+
+Context::Context(const SMB::URL &url, const SMB::Options &options)
+    : m_url(url), m_splice_supported(true)
+{
+	// Create a new context and initialize it with the given options
+	m_ctx = smbc_new_context();
+	if (!m_ctx) {
+		throw std::system_error(errno, std::system_category());
+	}
+	try {
+		apply_options(options);
+	}
+	catch (...) {
+		smbc_free_context(m_ctx, false);
+		throw;
+	}
+	smbc_setLogCallback(m_ctx, nullptr, log_callback);
+	if (smbc_init_context(m_ctx) != m_ctx) {
+		const int error = errno;
+		smbc_free_context(m_ctx, false);
+		throw std::system_error(error, std::system_category());
+	}
+
+	smbc_setOptionUserData(m_ctx, this);
+	smbc_setOptionNoAutoAnonymousLogin(m_ctx, true);
+	smbc_setOptionUseCCache(m_ctx, false);
+
+	// Fetch all required function pointers
+	m_open = smbc_getFunctionOpen(m_ctx);
+	m_close = smbc_getFunctionClose(m_ctx);
+	m_lseek = smbc_getFunctionLseek(m_ctx);
+	m_ftruncate = smbc_getFunctionFtruncate(m_ctx);
+	m_fstat = smbc_getFunctionFstat(m_ctx);
+	m_write = smbc_getFunctionWrite(m_ctx);
+	m_read = smbc_getFunctionRead(m_ctx);
+	m_unlink = smbc_getFunctionUnlink(m_ctx);
+	m_rename = smbc_getFunctionRename(m_ctx);
+	m_mkdir = smbc_getFunctionMkdir(m_ctx);
+	m_rmdir = smbc_getFunctionRmdir(m_ctx);
+	m_opendir = smbc_getFunctionOpendir(m_ctx);
+	m_closedir = smbc_getFunctionClosedir(m_ctx);
+	m_readdir = smbc_getFunctionReaddir(m_ctx);
+	m_statvfs = smbc_getFunctionStatVFS(m_ctx);
+	m_splice = smbc_getFunctionSplice(m_ctx);
+
+	// Set the auth data callback
+	smbc_setFunctionAuthDataWithContext(m_ctx, auth_data_callback);
+}
+
+Context::~Context()
+{
+	if (m_ctx) {
+		smbc_free_context(m_ctx, true);
+	}
+	m_ctx = nullptr;
+}
+
+size_t Context::read_full(SMBCFILE *file, uint8_t *buf, size_t count)
+{
+	size_t total = 0;
+	while (total < count) {
+		const ssize_t n = err(read(file, buf + total, count - total));
+		if (n == 0) {
+			memset(buf + total, 0, count - total);
+			break;
+		}
+		total += n;
+	}
+	return total;
+}
+
+void Context::write_full(SMBCFILE *file, const uint8_t *buf, size_t count)
+{
+	while (count > 0) {
+		const ssize_t n = err(write(file, buf, count));
+		if (n == 0) {
+			throw std::system_error(EIO, std::system_category());
+		}
+		buf += n;
+		count -= n;
+	}
+}
+
+bool Context::read_file(const std::string &path, std::string &data)
+{
+	File file(*this, path.c_str(), O_RDONLY, 0);
+	if (!file) {
+		if (errno == ENOENT) {
+			return false;
+		}
+		err(-1);
+	}
+
+	char buf[65536];
+	ssize_t n;
+	data.clear();
+	while ((n = err(read(file, buf, sizeof(buf)))) > 0) {
+		data.append(buf, n);
+	}
+	return true;
+}
+
+void Context::write_file(const std::string &path, const std::string &data)
+{
+	File file(*this, path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0660);
+	if (!file) {
+		err(-1);
+	}
+	write_full(file, reinterpret_cast<const uint8_t *>(data.data()),
+	           data.size());
+}
+
+void Context::copy(SMBCFILE *src, SMBCFILE *dst, off_t count, uint8_t *buf,
+                   size_t buf_size)
+{
+	// Try to let the server copy the data (FSCTL_SRV_COPYCHUNK)
+	if (m_splice_supported) {
+		const off_t res = splice(src, dst, count);
+		if (res == count) {
+			return;
+		}
+		if (res < 0 && (errno == ENOTSUP || errno == EOPNOTSUPP ||
+		                errno == ENOSYS)) {
+			m_splice_supported = false;
+		}
+		err(lseek(src, 0, SEEK_SET));
+		err(lseek(dst, 0, SEEK_SET));
+	}
+
+	// Fall back to reading and writing the data
+	off_t total = 0;
+	while (total < count) {
+		const ssize_t n =
+		    err(read(src, buf, std::min<off_t>(buf_size, count - total)));
+		if (n == 0) {
+			break;
+		}
+		for (ssize_t offs = 0; offs < n;) {
+			offs += err(write(dst, buf + offs, n - offs));
+		}
+		total += n;
+	}
+}
+
+/******************************************************************************
+ * Class ContextPool                                                          *
+ ******************************************************************************/
+
+ContextPool::ContextPool(const SMB::URL &url, const SMB::Options &options)
+    : m_url(url), m_options(options), m_size(options.pool_size)
+{
+	m_contexts.reserve(m_size);
+}
+
+ContextPool::Lease ContextPool::acquire(IOClass cls)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_idle.empty()) {
+		// Create a new context if we have not reached the pool size yet
+		if (m_contexts.size() < m_size) {
+			m_contexts.emplace_back(std::make_unique<Context>(m_url, m_options));
+			return Lease(this, m_contexts.back().get());
+		}
+
+		// Wait for release() to hand over a context
+		Waiter waiter{cls, Clock::now() + io_class_deadline(cls), nullptr};
+		m_waiters.push_back(&waiter);
+		m_cond.wait(lock, [&waiter]() { return waiter.ctx != nullptr; });
+		waiter.ctx->update_debug_level();
+		return Lease(this, waiter.ctx);
+	}
+	Context *ctx = m_idle.back();
+	m_idle.pop_back();
+	ctx->update_debug_level();
+	return Lease(this, ctx);
+}
+
+ContextPool::Lease ContextPool::try_acquire()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_idle.empty()) {
+		if (m_contexts.size() < m_size) {
+			m_contexts.emplace_back(std::make_unique<Context>(m_url, m_options));
+			return Lease(this, m_contexts.back().get());
+		}
+		return Lease(this, nullptr);
+	}
+	Context *ctx = m_idle.back();
+	m_idle.pop_back();
+	ctx->update_debug_level();
+	return Lease(this, ctx);
+}
+
+void ContextPool::release(Context *ctx)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_waiters.empty()) {
+			m_idle.push_back(ctx);
+			return;
+		}
+
+		// Serve the most overdue waiter, or else the first waiter of the
+		// highest class
+		const Clock::time_point now = Clock::now();
+		auto best = m_waiters.end();
+		for (auto it = m_waiters.begin(); it != m_waiters.end(); ++it) {
+			if (best == m_waiters.end()) {
+				best = it;
+				continue;
+			}
+			const bool overdue = (*it)->deadline <= now;
+			const bool best_overdue = (*best)->deadline <= now;
+			if (overdue != best_overdue
+			        ? overdue
+			        : overdue ? (*it)->deadline < (*best)->deadline
+			                  : (*it)->cls < (*best)->cls) {
+				best = it;
+			}
+		}
+		(*best)->ctx = ctx;
+		m_waiters.erase(best);
+	}
+	m_cond.notify_all();
+}
@@ -0,0 +1,348 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <libsmbclient.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <nbdkit_smb_plugin/io_class.hpp>
+#include <nbdkit_smb_plugin/probes.hpp>
+#include <nbdkit_smb_plugin/smb.hpp>
+
+// Throws a std::system_error for the current errno if status is negative
+template <typename T>
+static T err(T status)
+{
+	if (status < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	return status;
+}
+
+/**
+ * Wraps a single libsmbclient context. A context must only be used by one
+ * thread at a time; use a ContextPool to share contexts between threads.
+ */
+class Context {
+private:
+	SMB::URL m_url;
+	SMBCCTX *m_ctx;
+	bool m_splice_supported;
+	unsigned int m_log_generation;
+
+	smbc_open_fn m_open;
+	smbc_close_fn m_close;
+	smbc_lseek_fn m_lseek;
+	smbc_write_fn m_write;
+	smbc_ftruncate_fn m_ftruncate;
+	smbc_fstat_fn m_fstat;
+	smbc_read_fn m_read;
+	smbc_unlink_fn m_unlink;
+	smbc_rename_fn m_rename;
+	smbc_mkdir_fn m_mkdir;
+	smbc_rmdir_fn m_rmdir;
+	smbc_opendir_fn m_opendir;
+	smbc_closedir_fn m_closedir;
+	smbc_readdir_fn m_readdir;
+	smbc_statvfs_fn m_statvfs;
+	smbc_splice_fn m_splice;
+
+	static void auth_data_callback(SMBCCTX *ctx, const char *server,
+	                               const char *share, char *workgroup,
+	                               int max_len_workgroup, char *username,
+	                               int max_len_username, char *password,
+	                               int max_len_password);
+
+	static void log_callback(void *private_ptr, int level, const char *msg);
+
+	void apply_options(const SMB::Options &options);
+
+	// Applies a verbosity change to the libsmbclient debug level
+	void update_debug_level();
+
+	friend class ContextPool;
+
+public:
+	// Creates a context with the libsmbclient settings in the options
+	Context(const SMB::URL &url, const SMB::Options &options);
+	~Context();
+
+	Context(const Context &) = delete;
+	Context &operator=(const Context &) = delete;
+
+	SMBCFILE *open(const char *fname, int flags, mode_t mode)
+	{
+		SMB_PROBE2(smbc_open_entry, fname, flags);
+		SMBCFILE *res = m_open(m_ctx, fname, flags, mode);
+		SMB_PROBE2(smbc_open_return, res, res ? 0 : errno);
+		return res;
+	}
+	int close(SMBCFILE *file)
+	{
+		SMB_PROBE1(smbc_close_entry, file);
+		const int res = m_close(m_ctx, file);
+		SMB_PROBE2(smbc_close_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	off_t lseek(SMBCFILE *file, off_t offset, int whence)
+	{
+		SMB_PROBE3(smbc_lseek_entry, file, offset, whence);
+		const off_t res = m_lseek(m_ctx, file, offset, whence);
+		SMB_PROBE2(smbc_lseek_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	ssize_t write(SMBCFILE *file, const void *buf, size_t count)
+	{
+		SMB_PROBE2(smbc_write_entry, file, count);
+		const ssize_t res = m_write(m_ctx, file, buf, count);
+		SMB_PROBE2(smbc_write_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	int ftruncate(SMBCFILE *file, off_t size)
+	{
+		SMB_PROBE2(smbc_ftruncate_entry, file, size);
+		const int res = m_ftruncate(m_ctx, file, size);
+		SMB_PROBE2(smbc_ftruncate_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	int fstat(SMBCFILE *file, struct stat *st)
+	{
+		SMB_PROBE1(smbc_fstat_entry, file);
+		const int res = m_fstat(m_ctx, file, st);
+		SMB_PROBE2(smbc_fstat_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	ssize_t read(SMBCFILE *file, void *buf, size_t count)
+	{
+		SMB_PROBE2(smbc_read_entry, file, count);
+		const ssize_t res = m_read(m_ctx, file, buf, count);
+		SMB_PROBE2(smbc_read_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	int unlink(const char *fname)
+	{
+		SMB_PROBE1(smbc_unlink_entry, fname);
+		const int res = m_unlink(m_ctx, fname);
+		SMB_PROBE2(smbc_unlink_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	int rename(const char *oname, const char *nname)
+	{
+		SMB_PROBE2(smbc_rename_entry, oname, nname);
+		const int res = m_rename(m_ctx, oname, m_ctx, nname);
+		SMB_PROBE2(smbc_rename_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	int mkdir(const char *fname, mode_t mode)
+	{
+		SMB_PROBE1(smbc_mkdir_entry, fname);
+		const int res = m_mkdir(m_ctx, fname, mode);
+		SMB_PROBE2(smbc_mkdir_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	int rmdir(const char *fname)
+	{
+		SMB_PROBE1(smbc_rmdir_entry, fname);
+		const int res = m_rmdir(m_ctx, fname);
+		SMB_PROBE2(smbc_rmdir_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	SMBCFILE *opendir(const char *fname)
+	{
+		SMB_PROBE1(smbc_opendir_entry, fname);
+		SMBCFILE *res = m_opendir(m_ctx, fname);
+		SMB_PROBE2(smbc_opendir_return, res, res ? 0 : errno);
+		return res;
+	}
+	int closedir(SMBCFILE *dir)
+	{
+		SMB_PROBE1(smbc_closedir_entry, dir);
+		const int res = m_closedir(m_ctx, dir);
+		SMB_PROBE2(smbc_closedir_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	struct smbc_dirent *readdir(SMBCFILE *dir)
+	{
+		SMB_PROBE1(smbc_readdir_entry, dir);
+		struct smbc_dirent *res = m_readdir(m_ctx, dir);
+		SMB_PROBE2(smbc_readdir_return, res, res ? 0 : errno);
+		return res;
+	}
+	int statvfs(const char *path, struct statvfs *st)
+	{
+		SMB_PROBE1(smbc_statvfs_entry, path);
+		const int res = m_statvfs(m_ctx, const_cast<char *>(path), st);
+		SMB_PROBE2(smbc_statvfs_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+	off_t splice(SMBCFILE *src, SMBCFILE *dst, off_t count)
+	{
+		SMB_PROBE3(smbc_splice_entry, src, dst, count);
+		const off_t res = m_splice(m_ctx, src, dst, count, nullptr, nullptr);
+		SMB_PROBE2(smbc_splice_return, res, SMB_PROBE_ERRNO(res));
+		return res;
+	}
+
+	// Reads until the buffer is full and returns the number of bytes read.
+	// Data beyond the end of the file is returned as zeros.
+	size_t read_full(SMBCFILE *file, uint8_t *buf, size_t count);
+
+	// Writes the entire buffer, continuing after short writes
+	void write_full(SMBCFILE *file, const uint8_t *buf, size_t count);
+
+	// Reads an entire (small) file. Returns false if it does not exist.
+	bool read_file(const std::string &path, std::string &data);
+
+	// Creates or replaces a (small) file
+	void write_file(const std::string &path, const std::string &data);
+
+	/**
+	 * Copies count bytes from the beginning of src to the beginning of dst.
+	 * Uses a server-side copy if the server supports it and streams the data
+	 * through the given buffer otherwise.
+	 */
+	void copy(SMBCFILE *src, SMBCFILE *dst, off_t count, uint8_t *buf,
+	          size_t buf_size);
+};
+
+/**
+ * RAII wrapper around a file handle opened on a specific context.
+ */
+class File {
+private:
+	Context *m_ctx;
+	SMBCFILE *m_file;
+
+	void close()
+	{
+		if (m_file) {
+			int errno_tmp = errno; // Restore errno
+			m_ctx->close(m_file);
+			m_file = nullptr;
+			errno = errno_tmp;
+		}
+	}
+
+public:
+	File() : m_ctx(nullptr), m_file(nullptr) {}
+
+	File(Context &ctx, const char *fname, int flags, mode_t mode) noexcept
+	    : m_ctx(&ctx)
+	{
+		m_file = m_ctx->open(fname, flags, mode);
+	}
+
+	~File() noexcept { close(); }
+
+	File(const File &) = delete;
+	File &operator=(const File &) = delete;
+
+	File(File &&o) noexcept : m_ctx(o.m_ctx), m_file(nullptr)
+	{
+		std::swap(m_file, o.m_file);
+	}
+	File &operator=(File &&o) noexcept
+	{
+		close();
+		m_ctx = o.m_ctx;
+		std::swap(m_file, o.m_file);
+		return *this;
+	}
+
+	operator bool() const { return m_file != nullptr; }
+
+	operator SMBCFILE *() const { return m_file; }
+};
+
+/**
+ * Hands out up to "size" contexts to concurrent users. Contexts are created
+ * on demand and recycled in LIFO order, so that a single user always gets the
+ * same (already connected) context back. When all contexts are in use, a
+ * released context is handed to the waiter of the highest I/O class, or to
+ * the waiter whose deadline has passed first.
+ */
+class ContextPool {
+private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Waiter {
+		IOClass cls;
+		Clock::time_point deadline;
+		Context *ctx;
+	};
+
+	SMB::URL m_url;
+	SMB::Options m_options;
+	size_t m_size;
+	std::vector<std::unique_ptr<Context>> m_contexts;
+	std::vector<Context *> m_idle;
+	std::list<Waiter *> m_waiters;  // In arrival order
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+
+	void release(Context *ctx);
+
+public:
+	class Lease {
+	private:
+		ContextPool *m_pool;
+		Context *m_ctx;
+
+	public:
+		Lease(ContextPool *pool, Context *ctx) : m_pool(pool), m_ctx(ctx) {}
+		~Lease()
+		{
+			if (m_ctx) {
+				m_pool->release(m_ctx);
+			}
+		}
+
+		Lease(const Lease &) = delete;
+		Lease &operator=(const Lease &) = delete;
+
+		Lease(Lease &&o) noexcept : m_pool(o.m_pool), m_ctx(o.m_ctx)
+		{
+			o.m_ctx = nullptr;
+		}
+
+		Context &operator*() const { return *m_ctx; }
+		Context *operator->() const { return m_ctx; }
+		explicit operator bool() const { return m_ctx != nullptr; }
+	};
+
+	// Creates up to options.pool_size contexts
+	ContextPool(const SMB::URL &url, const SMB::Options &options);
+
+	size_t size() const { return m_size; }
+
+	Lease acquire(IOClass cls = current_io_class());
+
+	// Returns an empty lease instead of waiting if no context is available
+	Lease try_acquire();
+};
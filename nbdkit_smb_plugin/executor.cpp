@@ -0,0 +1,150 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+#include <nbdkit_smb_plugin/executor.hpp>
+
+Executor::Executor(size_t n_threads) : m_done(false)
+{
+	for (size_t i = 0; i < n_threads; i++) {
+		m_threads.emplace_back([this]() { worker(); });
+	}
+}
+
+Executor::~Executor()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_done = true;
+	}
+	m_cond.notify_all();
+	for (std::thread &thread : m_threads) {
+		thread.join();
+	}
+}
+
+void Executor::worker()
+{
+	auto empty = [this]() {
+		return std::all_of(std::begin(m_queues), std::end(m_queues),
+		                   [](const std::deque<Task> &q) { return q.empty(); });
+	};
+	while (true) {
+		Task task;
+		size_t cls = 0;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [&]() { return m_done || !empty(); });
+			if (empty()) {
+				return;
+			}
+
+			// Take the most overdue task, or else the first task of the
+			// highest class
+			const auto now = std::chrono::steady_clock::now();
+			while (m_queues[cls].empty()) {
+				cls++;
+			}
+			for (size_t i = cls + 1; i < N_IO_CLASSES; i++) {
+				if (!m_queues[i].empty() &&
+				    m_queues[i].front().deadline <= now &&
+				    m_queues[i].front().deadline <
+				        m_queues[cls].front().deadline) {
+					cls = i;
+				}
+			}
+			task = std::move(m_queues[cls].front());
+			m_queues[cls].pop_front();
+		}
+		IOClassScope scope(static_cast<IOClass>(cls));
+		task.f();
+	}
+}
+
+void Executor::submit(std::function<void()> task)
+{
+	const IOClass cls = current_io_class();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_queues[size_t(cls)].push_back(
+		    Task{std::move(task),
+		         std::chrono::steady_clock::now() + io_class_deadline(cls)});
+	}
+	m_cond.notify_one();
+}
+
+void Executor::run(size_t n, const std::function<void(size_t)> &f)
+{
+	// Shared between the caller and the helpers; helpers may only get to run
+	// after the caller has already processed all indices and returned.
+	struct State {
+		const std::function<void(size_t)> *f;
+		size_t n;
+		std::atomic<size_t> next{0};
+		std::atomic<bool> failed{false};
+		size_t n_done = 0;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable cond;
+
+		void work()
+		{
+			size_t i, n_processed = 0;
+			while ((i = next++) < n) {
+				try {
+					if (!failed) {
+						(*f)(i);
+					}
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!error) {
+						error = std::current_exception();
+					}
+					failed = true;
+				}
+				n_processed++;
+			}
+			if (n_processed > 0) {
+				std::lock_guard<std::mutex> lock(mutex);
+				n_done += n_processed;
+				if (n_done == n) {
+					cond.notify_all();
+				}
+			}
+		}
+	};
+
+	auto state = std::make_shared<State>();
+	state->f = &f;
+	state->n = n;
+	for (size_t i = 1; i < std::min(n, m_threads.size() + 1); i++) {
+		submit([state]() { state->work(); });
+	}
+	state->work();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->cond.wait(lock, [&]() { return state->n_done == n; });
+	if (state->error) {
+		std::rethrow_exception(state->error);
+	}
+}
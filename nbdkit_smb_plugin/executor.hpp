@@ -0,0 +1,67 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <nbdkit_smb_plugin/io_class.hpp>
+
+/**
+ * A fixed set of worker threads executing queued tasks. Tasks are queued per
+ * I/O class of the submitting thread and run in that class; workers take
+ * tasks of higher classes first unless a task of a lower class is overdue.
+ */
+class Executor {
+private:
+	struct Task {
+		std::function<void()> f;
+		std::chrono::steady_clock::time_point deadline;
+	};
+
+	std::vector<std::thread> m_threads;
+	std::deque<Task> m_queues[N_IO_CLASSES];
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_done;
+
+	void worker();
+
+public:
+	Executor(size_t n_threads);
+
+	// Executes all queued tasks, then stops the worker threads
+	~Executor();
+
+	size_t size() const { return m_threads.size(); }
+
+	void submit(std::function<void()> task);
+
+	/**
+	 * Calls f(i) for all i in [0, n) on the calling thread and up to n - 1
+	 * worker threads, and waits for all calls to finish. The first exception
+	 * thrown by f is rethrown; remaining indices are skipped after an error.
+	 */
+	void run(size_t n, const std::function<void(size_t)> &f);
+};
@@ -0,0 +1,145 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+
+/**
+ * Maps ranges of blocks to contiguous byte addresses, e.g. to the location of
+ * their data in a log. Adjacent ranges with adjacent addresses are merged.
+ * Not thread-safe.
+ */
+class ExtentMap {
+public:
+	static constexpr uint64_t npos = uint64_t(-1);
+
+	struct Extent {
+		uint64_t block;
+		uint64_t count;
+		uint64_t addr;  // Address of the first block
+	};
+
+private:
+	uint64_t m_block_size;
+	std::map<uint64_t, Extent> m_extents;  // Keyed by the first block
+
+	// Removes the given range and calls f(addr, count) for each removed part
+	template <typename F>
+	void erase(uint64_t block, uint64_t count, F f)
+	{
+		const uint64_t end = block + count;
+		auto it = m_extents.upper_bound(block);
+		if (it != m_extents.begin() &&
+		    std::prev(it)->second.block + std::prev(it)->second.count > block) {
+			--it;
+		}
+		while (it != m_extents.end() && it->second.block < end) {
+			const Extent e = it->second;
+			it = m_extents.erase(it);
+			if (e.block < block) {
+				m_extents.emplace(e.block, Extent{e.block, block - e.block, e.addr});
+			}
+			const uint64_t e_end = e.block + e.count;
+			if (e_end > end) {
+				const uint64_t offs = end - e.block;
+				it = m_extents.emplace(
+				    end, Extent{end, e_end - end, e.addr + offs * m_block_size})
+				         .first;
+			}
+			const uint64_t first = std::max(e.block, block);
+			const uint64_t last = std::min(e_end, end);
+			f(e.addr + (first - e.block) * m_block_size, last - first);
+		}
+	}
+
+public:
+	explicit ExtentMap(uint64_t block_size) : m_block_size(block_size) {}
+
+	size_t size() const { return m_extents.size(); }
+
+	void clear() { m_extents.clear(); }
+
+	/**
+	 * Maps the given blocks to the given address, or unmaps them if addr is
+	 * npos. Calls removed(addr, count) for each previously mapped part.
+	 */
+	template <typename F>
+	void assign(uint64_t block, uint64_t count, uint64_t addr, F removed)
+	{
+		if (count == 0) {
+			return;
+		}
+		erase(block, count, removed);
+		if (addr == npos) {
+			return;
+		}
+		auto it = m_extents.lower_bound(block);
+		if (it != m_extents.begin()) {
+			Extent &prev = std::prev(it)->second;
+			if (prev.block + prev.count == block &&
+			    prev.addr + prev.count * m_block_size == addr) {
+				prev.count += count;
+				return;
+			}
+		}
+		m_extents.emplace_hint(it, block, Extent{block, count, addr});
+	}
+
+	/**
+	 * Calls f(block, count, addr) for consecutive parts of the given range,
+	 * where addr is npos for parts that are not mapped.
+	 */
+	template <typename F>
+	void lookup(uint64_t block, uint64_t count, F f) const
+	{
+		const uint64_t end = block + count;
+		auto it = m_extents.upper_bound(block);
+		if (it != m_extents.begin() &&
+		    std::prev(it)->second.block + std::prev(it)->second.count > block) {
+			--it;
+		}
+		uint64_t pos = block;
+		for (; it != m_extents.end() && it->second.block < end; ++it) {
+			const Extent &e = it->second;
+			if (e.block > pos) {
+				f(pos, e.block - pos, npos);
+				pos = e.block;
+			}
+			const uint64_t last = std::min(e.block + e.count, end);
+			f(pos, last - pos, e.addr + (pos - e.block) * m_block_size);
+			pos = last;
+		}
+		if (pos < end) {
+			f(pos, end - pos, npos);
+		}
+	}
+
+	// Calls f(extent) for all extents in the order of their blocks
+	template <typename F>
+	void for_each(F f) const
+	{
+		for (const auto &e : m_extents) {
+			f(e.second);
+		}
+	}
+};
@@ -0,0 +1,533 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <nbdkit_smb_plugin/folder.hpp>
+#include <nbdkit_smb_plugin/log.hpp>
+
+struct AllocIndexHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t superblock_size;
+	uint64_t n_superblocks;
+};
+
+static const char ALLOC_MAGIC[8] = {'N', 'B', 'D', 'S', 'M', 'B', 'A', 'I'};
+
+static unsigned long long parse_cfg_uint(const std::string &key,
+                                         const std::string &value)
+{
+	size_t n = 0;
+	unsigned long long res = 0;
+	try {
+		res = std::stoull(value, &n);
+	}
+	catch (std::logic_error &) {
+		n = 0;
+	}
+	if (n == 0 || n != value.size()) {
+		throw std::runtime_error("Invalid value for '" + key +
+		                         "' in the layout file");
+	}
+	return res;
+}
+
+/******************************************************************************
+ * Class Folder                                                               *
+ ******************************************************************************/
+
+Folder::Folder(ContextPool &pool, const SMB::URL &url,
+               const SMB::Options &options, bool read_only)
+    : m_url(url),
+      m_block_size(options.block_size),
+      m_superblock_size(options.superblock_size),
+      m_read_only(read_only),
+      m_log_structured(false),
+      m_layout(Layout::legacy())
+{
+	// Determine the directory layout of the disk and find out which
+	// superblocks exist
+	ContextPool::Lease ctx = pool.acquire();
+	init_layout(*ctx, options);
+	if (m_log_structured) {
+		return;
+	}
+	if (!load_alloc_index(*ctx)) {
+		SMB_LOG(DISK, INFO, "Scanning %s", m_url.str().c_str());
+		scan_alloc_index(pool, *ctx);
+	}
+	SMB_LOG(DISK, INFO, "Opened %s: depth %u, fan-out %u, %zu superblocks%s",
+	        m_url.str().c_str(), m_layout.depth(), m_layout.fanout(),
+	        m_allocated.count(), m_read_only ? " (read-only)" : "");
+}
+
+void Folder::close(Context &ctx)
+{
+	if (!m_read_only && !m_log_structured) {
+		save_alloc_index(ctx);
+	}
+}
+
+// Creates the directory containing the superblock file in path, as well as
+// any missing parent directories. name_offs is the offset of the relative
+// file name in path.
+void Folder::make_block_dirs(Context &ctx, std::string &path, size_t name_offs,
+                             unsigned int level)
+{
+	const size_t len = name_offs + m_layout.dir_length(level);
+	path[len] = '\0';
+	int res = ctx.mkdir(path.c_str(), 0770);
+	path[len] = '/';
+
+	// The parent directory does not exist yet; create it and retry
+	if (res < 0 && errno == ENOENT && level > 0) {
+		make_block_dirs(ctx, path, name_offs, level - 1);
+		path[len] = '\0';
+		res = ctx.mkdir(path.c_str(), 0770);
+		path[len] = '/';
+	}
+
+	// It's okay if someone else created the directory for us. However, any
+	// other error is a failure.
+	if (res < 0 && errno != EEXIST) {
+		err(-1);
+	}
+}
+
+// Position of a stripe as recorded in the layout file, "INDEX/COUNT/WIDTH";
+// empty if the disk is not striped
+static std::string stripe_desc(const SMB::Options &options)
+{
+	if (options.stripes.empty()) {
+		return std::string();
+	}
+	return std::to_string(options.stripe_index) + '/' +
+	       std::to_string(options.stripes.size() + 1) + '/' +
+	       std::to_string(options.stripe_width);
+}
+
+// Reads the directory layout and superblock size recorded on the share. Disks
+// that were created before the layout was recorded use the legacy layout; new
+// disks use the layout and superblock size given in the options.
+void Folder::init_layout(Context &ctx, const SMB::Options &options)
+{
+	std::string data;
+	if (read_file(ctx, LAYOUT_FILE, data)) {
+		bool legacy = false;
+		unsigned long long depth = 1, fanout = Layout::DEFAULT_FANOUT;
+		std::string stripe;
+		std::stringstream ss(data);
+		std::string line;
+		while (std::getline(ss, line)) {
+			const size_t i = line.find('=');
+			if (i == std::string::npos) {
+				continue;
+			}
+			const std::string key = line.substr(0, i);
+			const std::string value = line.substr(i + 1);
+			if (key == "layout") {
+				legacy = (value == "legacy");
+			}
+			else if (key == "depth") {
+				depth = parse_cfg_uint(key, value);
+			}
+			else if (key == "fanout") {
+				fanout = parse_cfg_uint(key, value);
+			}
+			else if (key == "base") {
+				m_base = value;
+			}
+			else if (key == "format") {
+				m_log_structured = (value == "log");
+			}
+			else if (key == "stripe") {
+				stripe = value;
+			}
+			else if (key == "block_size" &&
+			         parse_cfg_uint(key, value) != m_block_size) {
+				throw std::runtime_error("Disk was created with a different " +
+				                         key);
+			}
+			else if (key == "superblock_size") {
+				m_superblock_size = parse_cfg_uint(key, value);
+				if (m_superblock_size == 0) {
+					throw std::runtime_error("Invalid superblock size in the "
+					                         "layout file");
+				}
+			}
+		}
+		m_layout = legacy ? Layout::legacy() : Layout(depth, fanout);
+
+		// The base of an existing disk cannot be changed
+		if (!m_read_only && !options.base.empty() && options.base != m_base) {
+			throw std::runtime_error(
+			    "Disk already exists with a different base");
+		}
+
+		// A stripe only holds part of the superblocks and can neither be
+		// used on its own nor be restriped
+		if (m_read_only ? !stripe.empty() : stripe != stripe_desc(options)) {
+			throw std::runtime_error(
+			    m_read_only ? "Striped disks cannot be used as a base"
+			                : "Disk was created with a different striping");
+		}
+		return;
+	}
+
+	// Create the disk folder if it does not exist. Any existing content
+	// indicates a disk created before the layout was recorded.
+	std::vector<std::string> files, dirs;
+	if (!list_dir(ctx, "", files, dirs)) {
+		if (m_read_only) {
+			err(-1);
+		}
+		err(ctx.mkdir(m_url.str().c_str(), 0770));
+	}
+	if (!files.empty() || !dirs.empty()) {
+		m_layout = Layout::legacy();
+		m_superblock_size = LEGACY_SUPERBLOCK_SIZE;
+	}
+	else if (options.depth == 0) {
+		const size_t sb_bytes = superblock_bytes();
+		m_layout = Layout::for_disk((options.disk_size + sb_bytes - 1) / sb_bytes,
+		                            options.fanout);
+	}
+	else {
+		m_layout = Layout(options.depth, options.fanout);
+	}
+	if (m_read_only) {
+		return;
+	}
+
+	m_base = options.base;
+	m_log_structured = !m_layout.is_legacy() && options.format == "log";
+	std::stringstream ss;
+	ss << "layout=" << (m_layout.is_legacy() ? "legacy" : "hex") << '\n'
+	   << "depth=" << m_layout.depth() << '\n'
+	   << "fanout=" << m_layout.fanout() << '\n'
+	   << "block_size=" << m_block_size << '\n'
+	   << "superblock_size=" << m_superblock_size << '\n';
+	if (!m_base.empty()) {
+		ss << "base=" << m_base << '\n';
+	}
+	if (m_log_structured) {
+		ss << "format=log\n";
+	}
+	if (!options.stripes.empty()) {
+		ss << "stripe=" << stripe_desc(options) << '\n';
+	}
+	write_file(ctx, LAYOUT_FILE, ss.str());
+}
+
+// Loads the allocation index snapshot written by the last clean shutdown. The
+// snapshot is removed once loaded, so that it cannot be mistaken for an
+// up-to-date index after a crash. Read-only folders are never modified, so
+// their snapshot is kept.
+bool Folder::load_alloc_index(Context &ctx)
+{
+	std::string data;
+	if (!read_file(ctx, ALLOC_FILE, data)) {
+		return false;
+	}
+	if (!m_read_only) {
+		err(ctx.unlink((m_url.str() + ALLOC_FILE).c_str()));
+	}
+
+	AllocIndexHeader hdr;
+	if (data.size() < sizeof(hdr)) {
+		return false;
+	}
+	std::memcpy(&hdr, data.data(), sizeof(hdr));
+	const size_t n_words = (hdr.n_superblocks + 63) / 64;
+	if ((std::memcmp(hdr.magic, ALLOC_MAGIC, sizeof(ALLOC_MAGIC)) != 0) ||
+	    (hdr.version != 1) || (hdr.superblock_size != m_superblock_size) ||
+	    (data.size() != sizeof(hdr) + n_words * sizeof(uint64_t))) {
+		SMB_LOG(DISK, WARNING, "Ignoring invalid %s in %s", ALLOC_FILE,
+		        m_url.str().c_str());
+		return false;
+	}
+	Bitmap bitmap(hdr.n_superblocks);
+	std::memcpy(bitmap.data(), data.data() + sizeof(hdr),
+	            bitmap.n_words() * sizeof(uint64_t));
+
+	std::lock_guard<std::mutex> lock(m_allocated_mutex);
+	m_allocated = std::move(bitmap);
+	return true;
+}
+
+void Folder::save_alloc_index(Context &ctx)
+{
+	std::string data;
+	{
+		std::lock_guard<std::mutex> lock(m_allocated_mutex);
+		AllocIndexHeader hdr;
+		std::memcpy(hdr.magic, ALLOC_MAGIC, sizeof(ALLOC_MAGIC));
+		hdr.version = 1;
+		hdr.reserved = 0;
+		hdr.superblock_size = m_superblock_size;
+		hdr.n_superblocks = m_allocated.size();
+		data.append(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+		data.append(reinterpret_cast<const char *>(m_allocated.data()),
+		            m_allocated.n_words() * sizeof(uint64_t));
+	}
+	write_file(ctx, ALLOC_FILE, data);
+}
+
+// Recursively collects the superblock indices of all files below the given
+// directory, which is at the given depth in the directory hierarchy.
+void Folder::scan_dir(Context &ctx, const std::string &rel, unsigned int level,
+                      std::vector<uint64_t> &superblocks)
+{
+	std::vector<std::string> files, dirs;
+	list_dir(ctx, rel, files, dirs);
+	if (level < m_layout.depth()) {
+		for (const std::string &dir : dirs) {
+			scan_dir(ctx, rel + dir + '/', level + 1, superblocks);
+		}
+		return;
+	}
+	for (const std::string &file : files) {
+		const std::string name = rel + file;
+		uint64_t superblock;
+		if (m_layout.parse(name.c_str(), name.size(), superblock)) {
+			superblocks.push_back(superblock);
+		}
+	}
+}
+
+// Rebuilds the allocation index by listing the disk folder. The top-level
+// directories are distributed over all contexts in the pool.
+void Folder::scan_alloc_index(ContextPool &pool, Context &ctx)
+{
+	std::vector<std::string> files, dirs;
+	list_dir(ctx, "", files, dirs);
+
+	std::mutex mutex;
+	std::exception_ptr error;
+	std::atomic<size_t> next(0);
+	Bitmap bitmap;
+	auto worker = [&](Context &ctx) {
+		std::vector<uint64_t> superblocks;
+		try {
+			size_t i;
+			while ((i = next++) < dirs.size()) {
+				scan_dir(ctx, dirs[i] + '/', 1, superblocks);
+			}
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(mutex);
+			error = std::current_exception();
+			next = dirs.size();
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		for (uint64_t superblock : superblocks) {
+			bitmap.set(superblock);
+		}
+	};
+
+	// The calling thread scans using the context it already holds
+	std::vector<std::thread> threads;
+	const size_t n_threads = std::min(pool.size(), dirs.size());
+	for (size_t i = 1; i < n_threads; i++) {
+		threads.emplace_back([&]() { worker(*pool.acquire()); });
+	}
+	worker(ctx);
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+
+	std::lock_guard<std::mutex> lock(m_allocated_mutex);
+	m_allocated = std::move(bitmap);
+}
+
+std::string Folder::filename(size_t superblock) const
+{
+	std::string res(m_layout.name_length(), '0');
+	m_layout.format(superblock, &res[0]);
+	return res;
+}
+
+bool Folder::is_allocated(size_t superblock)
+{
+	std::lock_guard<std::mutex> lock(m_allocated_mutex);
+	return m_allocated.test(superblock);
+}
+
+void Folder::set_allocated(size_t superblock, bool allocated)
+{
+	std::lock_guard<std::mutex> lock(m_allocated_mutex);
+	if (allocated) {
+		m_allocated.set(superblock);
+	}
+	else {
+		m_allocated.reset(superblock);
+	}
+}
+
+Bitmap Folder::allocation()
+{
+	std::lock_guard<std::mutex> lock(m_allocated_mutex);
+	return m_allocated;
+}
+
+File Folder::open(Context &ctx, size_t superblock, bool writing)
+{
+	// Superblocks that are known to be allocated can be opened without
+	// creating them; unallocated superblocks need not be opened when reading.
+	const bool allocated = is_allocated(superblock);
+	if (!allocated && !writing) {
+		return File();
+	}
+
+	const std::string base = m_url.str();
+	std::string path = base + filename(superblock);
+
+	// Try to open the file
+	const int flags = writing ? O_WRONLY : O_RDONLY;
+	File file(ctx, path.c_str(), allocated ? flags : (flags | O_CREAT), 0770);
+	if (allocated) {
+		if (file) {
+			return file;
+		}
+		if (errno != ENOENT) {
+			err(-1);
+		}
+
+		// Someone removed the file behind our back
+		SMB_LOG(DISK, WARNING, "Superblock file %s disappeared", path.c_str());
+		set_allocated(superblock, false);
+		if (!writing) {
+			return File();
+		}
+		file = File(ctx, path.c_str(), flags | O_CREAT, 0770);
+	}
+
+	// The directory we're refering to does not exist; try to create it
+	if (!file && errno == ENOENT) {
+		make_block_dirs(ctx, path, base.size(), m_layout.depth() - 1);
+		file = File(ctx, path.c_str(), flags | O_CREAT, 0770);
+	}
+	if (!file) {
+		err(-1);
+	}
+
+	// Make sure the newly created file has the right size
+	struct stat st;
+	err(ctx.fstat(file, &st));
+	if (size_t(st.st_size) != superblock_bytes()) {
+		err(ctx.ftruncate(file, superblock_bytes()));
+	}
+	set_allocated(superblock, true);
+	return file;
+}
+
+void Folder::remove(Context &ctx, size_t superblock)
+{
+	if (m_read_only) {
+		throw std::system_error(EROFS, std::system_category());
+	}
+	const std::string path = m_url.str() + filename(superblock);
+	if (ctx.unlink(path.c_str()) < 0 && errno != ENOENT) {
+		err(-1);
+	}
+	set_allocated(superblock, false);
+}
+
+void Folder::copy_from(Context &ctx, Folder &src, size_t superblock,
+                       Arena &buffers)
+{
+	File in = src.open(ctx, superblock, false);
+	if (!in) {
+		return;
+	}
+
+	const std::string base = m_url.str();
+	std::string path = base + filename(superblock);
+	const std::string tmp_path = path + ".tmp";
+	File out(ctx, tmp_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0770);
+	if (!out && errno == ENOENT) {
+		make_block_dirs(ctx, path, base.size(), m_layout.depth() - 1);
+		out = File(ctx, tmp_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0770);
+	}
+	if (!out) {
+		err(-1);
+	}
+
+	struct stat st;
+	err(ctx.fstat(in, &st));
+	Arena::Buffer buf = buffers.allocate();
+	ctx.copy(in, out, std::min<off_t>(st.st_size, superblock_bytes()),
+	         buf.data(), buf.size());
+	err(ctx.ftruncate(out, superblock_bytes()));
+	out = File();
+
+	err(ctx.rename(tmp_path.c_str(), path.c_str()));
+	set_allocated(superblock, true);
+}
+
+bool Folder::read_file(Context &ctx, const std::string &name,
+                       std::string &data)
+{
+	return ctx.read_file(m_url.str() + name, data);
+}
+
+void Folder::write_file(Context &ctx, const std::string &name,
+                        const std::string &data)
+{
+	ctx.write_file(m_url.str() + name, data);
+}
+
+// Lists the given directory relative to the folder. Returns false if the
+// directory does not exist.
+bool Folder::list_dir(Context &ctx, const std::string &rel,
+                      std::vector<std::string> &files,
+                      std::vector<std::string> &dirs)
+{
+	const std::string path = m_url.str() + rel;
+	SMBCFILE *dir = ctx.opendir(path.c_str());
+	if (!dir) {
+		if (errno == ENOENT) {
+			return false;
+		}
+		err(-1);
+	}
+	while (struct smbc_dirent *ent = ctx.readdir(dir)) {
+		if (strcmp(ent->name, ".") == 0 || strcmp(ent->name, "..") == 0) {
+			continue;
+		}
+		if (ent->smbc_type == SMBC_DIR) {
+			dirs.emplace_back(ent->name);
+		}
+		else {
+			files.emplace_back(ent->name);
+		}
+	}
+	ctx.closedir(dir);
+	return true;
+}
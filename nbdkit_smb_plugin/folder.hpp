@@ -0,0 +1,125 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <nbdkit_smb_plugin/arena.hpp>
+#include <nbdkit_smb_plugin/bitmap.hpp>
+#include <nbdkit_smb_plugin/context.hpp>
+#include <nbdkit_smb_plugin/layout.hpp>
+#include <nbdkit_smb_plugin/smb.hpp>
+
+/**
+ * A disk folder on the share, i.e. a directory hierarchy of superblock files
+ * together with its recorded layout and an index of the superblocks that
+ * exist. Read-only folders (such as the base of an overlay disk) are never
+ * modified.
+ */
+class Folder {
+private:
+	static constexpr const char *LAYOUT_FILE = "layout.cfg";
+	static constexpr const char *ALLOC_FILE = "alloc.idx";
+
+	// Superblock size of disks created before the layout was recorded
+	static constexpr size_t LEGACY_SUPERBLOCK_SIZE = 256;
+
+	SMB::URL m_url;
+	size_t m_block_size;
+	size_t m_superblock_size;
+	bool m_read_only;
+	bool m_log_structured;
+	Layout m_layout;
+	std::string m_base;
+
+	// One bit per superblock file present on the share
+	std::mutex m_allocated_mutex;
+	Bitmap m_allocated;
+
+	void make_block_dirs(Context &ctx, std::string &path, size_t name_offs,
+	                     unsigned int level);
+
+	void init_layout(Context &ctx, const SMB::Options &options);
+
+	bool load_alloc_index(Context &ctx);
+	void save_alloc_index(Context &ctx);
+	void scan_dir(Context &ctx, const std::string &rel, unsigned int level,
+	              std::vector<uint64_t> &superblocks);
+	void scan_alloc_index(ContextPool &pool, Context &ctx);
+
+public:
+	Folder(ContextPool &pool, const SMB::URL &url, const SMB::Options &options,
+	       bool read_only);
+
+	// Persists the allocation index; must be called on clean shutdown
+	void close(Context &ctx);
+
+	const SMB::URL &url() const { return m_url; }
+	const Layout &layout() const { return m_layout; }
+	bool read_only() const { return m_read_only; }
+
+	// Log-structured disks store their data in segments (see LogStore)
+	// instead of superblock files and have no allocation index
+	bool log_structured() const { return m_log_structured; }
+
+	// The superblock size recorded for an existing disk takes precedence
+	// over the one given in the options
+	size_t block_size() const { return m_block_size; }
+	size_t superblock_size() const { return m_superblock_size; }
+	size_t superblock_bytes() const { return m_block_size * m_superblock_size; }
+
+	// URL of the base folder if this is an overlay, empty otherwise
+	const std::string &base() const { return m_base; }
+
+	// File name of the superblock relative to the folder
+	std::string filename(size_t superblock) const;
+
+	bool is_allocated(size_t superblock);
+	void set_allocated(size_t superblock, bool allocated);
+
+	// Returns a copy of the allocation index
+	Bitmap allocation();
+
+	/**
+	 * Opens the given superblock file. When reading, returns a null file if the
+	 * superblock does not exist. When writing, the superblock file and its
+	 * directories are created if necessary.
+	 */
+	File open(Context &ctx, size_t superblock, bool writing);
+
+	// Deletes the superblock file; missing files are ignored
+	void remove(Context &ctx, size_t superblock);
+
+	// Copies a superblock from another folder. The copy is written to a
+	// temporary file first, so the superblock never exists partially. If
+	// the server cannot copy the data, it is streamed through a buffer.
+	void copy_from(Context &ctx, Folder &src, size_t superblock,
+	               Arena &buffers);
+
+	// Access to auxiliary files and directories relative to the folder
+	bool read_file(Context &ctx, const std::string &name, std::string &data);
+	void write_file(Context &ctx, const std::string &name,
+	                const std::string &data);
+	bool list_dir(Context &ctx, const std::string &rel,
+	              std::vector<std::string> &files,
+	              std::vector<std::string> &dirs);
+};
@@ -0,0 +1,207 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <memory>
+
+#include <nbdkit_smb_plugin/hedge.hpp>
+#include <nbdkit_smb_plugin/io_class.hpp>
+
+/******************************************************************************
+ * Class Hedger                                                               *
+ ******************************************************************************/
+
+Hedger::Hedger(const SMB::Options &options, size_t n_reads, Arena &buffers)
+    : m_percentile(options.hedge),
+      m_budget(options.hedge_budget / 100.0),
+      m_tokens(MAX_TOKENS),
+      m_buffers(buffers),
+      m_executor(2 * n_reads)
+{
+}
+
+bool Hedger::enabled(const SMB::Options &options) { return options.hedge > 0; }
+
+size_t Hedger::size_class(size_t size)
+{
+	size_t res = 0;
+	for (size_t n = size / 4096; n >= 4 && res + 1 < N_SIZE_CLASSES; n /= 4) {
+		res++;
+	}
+	return res;
+}
+
+void Hedger::record(size_t size, Clock::time_point start)
+{
+	const uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(
+	                        Clock::now() - start)
+	                        .count();
+	Window &window = m_windows[size_class(size)];
+	const uint32_t sample = std::max<uint64_t>(
+	    1, std::min<uint64_t>(us, std::numeric_limits<uint32_t>::max()));
+	if (window.latency_us.size() < WINDOW) {
+		window.latency_us.push_back(sample);
+	}
+	else {
+		window.latency_us[window.next] = sample;
+		window.next = (window.next + 1) % WINDOW;
+	}
+	if (++window.n_new < UPDATE_INTERVAL) {
+		return;
+	}
+	window.n_new = 0;
+	std::vector<uint32_t> sorted = window.latency_us;
+	const auto nth = sorted.begin() + size_t(m_percentile / 100.0 *
+	                                         (sorted.size() - 1));
+	std::nth_element(sorted.begin(), nth, sorted.end());
+	window.threshold = std::chrono::microseconds(*nth);
+}
+
+Hedger::Clock::duration Hedger::threshold(size_t size)
+{
+	const Window &window = m_windows[size_class(size)];
+	if (window.latency_us.size() < MIN_SAMPLES) {
+		return Clock::duration::zero();
+	}
+	return window.threshold;
+}
+
+void Hedger::read(size_t size, uint8_t *buf, const Read &f)
+{
+	// Prefetches are not worth duplicating
+	const Clock::time_point start = Clock::now();
+	if (current_io_class() == IOClass::BACKGROUND) {
+		f(false, buf);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		record(size, start);
+		return;
+	}
+
+	Clock::duration wait;
+	bool can_hedge;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stats.reads++;
+		m_tokens = std::min(MAX_TOKENS, m_tokens + m_budget);
+		wait = threshold(size);
+		can_hedge = wait != Clock::duration::zero() && m_tokens >= 1.0;
+	}
+
+	// Reads that cannot be duplicated are performed directly, which saves
+	// the copy from the buffer of the hedger
+	Arena::Buffer first;
+	if (can_hedge && size <= m_buffers.buffer_size()) {
+		first = m_buffers.try_allocate();
+	}
+	if (!first) {
+		f(false, buf);
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (wait != Clock::duration::zero() && Clock::now() - start > wait) {
+			m_stats.denied++;
+		}
+		record(size, start);
+		return;
+	}
+
+	// State shared with the reads, which may outlive this call
+	struct Request {
+		Read f;
+		std::mutex mutex;
+		std::condition_variable cond;
+		Arena::Buffer bufs[2];
+		size_t n_issued = 0;
+		size_t n_failed = 0;
+		int winner = -1;
+		std::exception_ptr error;
+	};
+	auto req = std::make_shared<Request>();
+	req->f = f;
+	req->bufs[0] = std::move(first);
+	const auto issue = [&](size_t i, Clock::time_point issued) {
+		req->n_issued++;
+		m_executor.submit([this, req, size, i, issued]() {
+			try {
+				req->f(i == 1, req->bufs[i].data());
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(req->mutex);
+				if (i == 0 || !req->error) {
+					req->error = std::current_exception();
+				}
+				req->n_failed++;
+				req->cond.notify_all();
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				record(size, issued);
+			}
+			std::lock_guard<std::mutex> lock(req->mutex);
+			if (req->winner < 0) {
+				req->winner = i;
+			}
+			req->cond.notify_all();
+		});
+	};
+
+	std::unique_lock<std::mutex> lock(req->mutex);
+	const auto finished = [&]() {
+		return req->winner >= 0 || req->n_failed == req->n_issued;
+	};
+	issue(0, start);
+	if (!req->cond.wait_until(lock, start + wait, finished)) {
+		bool hedge;
+		{
+			std::lock_guard<std::mutex> stats_lock(m_mutex);
+			hedge = m_tokens >= 1.0;
+			if (hedge) {
+				req->bufs[1] = m_buffers.try_allocate();
+				hedge = bool(req->bufs[1]);
+			}
+			if (hedge) {
+				m_tokens -= 1.0;
+				m_stats.hedged++;
+			}
+			else {
+				m_stats.denied++;
+			}
+		}
+		if (hedge) {
+			issue(1, Clock::now());
+		}
+		req->cond.wait(lock, finished);
+	}
+	if (req->winner < 0) {
+		std::rethrow_exception(req->error);
+	}
+	if (req->winner == 1) {
+		std::lock_guard<std::mutex> stats_lock(m_mutex);
+		m_stats.won++;
+	}
+	memcpy(buf, req->bufs[req->winner].data(), size);
+}
+
+SMB::HedgeStats Hedger::stats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
@@ -0,0 +1,109 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <nbdkit_smb_plugin/arena.hpp>
+#include <nbdkit_smb_plugin/executor.hpp>
+#include <nbdkit_smb_plugin/smb.hpp>
+
+/**
+ * Duplicates reads that take longer than a percentile of the recent read
+ * latencies, and uses whichever copy completes first. The number of
+ * duplicates is limited to a fraction of all reads.
+ *
+ * Since a read cannot be cancelled, both copies are performed on threads of
+ * the hedger into buffers of their own, and the losing copy finishes in the
+ * background. The buffers are taken from the arena of superblock buffers;
+ * reads are not duplicated while it is exhausted.
+ */
+class Hedger {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	// Reads into the given buffer; hedge is set for the duplicate. May still
+	// be called after Hedger::read() has returned, so it must not refer to
+	// the stack of the caller.
+	using Read = std::function<void(bool hedge, uint8_t *buf)>;
+
+private:
+	// Latencies are tracked separately for reads of 4K, 16K, ..., 1M and
+	// larger sizes
+	static constexpr size_t N_SIZE_CLASSES = 6;
+
+	// Number of recent latencies the percentile is taken from, number of
+	// latencies required before reads are duplicated, and number of new
+	// latencies after which the percentile is updated
+	static constexpr size_t WINDOW = 256;
+	static constexpr size_t MIN_SAMPLES = 32;
+	static constexpr size_t UPDATE_INTERVAL = 16;
+
+	// Number of duplicates that may be issued at once after a quiet period
+	static constexpr double MAX_TOKENS = 8.0;
+
+	struct Window {
+		std::vector<uint32_t> latency_us;
+		size_t next = 0;
+		size_t n_new = 0;
+		Clock::duration threshold = Clock::duration::zero();
+	};
+
+	double m_percentile;
+	double m_budget;  // Duplicates allowed per read
+	double m_tokens;  // Duplicates that may currently be issued
+	Window m_windows[N_SIZE_CLASSES];
+
+	std::mutex m_mutex;
+	SMB::HedgeStats m_stats;
+
+	Arena &m_buffers;
+
+	Executor m_executor;
+
+	static size_t size_class(size_t size);
+
+	// Records the latency of a completed read; the mutex must be held
+	void record(size_t size, Clock::time_point start);
+
+	// Returns how long a read may take before it is duplicated, or zero if
+	// it is not to be duplicated; the mutex must be held
+	Clock::duration threshold(size_t size);
+
+public:
+	// Uses twice as many threads as there can be concurrent reads
+	Hedger(const SMB::Options &options, size_t n_reads, Arena &buffers);
+
+	// Waits for the reads that lost against their duplicate
+	~Hedger() = default;
+
+	// Returns true if hedging is configured
+	static bool enabled(const SMB::Options &options);
+
+	// Reads size bytes into buf, duplicating the read if it is slow. Throws
+	// the error of the original read if all reads that were issued failed.
+	void read(size_t size, uint8_t *buf, const Read &f);
+
+	SMB::HedgeStats stats();
+};
@@ -0,0 +1,35 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <nbdkit_smb_plugin/io_class.hpp>
+
+static thread_local IOClass io_class = IOClass::WRITE;
+
+IOClass current_io_class() { return io_class; }
+
+std::chrono::steady_clock::duration io_class_deadline(IOClass cls)
+{
+	static constexpr std::chrono::milliseconds DEADLINES[N_IO_CLASSES] = {
+	    std::chrono::milliseconds(5), std::chrono::milliseconds(20),
+	    std::chrono::milliseconds(250)};
+	return DEADLINES[size_t(cls)];
+}
+
+IOClassScope::IOClassScope(IOClass cls) : m_prev(io_class) { io_class = cls; }
+
+IOClassScope::~IOClassScope() { io_class = m_prev; }
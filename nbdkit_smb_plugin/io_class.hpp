@@ -0,0 +1,52 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+/**
+ * Priority class of the I/O issued by the current thread. Contexts and
+ * executor threads are handed to foreground reads first, then to foreground
+ * writes, then to background work such as journal writeback, prefetching and
+ * compaction. A request that has waited longer than the deadline of its class
+ * is served first regardless of its class, so no class starves.
+ */
+enum class IOClass { READ, WRITE, BACKGROUND };
+
+static constexpr size_t N_IO_CLASSES = 3;
+
+// Returns the class of the current thread; WRITE unless set otherwise
+IOClass current_io_class();
+
+// Time after which a waiting request of the given class is overdue
+std::chrono::steady_clock::duration io_class_deadline(IOClass cls);
+
+// Sets the class of the current thread for the lifetime of the scope
+class IOClassScope {
+private:
+	IOClass m_prev;
+
+public:
+	explicit IOClassScope(IOClass cls);
+	~IOClassScope();
+
+	IOClassScope(const IOClassScope &) = delete;
+	IOClassScope &operator=(const IOClassScope &) = delete;
+};
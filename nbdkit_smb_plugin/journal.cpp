@@ -0,0 +1,441 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include <nbdkit_smb_plugin/checksum.hpp>
+#include <nbdkit_smb_plugin/folder.hpp>
+#include <nbdkit_smb_plugin/journal.hpp>
+#include <nbdkit_smb_plugin/log.hpp>
+
+struct JournalHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint64_t epoch;
+};
+
+// Header of each journaled write, followed by its data
+struct JournalRecord {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t epoch;     // Records of earlier epochs are ignored
+	uint64_t sequence;  // Consecutive within an epoch
+	uint64_t block;
+	uint64_t checksum;  // Of the header and the data
+};
+
+static const char JOURNAL_MAGIC[8] = {'N', 'B', 'D', 'S', 'M', 'B', 'J', 'L'};
+static constexpr uint32_t RECORD_MAGIC = 0x524a4d53;
+
+static uint64_t record_checksum(JournalRecord rec, const uint8_t *data,
+                                size_t size)
+{
+	rec.checksum = 0;
+	return checksum(data, size, checksum(&rec, sizeof(rec)));
+}
+
+/******************************************************************************
+ * Class Journal                                                              *
+ ******************************************************************************/
+
+Journal::Journal(Folder &folder, const SMB::Options &options, uint64_t size,
+                 Apply apply)
+    : m_folder(folder),
+      m_block_size(folder.block_size()),
+      m_superblock_size(folder.superblock_size()),
+      m_size(size),
+      m_merge_size(options.io_size),
+      m_apply(std::move(apply)),
+      m_ctx(folder.url(), options),
+      m_epoch(0),
+      m_sequence(0),
+      m_offs(0),
+      m_index(m_block_size),
+      m_draining(false),
+      m_n_resets(0),
+      m_done(false)
+{
+	// Writes are acknowledged once appended, so the journal is opened
+	// write-through (libsmbclient maps O_SYNC to FILE_WRITE_THROUGH)
+	const std::string path = m_folder.url().str() + JOURNAL_FILE;
+	m_file = File(m_ctx, path.c_str(), O_RDWR | O_CREAT | O_SYNC, 0660);
+	if (!m_file) {
+		err(-1);
+	}
+	m_epoch = replay(m_ctx, m_file, m_folder, m_apply);
+	{
+		std::lock_guard<std::mutex> lock(m_append_mutex);
+		reset();
+	}
+	m_thread = std::thread([this]() { worker(); });
+}
+
+Journal::~Journal()
+{
+	{
+		std::unique_lock<std::shared_mutex> lock(m_mutex);
+		m_done = true;
+	}
+	m_cond.notify_all();
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+void Journal::close()
+{
+	drain();
+	std::lock_guard<std::mutex> lock(m_append_mutex);
+	reset();
+}
+
+// Applies the writes of the current epoch up to the first torn record
+uint64_t Journal::replay(Context &ctx, SMBCFILE *file, const Folder &folder,
+                         const Apply &apply)
+{
+	JournalHeader hdr;
+	if (ctx.read_full(file, reinterpret_cast<uint8_t *>(&hdr), sizeof(hdr)) <
+	        sizeof(hdr) ||
+	    memcmp(hdr.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 ||
+	    hdr.version != 1) {
+		return 0;  // The journal is new, or was reset when it was torn
+	}
+	const size_t block_size = folder.block_size();
+	if (hdr.block_size != block_size) {
+		throw std::runtime_error(
+		    "Journal was written with a different block size");
+	}
+
+	std::vector<uint8_t> data;
+	uint64_t sequence = 0;
+	while (true) {
+		JournalRecord rec;
+		if (ctx.read_full(file, reinterpret_cast<uint8_t *>(&rec),
+		                  sizeof(rec)) < sizeof(rec) ||
+		    rec.magic != RECORD_MAGIC || rec.epoch != hdr.epoch ||
+		    rec.sequence != sequence || rec.count * block_size > MAX_WRITE) {
+			break;
+		}
+		data.resize(rec.count * block_size);
+		if (ctx.read_full(file, data.data(), data.size()) < data.size() ||
+		    record_checksum(rec, data.data(), data.size()) != rec.checksum) {
+			break;
+		}
+		apply(rec.block, rec.count, data.data());
+		sequence++;
+	}
+	if (sequence > 0) {
+		SMB_LOG(DISK, INFO, "Applied %llu journaled writes to %s",
+		        (unsigned long long)sequence, folder.url().str().c_str());
+	}
+	return hdr.epoch;
+}
+
+void Journal::recover(ContextPool &pool, Folder &folder,
+                      const SMB::Options &options, const Apply &apply)
+{
+	const std::string path = folder.url().str() + JOURNAL_FILE;
+	{
+		ContextPool::Lease ctx = pool.acquire();
+		if (!File(*ctx, path.c_str(), O_RDONLY, 0)) {
+			if (errno == ENOENT) {
+				return;
+			}
+			err(-1);
+		}
+	}
+
+	// Applying the writes needs contexts of the pool
+	Context ctx(folder.url(), options);
+	{
+		File file(ctx, path.c_str(), O_RDONLY, 0);
+		if (!file) {
+			err(-1);
+		}
+		replay(ctx, file, folder, apply);
+	}
+	err(ctx.unlink(path.c_str()));
+}
+
+void Journal::reset()
+{
+	// The new epoch is only used once its header has been written
+	JournalHeader hdr;
+	memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+	hdr.version = 1;
+	hdr.block_size = m_block_size;
+	hdr.epoch = m_epoch + 1;
+	err(m_ctx.lseek(m_file, 0, SEEK_SET));
+	m_ctx.write_full(m_file, reinterpret_cast<const uint8_t *>(&hdr),
+	                 sizeof(hdr));
+	m_epoch = hdr.epoch;
+	m_sequence = 0;
+	m_offs = sizeof(hdr);
+
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	m_index.clear();
+	m_error = nullptr;
+	m_draining = false;
+	m_n_resets++;
+	m_cond.notify_all();
+}
+
+void Journal::start_over(bool draining)
+{
+	// Writes may have been appended before the append mutex was taken; they
+	// are only added while it is held, so the check below stays valid
+	std::unique_lock<std::mutex> append_lock(m_append_mutex, std::defer_lock);
+	if (draining) {
+		append_lock.lock();
+	}
+	else if (!append_lock.try_lock() || m_offs <= m_size / 4) {
+		return;
+	}
+	{
+		std::shared_lock<std::shared_mutex> lock(m_mutex);
+		if (!m_pending.empty()) {
+			return;
+		}
+	}
+	try {
+		reset();
+	}
+	catch (std::exception &e) {
+		SMB_LOG(DISK, ERROR, "Cannot reset the journal of %s: %s",
+		        m_folder.url().str().c_str(), e.what());
+		if (draining) {
+			std::unique_lock<std::shared_mutex> lock(m_mutex);
+			m_error = std::current_exception();
+			m_cond.notify_all();
+		}
+	}
+}
+
+void Journal::drain()
+{
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	m_cond.wait(lock, [this]() { return m_pending.empty() || m_error; });
+	if (m_error) {
+		std::rethrow_exception(m_error);
+	}
+}
+
+void Journal::worker()
+{
+	IOClassScope scope(IOClass::BACKGROUND);
+	std::vector<uint8_t> merged;
+	size_t n_attempts = 0;
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	while (true) {
+		m_cond.wait(lock, [this]() {
+			return m_done || !m_pending.empty() || m_draining;
+		});
+		if (m_done) {
+			return;  // Unapplied writes are applied when reopening
+		}
+		if (m_pending.empty()) {
+			// All writes are applied while writes bypass the journal
+			lock.unlock();
+			start_over(true);
+			lock.lock();
+			if (m_draining && m_pending.empty()) {
+				m_cond.wait_for(lock, std::chrono::seconds(1));
+			}
+			continue;
+		}
+
+		// Merge the following writes while they overlap or adjoin the first
+		// one within its superblock. Only this thread removes writes, so the
+		// entries stay valid.
+		const std::map<uint64_t, Pending>::iterator it = m_pending.begin();
+		std::map<uint64_t, Pending>::iterator end = std::next(it);
+		size_t n_merged = 1;
+		uint64_t first = it->second.block;
+		uint64_t last = first + it->second.count;
+		const uint64_t sb = first / m_superblock_size;
+		while (end != m_pending.end() &&
+		       (last - 1) / m_superblock_size == sb) {
+			const Pending &next = end->second;
+			const uint64_t next_last = next.block + next.count;
+			if (next.block > last || next_last < first ||
+			    next.block / m_superblock_size != sb ||
+			    (next_last - 1) / m_superblock_size != sb ||
+			    (std::max(last, next_last) - std::min(first, next.block)) *
+			            m_block_size >
+			        m_merge_size) {
+				break;
+			}
+			first = std::min(first, next.block);
+			last = std::max(last, next_last);
+			++end;
+			n_merged++;
+		}
+		lock.unlock();
+
+		const uint8_t *data = it->second.data.data();
+		if (n_merged > 1) {
+			merged.resize((last - first) * m_block_size);
+			auto i = it;
+			for (size_t j = 0; j < n_merged; j++, ++i) {
+				memcpy(merged.data() + (i->second.block - first) * m_block_size,
+				       i->second.data.data(), i->second.data.size());
+			}
+			data = merged.data();
+		}
+		try {
+			m_apply(first, last - first, data);
+		}
+		catch (std::exception &e) {
+			SMB_LOG(DISK, ERROR, "Cannot apply a journaled write to %s: %s",
+			        m_folder.url().str().c_str(), e.what());
+			lock.lock();
+			if (++n_attempts == MAX_ATTEMPTS) {
+				m_error = std::current_exception();
+				m_cond.notify_all();
+			}
+			m_cond.wait_for(lock, std::chrono::seconds(1));
+			continue;
+		}
+		n_attempts = 0;
+		lock.lock();
+		m_error = nullptr;
+		// Writes appended in the meantime follow the merged ones
+		m_pending.erase(it, std::next(it, n_merged));
+		m_cond.notify_all();
+		if (!m_pending.empty() || m_draining) {
+			continue;
+		}
+
+		// Start over early if the journal is idle, so that it rarely has to
+		// be drained
+		lock.unlock();
+		start_over(false);
+		lock.lock();
+	}
+}
+
+bool Journal::write(uint64_t block, size_t count, const uint8_t *buf)
+{
+	const size_t size = count * m_block_size;
+	if (size > MAX_WRITE) {
+		return false;
+	}
+
+	// While the journal is full, writes bypass it until the background
+	// thread has applied all journaled writes and started over
+	std::lock_guard<std::mutex> lock(m_append_mutex);
+	{
+		std::unique_lock<std::shared_mutex> map_lock(m_mutex);
+		if (m_draining) {
+			return false;
+		}
+		if (m_offs + sizeof(JournalRecord) + size > m_size) {
+			m_draining = true;
+			m_cond.notify_all();
+			return false;
+		}
+	}
+
+	JournalRecord rec{RECORD_MAGIC, uint32_t(count), m_epoch, m_sequence, block,
+	                  0};
+	rec.checksum = record_checksum(rec, buf, size);
+	m_staging.resize(sizeof(rec) + size);
+	memcpy(m_staging.data(), &rec, sizeof(rec));
+	memcpy(m_staging.data() + sizeof(rec), buf, size);
+
+	// A failed append is overwritten by the next one
+	err(m_ctx.lseek(m_file, m_offs, SEEK_SET));
+	m_ctx.write_full(m_file, m_staging.data(), m_staging.size());
+
+	const uint64_t offs = m_offs + sizeof(rec);
+	m_offs += m_staging.size();
+	m_sequence++;
+	{
+		std::unique_lock<std::shared_mutex> map_lock(m_mutex);
+		m_index.assign(block, count, offs, [](uint64_t, uint64_t) {});
+		m_pending.emplace(offs,
+		                  Pending{block, count,
+		                          std::vector<uint8_t>(buf, buf + size)});
+		m_draining = m_offs > HIGH_WATER * m_size;
+	}
+	m_cond.notify_all();
+	return true;
+}
+
+void Journal::read(uint64_t block, size_t count, uint8_t *buf,
+                   const std::function<void()> &read_applied)
+{
+	// Copy the data of unapplied writes before reading; writes that are
+	// applied in the meantime are read from the superblocks
+	std::vector<std::pair<size_t, std::vector<uint8_t>>> overlay;
+	{
+		std::shared_lock<std::shared_mutex> lock(m_mutex);
+		if (!m_pending.empty()) {
+			m_index.lookup(block, count, [&](uint64_t b, uint64_t n,
+			                                 uint64_t offs) {
+				auto it = m_pending.upper_bound(offs);
+				if (offs == ExtentMap::npos || it == m_pending.begin()) {
+					return;
+				}
+				--it;
+				const std::vector<uint8_t> &data = it->second.data;
+				const size_t rel = offs - it->first;
+				if (rel < data.size()) {
+					overlay.emplace_back(
+					    (b - block) * m_block_size,
+					    std::vector<uint8_t>(
+					        data.begin() + rel,
+					        data.begin() + rel + n * m_block_size));
+				}
+			});
+		}
+	}
+	read_applied();
+	for (const std::pair<size_t, std::vector<uint8_t>> &o : overlay) {
+		memcpy(buf + o.first, o.second.data(), o.second.size());
+	}
+}
+
+void Journal::bypass(uint64_t block, size_t count)
+{
+	std::unique_lock<std::shared_mutex> lock(m_mutex);
+	bool journaled = false;
+	m_index.lookup(block, count, [&](uint64_t, uint64_t, uint64_t offs) {
+		journaled = journaled || offs != ExtentMap::npos;
+	});
+	if (!journaled) {
+		return;
+	}
+
+	// Journaled writes to these blocks must not be replayed over this one,
+	// so wait for the next epoch without holding up the append mutex
+	const uint64_t n_resets = m_n_resets;
+	m_draining = true;
+	m_cond.notify_all();
+	m_cond.wait(lock,
+	            [&]() { return m_n_resets != n_resets || m_error; });
+	if (m_n_resets == n_resets) {
+		std::rethrow_exception(m_error);
+	}
+}
@@ -0,0 +1,158 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+
+#include <nbdkit_smb_plugin/context.hpp>
+#include <nbdkit_smb_plugin/extent_map.hpp>
+
+class Folder;
+
+/**
+ * Write-ahead journal for small writes. A small write is acknowledged as soon
+ * as it has been appended to the journal file in the disk folder, which takes
+ * a single SMB write on a dedicated connection. A background thread applies
+ * the journaled writes to the superblocks in order, merging adjacent and
+ * overlapping writes to the same superblock into one; until then, reads are
+ * served from the journaled data, which is also kept in memory.
+ *
+ * Once all writes are applied, the journal starts over with a new epoch.
+ * When the disk is opened, all writes of the current epoch are applied again.
+ */
+class Journal {
+public:
+	// Writes data directly to the superblocks
+	using Apply =
+	    std::function<void(uint64_t block, size_t count, const uint8_t *buf)>;
+
+	// Writes larger than this are not journaled
+	static constexpr size_t MAX_WRITE = 128 * 1024;
+
+private:
+	static constexpr const char *JOURNAL_FILE = "journal.log";
+
+	// Failed attempts to apply a write after which waiting for the journal
+	// fails with the error; the worker keeps retrying in the background
+	static constexpr size_t MAX_ATTEMPTS = 5;
+
+	// Fill level above which writes bypass the journal until the background
+	// thread has applied all journaled writes and started over
+	static constexpr double HIGH_WATER = 0.75;
+
+	struct Pending {
+		uint64_t block;
+		size_t count;
+		std::vector<uint8_t> data;
+	};
+
+	Folder &m_folder;
+	uint64_t m_block_size;
+	uint64_t m_superblock_size;  // In blocks
+	uint64_t m_size;
+	size_t m_merge_size;         // Maximum size of merged writes in bytes
+	Apply m_apply;
+
+	// Serializes appends; the journal is written over a dedicated context
+	std::mutex m_append_mutex;
+	Context m_ctx;
+	File m_file;
+	uint64_t m_epoch;
+	uint64_t m_sequence;
+	uint64_t m_offs;
+	std::vector<uint8_t> m_staging;
+
+	// Journaled blocks of the current epoch and the writes not applied yet,
+	// both by the offset of their data in the journal
+	std::shared_mutex m_mutex;
+	std::condition_variable_any m_cond;
+	ExtentMap m_index;
+	std::map<uint64_t, Pending> m_pending;
+	std::exception_ptr m_error;  // Set while the journal cannot make progress
+
+	// Set while writes bypass the journal so that it can start over, and
+	// number of epochs started so far
+	bool m_draining;
+	uint64_t m_n_resets;
+	bool m_done;
+	std::thread m_thread;
+
+	// Applies the writes of the current epoch and returns the epoch
+	static uint64_t replay(Context &ctx, SMBCFILE *file, const Folder &folder,
+	                       const Apply &apply);
+
+	// Starts a new epoch; the append mutex must be held and all writes must
+	// have been applied
+	void reset();
+
+	// Starts a new epoch once all writes are applied. Unless draining, only
+	// does so if this does not delay appends and the journal is filling up.
+	void start_over(bool draining);
+
+	void worker();
+
+public:
+	/**
+	 * Opens the journal of the given folder and applies the writes left in
+	 * it. The journal file is at most "size" bytes large.
+	 */
+	Journal(Folder &folder, const SMB::Options &options, uint64_t size,
+	        Apply apply);
+
+	// Stops the background thread; unapplied writes remain in the journal
+	~Journal();
+
+	// Applies the writes left in the journal of a disk that is opened without
+	// a journal and deletes the journal file
+	static void recover(ContextPool &pool, Folder &folder,
+	                    const SMB::Options &options, const Apply &apply);
+
+	// Applies all writes and empties the journal; must be called on clean
+	// shutdown
+	void close();
+
+	// Waits until all journaled writes have been applied. Throws the error
+	// of a write that repeatedly failed to apply.
+	void drain();
+
+	// Journals a write. Returns false if the write is too large or the
+	// journal is full, in which case the write must bypass the journal.
+	bool write(uint64_t block, size_t count, const uint8_t *buf);
+
+	/**
+	 * Reads blocks using the given function and replaces the data of blocks
+	 * whose journaled writes have not been applied yet.
+	 */
+	void read(uint64_t block, size_t count, uint8_t *buf,
+	          const std::function<void()> &read_applied);
+
+	// Must be called before blocks are written bypassing the journal. If
+	// they were journaled, waits until the journal has started over, so that
+	// these writes can no longer be replayed; other writes are not delayed.
+	void bypass(uint64_t block, size_t count);
+};
@@ -0,0 +1,186 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <stdexcept>
+
+#include <nbdkit_smb_plugin/layout.hpp>
+
+static constexpr unsigned int N_DIGITS = 16;  // Hex digits in a 64-bit index
+
+static const char EXT[] = ".img";
+static constexpr size_t EXT_LEN = sizeof(EXT) - 1;
+
+static char nibble_to_hex(uint8_t x)
+{
+	return x < 10 ? ('0' + x) : ('a' + (x - 10));
+}
+
+static int hex_to_nibble(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+// Writes the n lowest hex digits of x to s, most significant digit first
+static void format_hex(uint64_t x, unsigned int n, char *s)
+{
+	for (unsigned int i = 0; i < n; i++) {
+		s[n - i - 1] = nibble_to_hex((x >> (4 * i)) & 0x0F);
+	}
+}
+
+static bool parse_hex(const char *s, unsigned int n, uint64_t &x)
+{
+	x = 0;
+	for (unsigned int i = 0; i < n; i++) {
+		const int v = hex_to_nibble(s[i]);
+		if (v < 0) {
+			return false;
+		}
+		x = (x << 4) | uint64_t(v);
+	}
+	return true;
+}
+
+Layout Layout::legacy()
+{
+	Layout res(1, 4096);
+	res.m_legacy = true;
+	return res;
+}
+
+Layout Layout::for_disk(size_t n_superblocks, unsigned int fanout)
+{
+	unsigned int depth = 1;
+	size_t n_leaf_dirs = fanout;
+	while ((depth < MAX_DEPTH) && (n_superblocks / n_leaf_dirs > fanout)) {
+		depth++;
+		n_leaf_dirs *= fanout;
+	}
+	return Layout(depth, fanout);
+}
+
+Layout::Layout(unsigned int depth, unsigned int fanout)
+    : m_legacy(false), m_depth(depth), m_digits(0)
+{
+	switch (fanout) {
+		case 16:
+			m_digits = 1;
+			break;
+		case 256:
+			m_digits = 2;
+			break;
+		case 4096:
+			m_digits = 3;
+			break;
+		default:
+			throw std::invalid_argument("fanout must be one of 16, 256, 4096");
+	}
+	if ((depth < 1) || (depth > MAX_DEPTH)) {
+		throw std::invalid_argument("depth must be between 1 and 3");
+	}
+}
+
+size_t Layout::name_length() const
+{
+	if (m_legacy) {
+		return N_DIGITS + 1 + EXT_LEN;
+	}
+	return N_DIGITS + m_depth + EXT_LEN;
+}
+
+size_t Layout::dir_length(unsigned int level) const
+{
+	if (m_legacy) {
+		return 3;
+	}
+	return (level + 1) * (m_digits + 1) - 1;
+}
+
+void Layout::format(uint64_t superblock, char *s) const
+{
+	if (m_legacy) {
+		for (size_t i = 0; i < 8; i++) {
+			(*s++) = nibble_to_hex(((superblock >> (8 * i)) & 0x0F) >> 0);
+			if (i == 1) {
+				(*s++) = '/';
+			}
+			(*s++) = nibble_to_hex(((superblock >> (8 * i)) & 0xF0) >> 4);
+		}
+	}
+	else {
+		const unsigned int bits = 4 * m_digits;
+		for (unsigned int i = 0; i < m_depth; i++) {
+			format_hex(superblock >> (bits * i), m_digits, s);
+			s += m_digits;
+			(*s++) = '/';
+		}
+		const unsigned int n_file_digits = N_DIGITS - m_depth * m_digits;
+		format_hex(superblock >> (bits * m_depth), n_file_digits, s);
+		s += n_file_digits;
+	}
+	std::memcpy(s, EXT, EXT_LEN);
+}
+
+bool Layout::parse(const char *s, size_t len, uint64_t &superblock) const
+{
+	if ((len != name_length()) ||
+	    (std::memcmp(s + len - EXT_LEN, EXT, EXT_LEN) != 0)) {
+		return false;
+	}
+
+	superblock = 0;
+	if (m_legacy) {
+		if (s[3] != '/') {
+			return false;
+		}
+		for (size_t i = 0, j = 0; i < N_DIGITS; i++, j++) {
+			if (j == 3) {
+				j++;  // Skip the slash
+			}
+			const int v = hex_to_nibble(s[j]);
+			if (v < 0) {
+				return false;
+			}
+			superblock |= uint64_t(v) << (4 * i);
+		}
+		return true;
+	}
+
+	const unsigned int bits = 4 * m_digits;
+	for (unsigned int i = 0; i < m_depth; i++) {
+		uint64_t x;
+		if (!parse_hex(s, m_digits, x) || (s[m_digits] != '/')) {
+			return false;
+		}
+		superblock |= x << (bits * i);
+		s += m_digits + 1;
+	}
+	uint64_t x;
+	if (!parse_hex(s, N_DIGITS - m_depth * m_digits, x)) {
+		return false;
+	}
+	superblock |= x << (bits * m_depth);
+	return true;
+}
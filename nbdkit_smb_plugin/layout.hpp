@@ -0,0 +1,82 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Describes how superblock indices are mapped onto file names relative to the
+ * disk folder. Superblocks are spread over a hierarchy of "depth" directory
+ * levels, each of which has at most "fanout" entries. The lowest-order digits
+ * of the superblock index select the directories, so consecutive superblocks
+ * end up in different directories.
+ *
+ * The legacy layout is the original fixed two-level layout, in which the
+ * first three (nibble-swapped) hex digits select the directory and the
+ * remaining thirteen digits form the file name.
+ */
+class Layout {
+private:
+	bool m_legacy;
+	unsigned int m_depth;
+	unsigned int m_digits;  // Hex digits per directory level
+
+public:
+	// Default fan-out used for new disks
+	static constexpr unsigned int DEFAULT_FANOUT = 256;
+
+	// Maximum number of directory levels
+	static constexpr unsigned int MAX_DEPTH = 3;
+
+	static Layout legacy();
+
+	/**
+	 * Chooses the smallest depth for which no directory holds more than
+	 * "fanout" entries on a disk with the given number of superblocks.
+	 */
+	static Layout for_disk(size_t n_superblocks,
+	                       unsigned int fanout = DEFAULT_FANOUT);
+
+	Layout(unsigned int depth, unsigned int fanout = DEFAULT_FANOUT);
+
+	bool is_legacy() const { return m_legacy; }
+	unsigned int depth() const { return m_depth; }
+	unsigned int fanout() const { return 1U << (4 * m_digits); }
+
+	// Length of the relative file name, including slashes and extension
+	size_t name_length() const;
+
+	// Offset of the slash terminating the given directory level
+	size_t dir_length(unsigned int level) const;
+
+	// Writes the name_length() characters of the superblock file name to s
+	void format(uint64_t superblock, char *s) const;
+
+	// Inverse of format(); returns false if s is not a superblock file name
+	bool parse(const char *s, size_t len, uint64_t &superblock) const;
+
+	bool operator==(const Layout &o) const
+	{
+		return (m_legacy == o.m_legacy) && (m_depth == o.m_depth) &&
+		       (m_digits == o.m_digits);
+	}
+	bool operator!=(const Layout &o) const { return !(*this == o); }
+};
@@ -0,0 +1,309 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <signal.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include <nbdkit_smb_plugin/log.hpp>
+
+static const char *SUBSYSTEM_NAMES[Log::N_SUBSYSTEMS] = {
+    "smbclient", "io", "disk", "prealloc", "memory"};
+static const char *LEVEL_NAMES[] = {"none", "error", "warning",
+                                    "info", "debug", "trace"};
+
+/******************************************************************************
+ * Class Logger                                                               *
+ ******************************************************************************/
+
+namespace {
+/**
+ * Bounded multi-producer, single-consumer ring of fixed-size messages. Each
+ * slot carries a sequence number telling whether it is free for the producer
+ * at that position or filled for the consumer.
+ */
+class Logger {
+private:
+	static constexpr size_t CAPACITY = 1024;  // Must be a power of two
+	static constexpr size_t MSG_SIZE = 240;
+
+	struct Entry {
+		std::atomic<size_t> seq;
+		uint8_t subsystem;
+		uint8_t level;
+		char msg[MSG_SIZE];
+	};
+
+	std::unique_ptr<Entry[]> m_entries;
+	alignas(64) std::atomic<size_t> m_head;
+	alignas(64) std::atomic<size_t> m_dropped;
+	size_t m_tail;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_done;
+	std::thread m_thread;
+
+	bool pop(std::string &out)
+	{
+		Entry &e = m_entries[m_tail & (CAPACITY - 1)];
+		if (e.seq.load(std::memory_order_acquire) != m_tail + 1) {
+			return false;
+		}
+		out += "nbdkit-smb: ";
+		out += SUBSYSTEM_NAMES[e.subsystem];
+		out += ": ";
+		out += LEVEL_NAMES[e.level];
+		out += ": ";
+		out += e.msg;
+		out += '\n';
+		e.seq.store(m_tail + CAPACITY, std::memory_order_release);
+		m_tail++;
+		return true;
+	}
+
+	void drain()
+	{
+		std::string out;
+		while (pop(out)) {
+		}
+		const size_t dropped = m_dropped.exchange(0);
+		if (dropped > 0) {
+			out += "nbdkit-smb: " + std::to_string(dropped) +
+			       " log messages dropped\n";
+		}
+		if (!out.empty()) {
+			fwrite(out.data(), 1, out.size(), stderr);
+			fflush(stderr);
+		}
+	}
+
+	void worker()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (!m_done) {
+			m_cond.wait_for(lock, std::chrono::milliseconds(50));
+			lock.unlock();
+			drain();
+			lock.lock();
+		}
+	}
+
+public:
+	Logger()
+	    : m_entries(new Entry[CAPACITY]),
+	      m_head(0),
+	      m_dropped(0),
+	      m_tail(0),
+	      m_done(false)
+	{
+		for (size_t i = 0; i < CAPACITY; i++) {
+			m_entries[i].seq.store(i, std::memory_order_relaxed);
+		}
+		m_thread = std::thread([this]() { worker(); });
+	}
+
+	// Writes out the remaining messages
+	~Logger()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_done = true;
+		}
+		m_cond.notify_all();
+		m_thread.join();
+		drain();
+	}
+
+	void push(Log::Subsystem subsystem, Log::Level level, const char *fmt,
+	          va_list ap)
+	{
+		// Claim a slot
+		size_t pos = m_head.load(std::memory_order_relaxed);
+		Entry *e;
+		while (true) {
+			e = &m_entries[pos & (CAPACITY - 1)];
+			const intptr_t diff =
+			    intptr_t(e->seq.load(std::memory_order_acquire)) -
+			    intptr_t(pos);
+			if (diff == 0) {
+				if (m_head.compare_exchange_weak(pos, pos + 1,
+				                                 std::memory_order_relaxed)) {
+					break;
+				}
+			}
+			else if (diff < 0) {
+				m_dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			else {
+				pos = m_head.load(std::memory_order_relaxed);
+			}
+		}
+
+		e->subsystem = subsystem;
+		e->level = level;
+		vsnprintf(e->msg, MSG_SIZE, fmt, ap);
+
+		// Strip the trailing newline of libsmbclient messages
+		size_t len = strlen(e->msg);
+		while (len > 0 && e->msg[len - 1] == '\n') {
+			e->msg[--len] = '\0';
+		}
+		e->seq.store(pos + 1, std::memory_order_release);
+	}
+};
+
+// The logger thread is only started once the first message is written
+Logger &logger()
+{
+	static Logger logger;
+	return logger;
+}
+}  // namespace
+
+/******************************************************************************
+ * Class Log                                                                  *
+ ******************************************************************************/
+
+std::atomic<int> Log::s_levels[N_SUBSYSTEMS] = {
+    {Log::ERROR}, {Log::ERROR}, {Log::ERROR}, {Log::ERROR}, {Log::ERROR}};
+std::atomic<int> Log::s_configured[N_SUBSYSTEMS] = {
+    {Log::ERROR}, {Log::ERROR}, {Log::ERROR}, {Log::ERROR}, {Log::ERROR}};
+std::atomic<unsigned int> Log::s_generation{0};
+
+void Log::write(Subsystem subsystem, Level level, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	logger().push(subsystem, level, fmt, ap);
+	va_end(ap);
+}
+
+static int parse_level(const std::string &value)
+{
+	for (int i = Log::NONE; i <= Log::TRACE; i++) {
+		if (value == LEVEL_NAMES[i] || value == std::to_string(i)) {
+			return i;
+		}
+	}
+	throw std::invalid_argument("invalid log level '" + value + "'");
+}
+
+void Log::parse(const std::string &spec, int levels[N_SUBSYSTEMS])
+{
+	size_t start = 0;
+	while (start <= spec.size()) {
+		size_t end = spec.find(',', start);
+		if (end == std::string::npos) {
+			end = spec.size();
+		}
+		const std::string item = spec.substr(start, end - start);
+		const size_t colon = item.find(':');
+		if (colon == std::string::npos) {
+			const int level = parse_level(item);
+			for (int i = 0; i < N_SUBSYSTEMS; i++) {
+				levels[i] = level;
+			}
+		}
+		else {
+			const std::string name = item.substr(0, colon);
+			int i = 0;
+			while (i < N_SUBSYSTEMS && name != SUBSYSTEM_NAMES[i]) {
+				i++;
+			}
+			if (i == N_SUBSYSTEMS) {
+				throw std::invalid_argument("unknown log subsystem '" + name +
+				                            "'");
+			}
+			levels[i] = parse_level(item.substr(colon + 1));
+		}
+		start = end + 1;
+	}
+}
+
+void Log::configure(const std::string &spec)
+{
+	int levels[N_SUBSYSTEMS];
+	for (int i = 0; i < N_SUBSYSTEMS; i++) {
+		levels[i] = s_configured[i].load();
+	}
+	parse(spec, levels);
+	for (int i = 0; i < N_SUBSYSTEMS; i++) {
+		s_configured[i].store(levels[i]);
+		s_levels[i].store(levels[i]);
+	}
+	s_generation++;
+}
+
+void Log::validate(const std::string &spec)
+{
+	int levels[N_SUBSYSTEMS];
+	parse(spec, levels);
+}
+
+int Log::smbclient_debug_level()
+{
+	static const int DEBUG_LEVELS[] = {0, 0, 1, 3, 6, 10};
+	return DEBUG_LEVELS[s_levels[SMBCLIENT].load(std::memory_order_relaxed)];
+}
+
+// Only touches lock-free atomics and is thus async-signal-safe
+void Log::on_signal(int sig)
+{
+	for (int i = 0; i < N_SUBSYSTEMS; i++) {
+		if (sig == SIGUSR1) {
+			const int level = s_levels[i].load();
+			if (level < TRACE) {
+				s_levels[i].store(level + 1);
+			}
+		}
+		else {
+			s_levels[i].store(s_configured[i].load());
+		}
+	}
+	s_generation++;
+}
+
+void Log::install_signal_handlers()
+{
+	static std::once_flag once;
+	std::call_once(once, []() {
+		for (int sig : {SIGUSR1, SIGUSR2}) {
+			struct sigaction old;
+			if (sigaction(sig, nullptr, &old) < 0 || old.sa_handler != SIG_DFL) {
+				continue;
+			}
+			struct sigaction sa;
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_handler = on_signal;
+			sa.sa_flags = SA_RESTART;
+			sigemptyset(&sa.sa_mask);
+			sigaction(sig, &sa, nullptr);
+		}
+	});
+}
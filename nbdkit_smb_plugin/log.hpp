@@ -0,0 +1,86 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+
+/**
+ * Process-wide logger. Messages are formatted into a fixed-size lock-free ring
+ * buffer and written to stderr by a background thread, so that logging never
+ * blocks the I/O path; messages are dropped while the ring is full.
+ *
+ * The verbosity is set per subsystem. A disabled message costs a single
+ * relaxed atomic load when using SMB_LOG, which does not evaluate the
+ * arguments either. SIGUSR1 increases the verbosity of all subsystems by one
+ * level, SIGUSR2 restores the configured levels.
+ */
+class Log {
+public:
+	enum Subsystem { SMBCLIENT, IO, DISK, PREALLOC, MEMORY, N_SUBSYSTEMS };
+	enum Level { NONE, ERROR, WARNING, INFO, DEBUG, TRACE };
+
+private:
+	static std::atomic<int> s_levels[N_SUBSYSTEMS];
+	static std::atomic<int> s_configured[N_SUBSYSTEMS];
+	static std::atomic<unsigned int> s_generation;
+
+	static void parse(const std::string &spec, int levels[N_SUBSYSTEMS]);
+	static void on_signal(int sig);
+
+public:
+	static bool enabled(Subsystem subsystem, Level level)
+	{
+		return int(level) <=
+		       s_levels[subsystem].load(std::memory_order_relaxed);
+	}
+
+	static void write(Subsystem subsystem, Level level, const char *fmt, ...)
+	    __attribute__((format(printf, 3, 4)));
+
+	/**
+	 * Sets the verbosity from a comma-separated list of levels, each either
+	 * applying to all subsystems ("debug") or to a single one ("io:trace").
+	 * Levels are none, error, warning, info, debug and trace, or 0 to 5. The
+	 * default is "error".
+	 */
+	static void configure(const std::string &spec);
+
+	// Throws std::invalid_argument if the specification is malformed
+	static void validate(const std::string &spec);
+
+	// Incremented whenever the verbosity changes
+	static unsigned int generation()
+	{
+		return s_generation.load(std::memory_order_relaxed);
+	}
+
+	// libsmbclient debug level corresponding to the SMBCLIENT verbosity
+	static int smbclient_debug_level();
+
+	// Installs the SIGUSR1/SIGUSR2 handlers unless the signals are in use
+	static void install_signal_handlers();
+};
+
+#define SMB_LOG(subsystem, level, ...)                           \
+	do {                                                         \
+		if (Log::enabled(Log::subsystem, Log::level)) {          \
+			Log::write(Log::subsystem, Log::level, __VA_ARGS__); \
+		}                                                        \
+	} while (0)
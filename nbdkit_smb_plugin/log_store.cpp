@@ -0,0 +1,521 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <stdexcept>
+
+#include <nbdkit_smb_plugin/checksum.hpp>
+#include <nbdkit_smb_plugin/folder.hpp>
+#include <nbdkit_smb_plugin/log.hpp>
+#include <nbdkit_smb_plugin/log_store.hpp>
+
+// Header of each record in a segment, followed by the data of the record
+struct LogRecord {
+	uint32_t magic;
+	uint32_t flags;
+	uint64_t sequence;  // Consecutive over all segments
+	uint64_t block;
+	uint32_t count;
+	uint32_t checksum;  // Of the header and the data
+};
+
+static_assert(sizeof(LogRecord) == 32, "unexpected LogRecord size");
+
+static constexpr uint32_t RECORD_MAGIC = 0x524c4d53;
+static constexpr uint32_t RECORD_UNMAP = 1;  // The record carries no data
+
+struct CheckpointHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_size;
+	uint64_t segment_size;
+	uint64_t generation;
+	uint64_t sequence;  // Sequence number of the next record
+	uint64_t head_segment;  // Position at which the replay starts
+	uint64_t head_offs;
+	uint64_t n_extents;
+	uint64_t checksum;
+};
+
+static const char CHECKPOINT_MAGIC[8] = {'N', 'B', 'D', 'S', 'M', 'B', 'L', 'C'};
+
+// Checkpoints alternate between two files, so that a torn checkpoint never
+// destroys the previous one
+static const char *CHECKPOINT_FILES[2] = {"log.0.idx", "log.1.idx"};
+
+static const char *SEGMENT_DIR = "segments/";
+
+static uint32_t record_checksum(LogRecord rec, const uint8_t *data,
+                                size_t size)
+{
+	rec.checksum = 0;
+	const uint64_t h = checksum(data, size, checksum(&rec, sizeof(rec)));
+	return uint32_t(h ^ (h >> 32));
+}
+
+/******************************************************************************
+ * Class LogStore                                                             *
+ ******************************************************************************/
+
+LogStore::LogStore(ContextPool &pool, Folder &folder,
+                   const SMB::Options &options)
+    : m_pool(pool),
+      m_folder(folder),
+      m_block_size(folder.block_size()),
+      m_ctx(folder.url(), options),
+      m_head(0),
+      m_head_offs(0),
+      m_next_segment(0),
+      m_sequence(0),
+      m_new_segments(0),
+      m_map(m_block_size),
+      m_n_checkpoints(0),
+      m_done(false)
+{
+	load(*m_pool.acquire());
+	m_gc_thread = std::thread([this]() { collector(); });
+}
+
+LogStore::~LogStore()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_gc_mutex);
+		m_done = true;
+	}
+	m_gc_cond.notify_all();
+	if (m_gc_thread.joinable()) {
+		m_gc_thread.join();
+	}
+}
+
+void LogStore::close()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_gc_mutex);
+		m_done = true;
+	}
+	m_gc_cond.notify_all();
+	if (m_gc_thread.joinable()) {
+		m_gc_thread.join();
+	}
+	checkpoint(*m_pool.acquire());
+}
+
+std::string LogStore::segment_path(uint64_t segment) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.seg", (unsigned long long)segment);
+	return m_folder.url().str() + SEGMENT_DIR + name;
+}
+
+void LogStore::load(Context &ctx)
+{
+	// Find the existing segments
+	std::vector<std::string> files, dirs;
+	if (!m_folder.list_dir(ctx, SEGMENT_DIR, files, dirs)) {
+		err(ctx.mkdir((m_folder.url().str() + SEGMENT_DIR).c_str(), 0770));
+	}
+	std::set<uint64_t> segments;
+	for (const std::string &name : files) {
+		char *end;
+		const uint64_t segment = strtoull(name.c_str(), &end, 16);
+		if (end == name.c_str() + 16 && strcmp(end, ".seg") == 0) {
+			segments.insert(segment);
+			m_live[segment] = 0;
+			m_next_segment = std::max(m_next_segment, segment + 1);
+		}
+	}
+
+	uint64_t segment = 0, offs = 0;
+	if (!load_checkpoint(ctx, segment, offs) && !segments.empty()) {
+		throw std::runtime_error("Missing checkpoint of the log-structured disk");
+	}
+	if (m_live.size() != segments.size()) {
+		throw std::runtime_error("Missing segment of the log-structured disk");
+	}
+	replay(ctx, segment, offs);
+
+	// New records are appended to a new segment; the checkpoint makes sure
+	// that a later replay starts there and not at a torn record
+	m_head = m_next_segment;
+	checkpoint(ctx);
+	SMB_LOG(DISK, INFO, "Opened log of %s: %zu segments, %zu extents",
+	        m_folder.url().str().c_str(), m_live.size(), m_map.size());
+}
+
+// Loads the most recent valid checkpoint. Returns the position at which the
+// replay starts.
+bool LogStore::load_checkpoint(Context &ctx, uint64_t &segment, uint64_t &offs)
+{
+	std::string best;
+	CheckpointHeader best_hdr{};
+	for (const char *name : CHECKPOINT_FILES) {
+		std::string data;
+		if (!m_folder.read_file(ctx, name, data)) {
+			continue;
+		}
+		CheckpointHeader hdr;
+		if (!read_header(data, hdr) ||
+		    memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 ||
+		    hdr.version != 1 ||
+		    data.size() !=
+		        sizeof(hdr) + hdr.n_extents * sizeof(ExtentMap::Extent)) {
+			SMB_LOG(DISK, WARNING, "Ignoring invalid %s in %s", name,
+			        m_folder.url().str().c_str());
+			continue;
+		}
+		if (hdr.block_size != m_block_size || hdr.segment_size != SEGMENT_SIZE) {
+			throw std::runtime_error(
+			    "Log was written with a different block or segment size");
+		}
+		if (best.empty() || hdr.generation > best_hdr.generation) {
+			best = std::move(data);
+			best_hdr = hdr;
+		}
+	}
+	if (best.empty()) {
+		return false;
+	}
+
+	for (size_t i = 0; i < best_hdr.n_extents; i++) {
+		ExtentMap::Extent e;
+		memcpy(&e, best.data() + sizeof(best_hdr) + i * sizeof(e), sizeof(e));
+		map(e.block, e.count, e.addr);
+	}
+	m_n_checkpoints = best_hdr.generation + 1;
+	m_sequence = best_hdr.sequence;
+	segment = best_hdr.head_segment;
+	offs = best_hdr.head_offs;
+	return true;
+}
+
+// Applies the records appended after the checkpoint. The replay ends at the
+// first record that is torn or out of sequence.
+void LogStore::replay(Context &ctx, uint64_t segment, uint64_t offs)
+{
+	std::vector<uint8_t> data;
+	size_t n_records = 0;
+	for (bool first = true; m_live.count(segment); segment++, offs = 0) {
+		File file(ctx, segment_path(segment).c_str(), O_RDONLY, 0);
+		if (!file) {
+			err(-1);
+		}
+		err(ctx.lseek(file, offs, SEEK_SET));
+		size_t n = 0;
+		while (true) {
+			LogRecord rec;
+			if (ctx.read_full(file, reinterpret_cast<uint8_t *>(&rec),
+			                  sizeof(rec)) < sizeof(rec) ||
+			    rec.magic != RECORD_MAGIC || rec.sequence != m_sequence) {
+				break;
+			}
+			const size_t size =
+			    (rec.flags & RECORD_UNMAP) ? 0 : rec.count * m_block_size;
+			if (size > MAX_RECORD_SIZE) {
+				break;
+			}
+			data.resize(size);
+			if (ctx.read_full(file, data.data(), size) < size ||
+			    record_checksum(rec, data.data(), size) != rec.checksum) {
+				break;
+			}
+			map(rec.block, rec.count,
+			    size ? segment * SEGMENT_SIZE + offs + sizeof(rec)
+			         : ExtentMap::npos);
+			offs += sizeof(rec) + size;
+			m_sequence++;
+			n++;
+		}
+		n_records += n;
+		if (n == 0 && !first) {
+			break;
+		}
+		first = false;
+	}
+	if (n_records > 0) {
+		SMB_LOG(DISK, INFO, "Replayed %zu log records of %s", n_records,
+		        m_folder.url().str().c_str());
+	}
+}
+
+void LogStore::map(uint64_t block, uint64_t count, uint64_t addr)
+{
+	m_map.assign(block, count, addr, [this](uint64_t old, uint64_t n) {
+		m_live[old / SEGMENT_SIZE] -= n * m_block_size;
+	});
+	if (addr != ExtentMap::npos) {
+		m_live[addr / SEGMENT_SIZE] += count * m_block_size;
+	}
+}
+
+bool LogStore::append(uint64_t block, size_t count, const uint8_t *data)
+{
+	const size_t size = data ? count * m_block_size : 0;
+	bool rolled = false;
+	if (!m_head_file || m_head_offs + sizeof(LogRecord) + size > SEGMENT_SIZE) {
+		roll();
+		rolled = true;
+	}
+
+	LogRecord rec{RECORD_MAGIC, data ? 0 : RECORD_UNMAP, m_sequence, block,
+	              uint32_t(count), 0};
+	rec.checksum = record_checksum(rec, data, size);
+	m_staging.resize(sizeof(rec) + size);
+	memcpy(m_staging.data(), &rec, sizeof(rec));
+	if (size) {
+		memcpy(m_staging.data() + sizeof(rec), data, size);
+	}
+
+	// A failed append is overwritten by the next one
+	err(m_ctx.lseek(m_head_file, m_head_offs, SEEK_SET));
+	m_ctx.write_full(m_head_file, m_staging.data(), m_staging.size());
+
+	const uint64_t addr = m_head * SEGMENT_SIZE + m_head_offs + sizeof(rec);
+	m_head_offs += m_staging.size();
+	m_sequence++;
+	{
+		std::lock_guard<std::mutex> lock(m_map_mutex);
+		map(block, count, size ? addr : ExtentMap::npos);
+	}
+	return rolled && ++m_new_segments >= CHECKPOINT_SEGMENTS;
+}
+
+void LogStore::roll()
+{
+	const uint64_t segment = m_next_segment;
+	File file(m_ctx, segment_path(segment).c_str(), O_CREAT | O_WRONLY | O_TRUNC,
+	          0660);
+	if (!file) {
+		err(-1);
+	}
+	m_head_file = std::move(file);
+	m_next_segment++;
+	m_head = segment;
+	m_head_offs = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_map_mutex);
+		m_live.emplace(segment, 0);
+	}
+
+	// The previous head may now be compacted
+	m_gc_cond.notify_one();
+}
+
+void LogStore::checkpoint(Context &ctx)
+{
+	std::lock_guard<std::mutex> lock(m_checkpoint_mutex);
+	CheckpointHeader hdr;
+	std::string data;
+	{
+		std::lock_guard<std::mutex> append_lock(m_append_mutex);
+		std::lock_guard<std::mutex> map_lock(m_map_mutex);
+		memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+		hdr.version = 1;
+		hdr.block_size = m_block_size;
+		hdr.segment_size = SEGMENT_SIZE;
+		hdr.generation = m_n_checkpoints;
+		hdr.sequence = m_sequence;
+
+		// Without an open head segment, the next record starts a new segment
+		hdr.head_segment = m_head_file ? m_head.load() : m_next_segment;
+		hdr.head_offs = m_head_file ? m_head_offs : 0;
+		hdr.n_extents = m_map.size();
+		data.resize(sizeof(hdr) + m_map.size() * sizeof(ExtentMap::Extent));
+		size_t offs = sizeof(hdr);
+		m_map.for_each([&](const ExtentMap::Extent &e) {
+			memcpy(&data[offs], &e, sizeof(e));
+			offs += sizeof(e);
+		});
+		m_new_segments = 0;
+	}
+	write_header(data, hdr);
+	m_folder.write_file(ctx, CHECKPOINT_FILES[m_n_checkpoints % 2], data);
+	m_n_checkpoints++;
+}
+
+void LogStore::collector()
+{
+	IOClassScope scope(IOClass::BACKGROUND);
+	std::unique_lock<std::mutex> lock(m_gc_mutex);
+	while (!m_done) {
+		m_gc_cond.wait_for(lock, std::chrono::seconds(1));
+		lock.unlock();
+		try {
+			while (!m_done && collect()) {
+			}
+		}
+		catch (std::exception &e) {
+			SMB_LOG(DISK, ERROR, "Cannot compact the log of %s: %s",
+			        m_folder.url().str().c_str(), e.what());
+		}
+		lock.lock();
+	}
+}
+
+// Compacts the segment with the least live data if it is below the threshold.
+// Returns false if there is nothing to compact.
+bool LogStore::collect()
+{
+	uint64_t victim = 0, live = SEGMENT_SIZE;
+	std::vector<ExtentMap::Extent> extents;
+	{
+		std::lock_guard<std::mutex> lock(m_map_mutex);
+		for (const std::pair<const uint64_t, uint64_t> &s : m_live) {
+			if (s.first < m_head && s.second < live) {
+				victim = s.first;
+				live = s.second;
+			}
+		}
+		if (live >= GC_THRESHOLD * SEGMENT_SIZE) {
+			return false;
+		}
+		m_map.for_each([&](const ExtentMap::Extent &e) {
+			if (e.addr / SEGMENT_SIZE == victim) {
+				extents.push_back(e);
+			}
+		});
+	}
+
+	ContextPool::Lease ctx = m_pool.acquire();
+	if (!extents.empty()) {
+		std::vector<uint8_t> data;
+		{
+			File file(*ctx, segment_path(victim).c_str(), O_RDONLY, 0);
+			if (!file) {
+				err(-1);
+			}
+			struct stat st;
+			err(ctx->fstat(file, &st));
+			data.resize(st.st_size);
+			ctx->read_full(file, data.data(), data.size());
+		}
+
+		// Append the data that was not overwritten in the meantime again
+		const uint64_t max_blocks = MAX_RECORD_SIZE / m_block_size;
+		const uint64_t base = victim * SEGMENT_SIZE;
+		for (const ExtentMap::Extent &e : extents) {
+			std::lock_guard<std::mutex> lock(m_append_mutex);
+			std::vector<ExtentMap::Extent> parts;
+			{
+				std::lock_guard<std::mutex> map_lock(m_map_mutex);
+				m_map.lookup(e.block, e.count,
+				             [&](uint64_t b, uint64_t n, uint64_t a) {
+					             if (a == e.addr + (b - e.block) * m_block_size) {
+						             parts.push_back(ExtentMap::Extent{b, n, a});
+					             }
+				             });
+			}
+			for (const ExtentMap::Extent &p : parts) {
+				if (p.addr - base + p.count * m_block_size > data.size()) {
+					throw std::runtime_error("Truncated log segment");
+				}
+				for (uint64_t i = 0; i < p.count; i += max_blocks) {
+					const uint64_t n = std::min(max_blocks, p.count - i);
+					append(p.block + i, n, &data[p.addr - base + i * m_block_size]);
+				}
+			}
+		}
+	}
+
+	// The segment may only be deleted once no checkpoint refers to it
+	{
+		std::lock_guard<std::mutex> lock(m_map_mutex);
+		if (m_live[victim] != 0) {
+			SMB_LOG(DISK, ERROR, "Log segment %llx still has %llu live bytes",
+			        (unsigned long long)victim,
+			        (unsigned long long)m_live[victim]);
+			return false;
+		}
+	}
+	checkpoint(*ctx);
+	{
+		std::unique_lock<std::shared_mutex> lock(m_delete_mutex);
+		if (ctx->unlink(segment_path(victim).c_str()) < 0 && errno != ENOENT) {
+			err(-1);
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_map_mutex);
+		m_live.erase(victim);
+	}
+	SMB_LOG(DISK, DEBUG, "Compacted log segment %llx with %llu live bytes",
+	        (unsigned long long)victim, (unsigned long long)live);
+	return true;
+}
+
+void LogStore::read(uint64_t block, size_t count, uint8_t *buf)
+{
+	// The collector holds a context while it waits to delete a segment, so
+	// the context must be acquired first
+	ContextPool::Lease ctx = m_pool.acquire();
+	std::shared_lock<std::shared_mutex> lock(m_delete_mutex);
+	std::vector<ExtentMap::Extent> parts;
+	bool mapped = false;
+	{
+		std::lock_guard<std::mutex> map_lock(m_map_mutex);
+		m_map.lookup(block, count, [&](uint64_t b, uint64_t n, uint64_t a) {
+			parts.push_back(ExtentMap::Extent{b, n, a});
+			mapped = mapped || a != ExtentMap::npos;
+		});
+	}
+	if (!mapped) {
+		memset(buf, 0, count * m_block_size);
+		return;
+	}
+
+	File file;
+	uint64_t file_segment = ExtentMap::npos;
+	for (const ExtentMap::Extent &p : parts) {
+		uint8_t *dst = buf + (p.block - block) * m_block_size;
+		const size_t size = p.count * m_block_size;
+		if (p.addr == ExtentMap::npos) {
+			memset(dst, 0, size);
+			continue;
+		}
+		const uint64_t segment = p.addr / SEGMENT_SIZE;
+		if (segment != file_segment) {
+			file = File(*ctx, segment_path(segment).c_str(), O_RDONLY, 0);
+			if (!file) {
+				err(-1);
+			}
+			file_segment = segment;
+		}
+		err(ctx->lseek(file, p.addr % SEGMENT_SIZE, SEEK_SET));
+		ctx->read_full(file, dst, size);
+	}
+}
+
+void LogStore::write(uint64_t block, size_t count, const uint8_t *buf)
+{
+	const size_t max_blocks = MAX_RECORD_SIZE / m_block_size;
+	bool due = false;
+	{
+		std::lock_guard<std::mutex> lock(m_append_mutex);
+		for (size_t i = 0; i < count; i += max_blocks) {
+			const size_t n = std::min(max_blocks, count - i);
+			due |= append(block + i, n, buf ? buf + i * m_block_size : nullptr);
+		}
+	}
+	if (due) {
+		checkpoint(*m_pool.acquire());
+	}
+}
@@ -0,0 +1,127 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <nbdkit_smb_plugin/context.hpp>
+#include <nbdkit_smb_plugin/extent_map.hpp>
+
+class Folder;
+
+/**
+ * Log-structured disk layout. Instead of being written in place into
+ * superblock files, writes are appended as records to large segment files,
+ * so that random writes become sequential appends over a single connection.
+ * An extent map records the location of the most recent data of each block.
+ *
+ * The map is checkpointed to the disk folder regularly and on close; after a
+ * crash, the records appended since the last checkpoint are replayed. A
+ * background thread compacts segments with little live data by appending
+ * their live data to the log again and deleting them.
+ */
+class LogStore {
+private:
+	static constexpr uint64_t SEGMENT_SIZE = 64 * 1024 * 1024;
+
+	// Maximum amount of data in a single record
+	static constexpr size_t MAX_RECORD_SIZE = 4 * 1024 * 1024;
+
+	// Number of new segments after which a checkpoint is written
+	static constexpr size_t CHECKPOINT_SEGMENTS = 4;
+
+	// Segments in which less than this fraction of the data is live are
+	// compacted
+	static constexpr double GC_THRESHOLD = 0.5;
+
+	ContextPool &m_pool;
+	Folder &m_folder;
+	uint64_t m_block_size;
+
+	// Serializes appends to the head segment, which is written over a
+	// dedicated context
+	std::mutex m_append_mutex;
+	Context m_ctx;
+	File m_head_file;
+	std::atomic<uint64_t> m_head;
+	uint64_t m_head_offs;
+	uint64_t m_next_segment;
+	uint64_t m_sequence;  // Sequence number of the next record
+	size_t m_new_segments;
+	std::vector<uint8_t> m_staging;
+
+	// Location of the data of each block and live bytes in each segment
+	std::mutex m_map_mutex;
+	ExtentMap m_map;
+	std::map<uint64_t, uint64_t> m_live;
+
+	// Held shared while reading from segments, exclusively to delete them
+	std::shared_mutex m_delete_mutex;
+
+	// Serializes checkpoints; counts them to alternate between two files
+	std::mutex m_checkpoint_mutex;
+	uint64_t m_n_checkpoints;
+
+	std::mutex m_gc_mutex;
+	std::condition_variable m_gc_cond;
+	std::atomic<bool> m_done;
+	std::thread m_gc_thread;
+
+	std::string segment_path(uint64_t segment) const;
+
+	void load(Context &ctx);
+	bool load_checkpoint(Context &ctx, uint64_t &segment, uint64_t &offs);
+	void replay(Context &ctx, uint64_t segment, uint64_t offs);
+
+	// Updates the map; the map mutex must be held
+	void map(uint64_t block, uint64_t count, uint64_t addr);
+
+	// Appends a single record; the append mutex must be held. Returns true
+	// if a checkpoint is due.
+	bool append(uint64_t block, size_t count, const uint8_t *data);
+	void roll();
+
+	void checkpoint(Context &ctx);
+
+	void collector();
+	bool collect();
+
+public:
+	LogStore(ContextPool &pool, Folder &folder, const SMB::Options &options);
+
+	// Stops the garbage collector
+	~LogStore();
+
+	// Writes the final checkpoint; must be called on clean shutdown
+	void close();
+
+	void read(uint64_t block, size_t count, uint8_t *buf);
+
+	// Writes the given blocks, or unmaps them if buf is null
+	void write(uint64_t block, size_t count, const uint8_t *buf);
+};
@@ -0,0 +1,653 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <system_error>
+
+#include <nbdkit_smb_plugin/checksum.hpp>
+#include <nbdkit_smb_plugin/folder.hpp>
+#include <nbdkit_smb_plugin/io_class.hpp>
+#include <nbdkit_smb_plugin/log.hpp>
+#include <nbdkit_smb_plugin/mirror.hpp>
+
+struct MirrorMapHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t generation;
+	uint64_t n_superblocks;  // Bits in each of the three bitmaps
+	uint64_t checksum;       // Of the header and the bitmaps
+};
+
+static const char MAP_MAGIC[8] = {'N', 'B', 'D', 'S', 'M', 'B', 'M', 'M'};
+static constexpr uint32_t MAP_CLEAN = 1;  // Written on clean shutdown
+
+// Maps alternate between two files, so that a torn map never destroys the
+// previous one
+static const char *MAP_FILES[2] = {"mirror.0.map", "mirror.1.map"};
+
+// Interval at which an offline side is tried again, and time without writes
+// after which the superblocks that may be written are forgotten
+static constexpr std::chrono::seconds RETRY_INTERVAL(5);
+static constexpr std::chrono::seconds IDLE_INTERVAL(2);
+
+// Number of superblocks copied between two updates of the map
+static constexpr size_t RESYNC_BATCH = 64;
+
+// The latency estimate of a side that is not read from approaches that of
+// the other side by this fraction per read, so that it is tried again
+static constexpr double LATENCY_DECAY = 1.0 / 256;
+
+/******************************************************************************
+ * Class Mirror                                                               *
+ ******************************************************************************/
+
+// State of a write on one side
+enum : uint8_t { NOT_ISSUED, PENDING, DONE, FAILED };
+
+struct Mirror::Request {
+	Write f;
+	std::vector<size_t> superblocks;
+	std::vector<uint8_t> state;  // Per side and write
+
+	uint8_t &at(size_t side, size_t i)
+	{
+		return state[side * superblocks.size() + i];
+	}
+};
+
+Mirror::Mirror(Side primary, Side mirror, Executor &executor,
+               const SMB::Options &options, Resync resync)
+    : m_sides{primary, mirror},
+      m_executor(executor),
+      m_resync(std::move(resync)),
+      m_lag(std::chrono::milliseconds(options.mirror_lag)),
+      m_max_pending(options.pool_size),
+      m_online{true, true},
+      m_n_pending{0, 0},
+      m_n_writing(0),
+      m_n_reading{0, 0},
+      m_latency_us{1000.0, 1000.0},
+      m_resync_side(N_SIDES),
+      m_resync_superblock(0),
+      m_resync_missed(false),
+      m_generation(0),
+      m_saving{false, false},
+      m_next_file{0, 0},
+      m_done(false)
+{
+	// Use the most recent map of either side
+	Map best;
+	bool found = false;
+	for (size_t side = 0; side < N_SIDES; side++) {
+		Map map;
+		if (load(side, map) && (!found || map.generation > best.generation)) {
+			best = std::move(map);
+			found = true;
+		}
+	}
+	if (!found) {
+		// A new mirror receives everything from the primary side
+		m_dirty[1] = m_sides[0].disk->allocation();
+		m_dirty[1].merge(m_sides[1].disk->allocation());
+		SMB_LOG(DISK, INFO, "Copying %zu superblocks to the mirror %s",
+		        m_dirty[1].count(), m_sides[1].disk->url().str().c_str());
+	}
+	else {
+		m_dirty[0] = std::move(best.dirty[0]);
+		m_dirty[1] = std::move(best.dirty[1]);
+		m_generation = best.generation + 1;
+
+		// Writes in progress during a crash may have reached either side
+		if (!best.clean) {
+			size_t n = 0;
+			for (size_t sb = best.active.find_next(0); sb != Bitmap::npos;
+			     sb = best.active.find_next(sb + 1)) {
+				if (!m_dirty[0].test(sb)) {
+					n += !m_dirty[1].set(sb);
+				}
+			}
+			SMB_LOG(DISK, WARNING,
+			        "Mirror was not closed cleanly, resynchronizing %zu "
+			        "superblocks",
+			        n);
+		}
+	}
+	save();
+	m_thread = std::thread([this]() { worker(); });
+}
+
+Mirror::~Mirror() { stop(); }
+
+void Mirror::stop()
+{
+	// Writes of lagging sides and map updates run on the executor and refer
+	// to the mirror until they are finished
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done = true;
+		m_cond.notify_all();
+		m_cond.wait(lock, [this]() {
+			return m_n_pending[0] == 0 && m_n_pending[1] == 0 &&
+			       !m_saving[0] && !m_saving[1];
+		});
+	}
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+void Mirror::close()
+{
+	stop();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_active.clear();
+	}
+	save(true);
+}
+
+bool Mirror::load(size_t side, Map &map)
+{
+	Folder &folder = *m_sides[side].disk;
+	ContextPool::Lease ctx = m_sides[side].pool->acquire();
+	bool found = false;
+	for (const char *name : MAP_FILES) {
+		std::string data;
+		if (!folder.read_file(*ctx, name, data)) {
+			continue;
+		}
+		MirrorMapHeader hdr{};
+		const bool valid = read_header(data, hdr);
+		const size_t n_words = (hdr.n_superblocks + 63) / 64;
+		if (!valid || memcmp(hdr.magic, MAP_MAGIC, sizeof(MAP_MAGIC)) != 0 ||
+		    hdr.version != 1 ||
+		    data.size() != sizeof(hdr) + 3 * n_words * sizeof(uint64_t)) {
+			SMB_LOG(DISK, WARNING, "Ignoring invalid %s in %s", name,
+			        folder.url().str().c_str());
+			continue;
+		}
+		if (found && hdr.generation <= map.generation) {
+			continue;
+		}
+		m_next_file[side] = (name == MAP_FILES[0]) ? 1 : 0;
+
+		// The map lists the dirty superblocks of this side first
+		Bitmap *bitmaps[3] = {&map.dirty[side], &map.dirty[1 - side],
+		                      &map.active};
+		for (size_t i = 0; i < 3; i++) {
+			bitmaps[i]->resize(hdr.n_superblocks);
+			memcpy(bitmaps[i]->data(),
+			       data.data() + sizeof(hdr) + i * n_words * sizeof(uint64_t),
+			       n_words * sizeof(uint64_t));
+		}
+		map.generation = hdr.generation;
+		map.clean = hdr.flags & MAP_CLEAN;
+		found = true;
+	}
+	return found;
+}
+
+std::string Mirror::serialize(size_t side, uint64_t generation, bool clean)
+{
+	Bitmap bitmaps[3] = {m_dirty[side], m_dirty[1 - side], m_active};
+	size_t n_superblocks = 0;
+	for (const Bitmap &bitmap : bitmaps) {
+		n_superblocks = std::max(n_superblocks, bitmap.size());
+	}
+	const size_t n_words = (n_superblocks + 63) / 64;
+
+	MirrorMapHeader hdr;
+	memcpy(hdr.magic, MAP_MAGIC, sizeof(MAP_MAGIC));
+	hdr.version = 1;
+	hdr.flags = clean ? MAP_CLEAN : 0;
+	hdr.generation = generation;
+	hdr.n_superblocks = n_superblocks;
+	std::string data(sizeof(hdr) + 3 * n_words * sizeof(uint64_t), '\0');
+	for (size_t i = 0; i < 3; i++) {
+		bitmaps[i].resize(n_superblocks);
+		memcpy(&data[sizeof(hdr) + i * n_words * sizeof(uint64_t)],
+		       bitmaps[i].data(), n_words * sizeof(uint64_t));
+	}
+	write_header(data, hdr);
+	return data;
+}
+
+void Mirror::save(bool clean, size_t probe)
+{
+	struct Save {
+		std::string data[N_SIDES];
+		uint8_t state[N_SIDES] = {NOT_ISSUED, NOT_ISSUED};
+	};
+	std::unique_lock<std::mutex> lock(m_mutex);
+	const auto can_save = [&](size_t side) {
+		return m_online[side] || side == probe;
+	};
+
+	// Sides that failed are taken offline, so this ends once a side has
+	// recorded the map or no side is left
+	while (can_save(0) || can_save(1)) {
+		// A side still writing an earlier map is skipped, unless no other
+		// side can record this one
+		m_cond.wait(lock, [&]() {
+			for (size_t side = 0; side < N_SIDES; side++) {
+				if (can_save(side) && !m_saving[side]) {
+					return true;
+				}
+			}
+			return !can_save(0) && !can_save(1);
+		});
+		const std::shared_ptr<Save> op = std::make_shared<Save>();
+		const uint64_t generation = m_generation++;
+		for (size_t side = 0; side < N_SIDES; side++) {
+			if (!can_save(side) || m_saving[side]) {
+				continue;
+			}
+			op->data[side] = serialize(side, generation, clean);
+			op->state[side] = PENDING;
+			m_saving[side] = true;
+			const char *name = MAP_FILES[m_next_file[side]];
+			m_next_file[side] ^= 1;
+			m_executor.submit([this, op, side, probe, name]() {
+				std::string error;
+				try {
+					ContextPool::Lease ctx = m_sides[side].pool->acquire();
+					m_sides[side].disk->write_file(*ctx, name, op->data[side]);
+				}
+				catch (std::exception &e) {
+					error = e.what();
+				}
+				std::lock_guard<std::mutex> lock(m_mutex);
+				op->state[side] = error.empty() ? DONE : FAILED;
+				m_saving[side] = false;
+				if (!error.empty()) {
+					set_offline(side, "map update", error.c_str());
+				}
+				else if (side == probe && !m_online[side]) {
+					m_online[side] = true;
+					SMB_LOG(DISK, WARNING,
+					        "Mirror side %s is back, resynchronizing %zu "
+					        "superblocks",
+					        m_sides[side].disk->url().str().c_str(),
+					        m_dirty[side].count());
+				}
+				m_cond.notify_all();
+			});
+		}
+
+		// The map of a slow side may be written after the request completed
+		m_cond.wait(lock, [&]() {
+			bool done = false, pending = false;
+			for (size_t side = 0; side < N_SIDES; side++) {
+				done = done || op->state[side] == DONE;
+				pending = pending || op->state[side] == PENDING;
+			}
+			return !pending || (done && !clean);
+		});
+		if (op->state[0] == DONE || op->state[1] == DONE) {
+			return;
+		}
+		probe = N_SIDES;
+	}
+	throw std::system_error(EIO, std::system_category(),
+	                        "Cannot record the mirror map on either side");
+}
+
+void Mirror::set_offline(size_t side, const char *what, const char *error)
+{
+	if (!m_online[side]) {
+		return;
+	}
+	m_online[side] = false;
+	m_stats.failures++;
+	SMB_LOG(DISK, ERROR, "Mirror side %s is unavailable after a failed %s: %s",
+	        m_sides[side].disk->url().str().c_str(), what, error);
+}
+
+bool Mirror::find_resync(size_t &side, size_t &superblock)
+{
+	for (side = 0; side < N_SIDES; side++) {
+		if (!m_online[side] || !m_online[1 - side]) {
+			continue;
+		}
+		const Bitmap &dirty = m_dirty[side];
+		for (superblock = dirty.find_next(0); superblock != Bitmap::npos;
+		     superblock = dirty.find_next(superblock + 1)) {
+			// Writes in progress on either side must finish first; writes
+			// issued later mark the copy as missed
+			if (!m_pending[0].count(superblock) &&
+			    !m_pending[1].count(superblock)) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void Mirror::worker()
+{
+	IOClassScope scope(IOClass::BACKGROUND);
+	std::chrono::steady_clock::time_point next_retry =
+	    std::chrono::steady_clock::now() + RETRY_INTERVAL;
+	size_t n_resynced = 0;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_done) {
+		// Copy dirty superblocks from the other side
+		size_t side, sb;
+		if (find_resync(side, sb)) {
+			m_resync_side = side;
+			m_resync_superblock = sb;
+			m_resync_missed = false;
+			lock.unlock();
+			std::string error;
+			try {
+				m_resync(1 - side, side, sb);
+			}
+			catch (std::exception &e) {
+				error = e.what();
+			}
+			lock.lock();
+			m_resync_side = N_SIDES;
+			if (!error.empty()) {
+				set_offline(side, "resync", error.c_str());
+			}
+			else if (!m_resync_missed) {
+				m_dirty[side].reset(sb);
+				m_stats.resynced++;
+				n_resynced++;
+			}
+			if (n_resynced < RESYNC_BATCH) {
+				continue;
+			}
+		}
+
+		// Record the progress once a batch is done or nothing is left, and
+		// forget the superblocks written before an idle period
+		const std::chrono::steady_clock::time_point now =
+		    std::chrono::steady_clock::now();
+		const bool idle = m_active.count() > 0 && m_n_writing == 0 &&
+		                  m_n_pending[0] == 0 && m_n_pending[1] == 0 &&
+		                  now - m_last_write >= IDLE_INTERVAL;
+		if (idle) {
+			m_active.clear();
+		}
+		size_t probe = N_SIDES;
+		if (now >= next_retry) {
+			next_retry = now + RETRY_INTERVAL;
+			for (size_t i = 0; i < N_SIDES; i++) {
+				if (!m_online[i]) {
+					probe = i;
+				}
+			}
+		}
+		if (n_resynced > 0 || idle || probe < N_SIDES) {
+			n_resynced = 0;
+			lock.unlock();
+			try {
+				save(false, probe);
+			}
+			catch (std::exception &e) {
+				SMB_LOG(DISK, DEBUG, "Cannot update the mirror map: %s",
+				        e.what());
+			}
+			lock.lock();
+			continue;
+		}
+		m_cond.wait_for(lock, IDLE_INTERVAL);
+	}
+}
+
+void Mirror::write(const std::vector<size_t> &superblocks, Write f)
+{
+	const std::shared_ptr<Request> req = std::make_shared<Request>();
+	req->f = std::move(f);
+	req->superblocks = superblocks;
+	req->state.assign(N_SIDES * superblocks.size(), NOT_ISSUED);
+	bool save_map = false;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (size_t sb : superblocks) {
+			if ((!m_online[0] || m_dirty[0].test(sb)) &&
+			    (!m_online[1] || m_dirty[1].test(sb))) {
+				throw std::system_error(EIO, std::system_category(),
+				                        "No side of the mirror is available");
+			}
+		}
+		for (size_t i = 0; i < superblocks.size(); i++) {
+			const size_t sb = superblocks[i];
+
+			// Write to all sides holding the current data, except for sides
+			// that are offline or too far behind while another one is not
+			bool issue[N_SIDES], any = false;
+			for (size_t side = 0; side < N_SIDES; side++) {
+				const bool clean = !m_dirty[side].test(sb);
+				issue[side] = clean && m_online[side] &&
+				              m_n_pending[side] < m_max_pending;
+				any = any || issue[side];
+				if (!clean && side == m_resync_side &&
+				    sb == m_resync_superblock) {
+					m_resync_missed = true;
+				}
+			}
+			for (size_t side = 0; side < N_SIDES; side++) {
+				if (!any && !m_dirty[side].test(sb) && m_online[side]) {
+					issue[side] = true;
+				}
+				if (issue[side]) {
+					req->at(side, i) = PENDING;
+					m_pending[side][sb]++;
+					m_n_pending[side]++;
+				}
+				else if (!m_dirty[side].set(sb)) {
+					save_map = true;
+				}
+			}
+			if (!m_active.set(sb)) {
+				save_map = true;
+			}
+		}
+		m_n_writing++;
+		m_last_write = std::chrono::steady_clock::now();
+	}
+
+	// Superblocks written for the first time since the last idle period are
+	// recorded, so that they are resynchronized after a crash
+	if (save_map) {
+		try {
+			save();
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (size_t side = 0; side < N_SIDES; side++) {
+				for (size_t i = 0; i < superblocks.size(); i++) {
+					if (req->at(side, i) == PENDING) {
+						if (--m_pending[side][superblocks[i]] == 0) {
+							m_pending[side].erase(superblocks[i]);
+						}
+						m_n_pending[side]--;
+					}
+				}
+			}
+			m_n_writing--;
+			m_cond.notify_all();
+			throw;
+		}
+		save_map = false;
+	}
+
+	const std::chrono::steady_clock::time_point deadline =
+	    std::chrono::steady_clock::now() + m_lag;
+
+	for (size_t side = 0; side < N_SIDES; side++) {
+		for (size_t i = 0; i < superblocks.size(); i++) {
+			if (req->at(side, i) != PENDING) {
+				continue;
+			}
+			m_executor.submit([this, req, side, i]() {
+				const std::chrono::steady_clock::time_point start =
+				    std::chrono::steady_clock::now();
+				std::string error;
+				try {
+					req->f(side, i);
+				}
+				catch (std::exception &e) {
+					error = e.what();
+				}
+				std::lock_guard<std::mutex> lock(m_mutex);
+				req->at(side, i) = error.empty() ? DONE : FAILED;
+				if (!error.empty()) {
+					set_offline(side, "write", error.c_str());
+				}
+				else {
+					update_latency(side, start);
+				}
+				const size_t sb = req->superblocks[i];
+				if (--m_pending[side][sb] == 0) {
+					m_pending[side].erase(sb);
+				}
+				m_n_pending[side]--;
+				m_cond.notify_all();
+			});
+		}
+	}
+
+	// Each write must reach one side; the other side may lag behind by the
+	// allowed time, after which it is resynchronized instead
+	std::unique_lock<std::mutex> lock(m_mutex);
+	const auto finished = [&](bool all) {
+		for (size_t i = 0; i < superblocks.size(); i++) {
+			bool done = false, pending = false;
+			for (size_t side = 0; side < N_SIDES; side++) {
+				done = done || req->at(side, i) == DONE;
+				pending = pending || req->at(side, i) == PENDING;
+			}
+			if (pending && (all || !done)) {
+				return false;
+			}
+		}
+		return true;
+	};
+	m_cond.wait(lock, [&]() { return finished(false); });
+	m_cond.wait_until(lock, deadline, [&]() { return finished(true); });
+
+	std::exception_ptr error;
+	bool lagged = false;
+	for (size_t i = 0; i < superblocks.size(); i++) {
+		bool done = false;
+		for (size_t side = 0; side < N_SIDES; side++) {
+			done = done || req->at(side, i) == DONE;
+		}
+		if (!done) {
+			error = std::make_exception_ptr(
+			    std::system_error(EIO, std::system_category(),
+			                      "Write failed on all sides of the mirror"));
+			continue;
+		}
+		for (size_t side = 0; side < N_SIDES; side++) {
+			const uint8_t state = req->at(side, i);
+			if (state == PENDING || state == FAILED) {
+				lagged = lagged || state == PENDING;
+				if (!m_dirty[side].set(superblocks[i])) {
+					save_map = true;
+				}
+			}
+		}
+	}
+	m_stats.lagged += lagged;
+	m_n_writing--;
+	if (save_map) {
+		m_cond.notify_all();  // Resynchronize the superblocks
+	}
+	if (!error && save_map) {
+		lock.unlock();
+		save();
+	}
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+size_t Mirror::read_begin(size_t superblock, size_t avoid)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Prefer the side with the lower expected latency given its queue
+	size_t res = N_SIDES;
+	double best = 0.0;
+	for (size_t side = 0; side < N_SIDES; side++) {
+		if (!m_online[side] || m_dirty[side].test(superblock)) {
+			continue;
+		}
+		double score =
+		    (m_n_reading[side] + m_n_pending[side] + 1) * m_latency_us[side];
+		if (side == avoid) {
+			score = std::numeric_limits<double>::infinity();
+		}
+		if (res == N_SIDES || score < best) {
+			res = side;
+			best = score;
+		}
+	}
+	if (res == N_SIDES) {
+		throw std::system_error(EIO, std::system_category(),
+		                        "No side of the mirror is available");
+	}
+	m_latency_us[1 - res] +=
+	    (m_latency_us[res] - m_latency_us[1 - res]) * LATENCY_DECAY;
+	m_n_reading[res]++;
+	return res;
+}
+
+void Mirror::read_done(size_t side, std::chrono::steady_clock::time_point start,
+                       bool failed)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_n_reading[side]--;
+	if (failed) {
+		set_offline(side, "read", "I/O error");
+		return;
+	}
+	update_latency(side, start);
+	(side == 0 ? m_stats.primary_reads : m_stats.mirror_reads)++;
+}
+
+void Mirror::update_latency(size_t side,
+                            std::chrono::steady_clock::time_point start)
+{
+	const double us = std::chrono::duration<double, std::micro>(
+	                      std::chrono::steady_clock::now() - start)
+	                      .count();
+	m_latency_us[side] += (us - m_latency_us[side]) / 8.0;
+}
+
+size_t Mirror::clean_side(size_t superblock)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_dirty[0].test(superblock) ? 1 : 0;
+}
+
+SMB::MirrorStats Mirror::stats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	SMB::MirrorStats res = m_stats;
+	res.dirty = m_dirty[0].count() + m_dirty[1].count();
+	return res;
+}
@@ -0,0 +1,184 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <nbdkit_smb_plugin/bitmap.hpp>
+#include <nbdkit_smb_plugin/context.hpp>
+#include <nbdkit_smb_plugin/executor.hpp>
+#include <nbdkit_smb_plugin/smb.hpp>
+
+class Folder;
+
+/**
+ * Keeps the two folders of a mirrored disk in sync. Writes are issued to both
+ * sides in parallel; a request completes once each of its writes has reached
+ * one side and the other side either has caught up or has fallen more than
+ * the allowed lag behind. Superblocks that a side missed, because it lagged
+ * behind or failed, are marked dirty for that side and copied from the other
+ * side by a background thread. Reads are sent to the side with the lower
+ * expected latency among those holding the current data.
+ *
+ * The dirty superblocks, together with the superblocks that may be written
+ * at the moment, are recorded in a map file in both folders before a request
+ * depends on them, so that the sides are resynchronized after a crash.
+ */
+class Mirror {
+public:
+	static constexpr size_t N_SIDES = 2;
+
+	struct Side {
+		ContextPool *pool;
+		Folder *disk;
+	};
+
+	// Copies a superblock from one side to the other. Writes to the
+	// superblock may be issued meanwhile; the copy is then repeated.
+	using Resync = std::function<void(size_t src, size_t dst, size_t superblock)>;
+
+	// Performs the i-th write of a request on the given side. May be called
+	// after the request has completed, if the side lags behind.
+	using Write = std::function<void(size_t side, size_t i)>;
+
+private:
+	struct Request;
+
+	Side m_sides[N_SIDES];
+	Executor &m_executor;
+	Resync m_resync;
+	std::chrono::steady_clock::duration m_lag;
+	size_t m_max_pending;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+
+	// Superblocks each side is missing, and superblocks that may be written
+	Bitmap m_dirty[N_SIDES];
+	Bitmap m_active;
+	bool m_online[N_SIDES];
+
+	// Writes in progress per side and superblock, and requests in progress
+	std::map<size_t, size_t> m_pending[N_SIDES];
+	size_t m_n_pending[N_SIDES];
+	size_t m_n_writing;
+	std::chrono::steady_clock::time_point m_last_write;
+
+	// Reads in progress and average latency of reads and writes in
+	// microseconds per side
+	size_t m_n_reading[N_SIDES];
+	double m_latency_us[N_SIDES];
+
+	// Superblock being copied by the background thread, and whether a write
+	// skipped it meanwhile, so that it stays dirty
+	size_t m_resync_side;
+	size_t m_resync_superblock;
+	bool m_resync_missed;
+
+	SMB::MirrorStats m_stats;
+
+	// Generation of the next map, whether a map is being written to each
+	// side, and which of the two map files of a side is written next
+	uint64_t m_generation;
+	bool m_saving[N_SIDES];
+	size_t m_next_file[N_SIDES];
+
+	bool m_done;
+	std::thread m_thread;
+
+	// Map recorded in the folder of one side
+	struct Map {
+		uint64_t generation = 0;
+		bool clean = false;
+		Bitmap dirty[N_SIDES];
+		Bitmap active;
+	};
+
+	// Loads the most recent valid map of the given side
+	bool load(size_t side, Map &map);
+
+	// Updates the latency estimate of a side; the mutex must be held
+	void update_latency(size_t side, std::chrono::steady_clock::time_point start);
+
+	// The map of each side records the dirty superblocks of that side first,
+	// so that the sides may be swapped. The mutex must be held.
+	std::string serialize(size_t side, uint64_t generation, bool clean);
+
+	// Records the map in the folders of all sides that are online, and of the
+	// given side, which is brought back online on success. Returns once one
+	// side has recorded it, or all sides on clean shutdown; throws if no
+	// side could record the map.
+	void save(bool clean = false, size_t probe = N_SIDES);
+
+	// Takes a side offline after an error; the mutex must be held
+	void set_offline(size_t side, const char *what, const char *error);
+
+	// Finds a dirty superblock that can be copied now; the mutex must be held
+	bool find_resync(size_t &side, size_t &superblock);
+
+	// Stops the background thread once no write or map update is in progress
+	void stop();
+
+	void worker();
+
+public:
+	/**
+	 * Loads the map of the two sides and resynchronizes them in the
+	 * background. Without a map, all superblocks of the primary side are
+	 * copied to the mirror.
+	 */
+	Mirror(Side primary, Side mirror, Executor &executor,
+	       const SMB::Options &options, Resync resync);
+
+	// Waits for the writes of lagging sides and stops the background thread;
+	// must be preceded by close() on clean shutdown
+	~Mirror();
+
+	// Waits for the writes of lagging sides and records a clean map; must
+	// be called on clean shutdown
+	void close();
+
+	/**
+	 * Performs write i of a request on both sides in parallel, where write i
+	 * affects the given superblock. Throws if a write failed on all sides it
+	 * was issued to.
+	 */
+	void write(const std::vector<size_t> &superblocks, Write f);
+
+	// Returns the side a superblock should be read from, other than the
+	// given side if possible. The read must be finished with read_done().
+	size_t read_begin(size_t superblock, size_t avoid = N_SIDES);
+	void read_done(size_t side, std::chrono::steady_clock::time_point start,
+	               bool failed);
+
+	// Returns a side holding the current data of the superblock, preferring
+	// the primary side
+	size_t clean_side(size_t superblock);
+
+	SMB::MirrorStats stats();
+};
@@ -51,7 +51,14 @@ static uint64_t size = 1 * 1024 * 1024 * 1024;  // Default disk size, 1GiB
 
 static void plugin_unload(void) { free(url); }
 
-static void *plugin_open(int readonly) { return nbdkit_smb_open(url); }
+static void *plugin_open(int readonly)
+{
+	nbdkit_smb *handle = nbdkit_smb_open(url, size);
+	if (handle == NULL) {
+		nbdkit_error("%s", nbdkit_smb_error());
+	}
+	return handle;
+}
 
 static void plugin_close(void *handle)
 {
@@ -67,7 +74,42 @@ static void plugin_dump_plugin(void)
 {
 	printf(
 	    "url=smb://[[WORKGROUP:][USER][:PASSWORD]@]HOST/SHARE/PATH/\n"
-	    "size=1G\n");
+	    "size=1G\n"
+	    "depth=0\n"
+	    "fanout=256\n"
+	    "format=superblocks\n"
+	    "backend=smbclient\n"
+	    "base=\n"
+	    "stripe=\n"
+	    "stripe_width=1\n"
+	    "mirror=\n"
+	    "mirror_lag=20\n"
+	    "pool_size=8\n"
+	    "io_size=1M\n"
+	    "prealloc=0\n"
+	    "journal=0\n"
+	    "cache=0\n"
+	    "cache_min=0\n"
+	    "readahead=0\n"
+	    "warm_start=1\n"
+	    "hedge=0\n"
+	    "hedge_budget=5\n"
+	    "read_bps=0\n"
+	    "write_bps=0\n"
+	    "read_iops=0\n"
+	    "write_iops=0\n"
+	    "burst_ms=1000\n"
+	    "superblock_size=1M\n"
+	    "protocol_min=\n"
+	    "protocol_max=\n"
+	    "encryption=\n"
+	    "config=\n"
+	    "timeout=\n"
+	    "port=\n"
+	    "buffer_memory=256M\n"
+	    "huge_pages=none\n"
+	    "log=error\n"
+	    "trace=\n");
 }
 
 static int plugin_config(const char *key, const char *value)
@@ -82,8 +124,8 @@ static int plugin_config(const char *key, const char *value)
 			return -1;
 		size = (uint64_t)r;
 	}
-	else {
-		nbdkit_error("unknown parameter '%s'", key);
+	else if (nbdkit_smb_config(key, value) < 0) {
+		nbdkit_error("%s", nbdkit_smb_error());
 		return -1;
 	}
 
@@ -104,9 +146,62 @@ static int plugin_config_complete(void)
 
 #define plugin_config_help                                         \
 	"url=smb://[[WORKGROUP:][USER][:PASSWORD]@]HOST/SHARE/PATH/\n" \
-	"    The SAMBA URL at which the disk should be stored"         \
+	"    The SAMBA URL at which the disk should be stored\n"       \
 	"size=1G\n"                                                    \
-	"    The size of the disk"
+	"    The size of the disk\n"                                   \
+	"depth=0\n"                                                    \
+	"    Directory levels of a new disk (0: choose from size)\n"   \
+	"fanout=256\n"                                                 \
+	"    Entries per directory level of a new disk (16/256/4096)\n" \
+	"format=superblocks|log\n"                                     \
+	"    Store the data of a new disk in place or in a log\n"      \
+	"base=smb://HOST/SHARE/PATH/ or /SHARE/PATH/\n"                \
+	"    Read-only base disk of a new copy-on-write overlay disk\n" \
+	"stripe=smb://HOST/SHARE/PATH/ stripe_width=1\n"               \
+	"    Further folders the disk is striped across (repeatable)\n" \
+	"mirror=smb://HOST/SHARE/PATH/ mirror_lag=20\n"                \
+	"    Folder holding a copy of the disk, and maximum write lag\n" \
+	"backend=smbclient|libsmb2\n"                                  \
+	"    SMB library used for superblock reads and writes\n"       \
+	"pool_size=8\n"                                                \
+	"    Maximum number of concurrent SMB connections\n"           \
+	"io_size=1M\n"                                                 \
+	"    Maximum size of a single SMB read or write\n"             \
+	"prealloc=0\n"                                                 \
+	"    Superblocks created ahead of sequential writers\n"        \
+	"journal=0\n"                                                  \
+	"    Size of the write-ahead journal for small writes\n"       \
+	"cache=0 readahead=0\n"                                        \
+	"    Size of the read cache and of the read-ahead window\n"    \
+	"cache_min=0\n"                                                \
+	"    Minimum cache size under memory pressure (0: fixed)\n"    \
+	"warm_start=1\n"                                               \
+	"    Restore the working set of the cache when opened\n"       \
+	"hedge=0 hedge_budget=5\n"                                     \
+	"    Read latency percentile after which reads are duplicated\n" \
+	"read_bps=0 write_bps=0 read_iops=0 write_iops=0\n"            \
+	"    Bandwidth and IOPS limits (0: unlimited)\n"               \
+	"burst_ms=1000\n"                                              \
+	"    Burst allowed above the limits\n"                         \
+	"superblock_size=1M\n"                                         \
+	"    Size of the superblock files of a new disk\n"             \
+	"protocol_min=SMB2 protocol_max=SMB3_11\n"                     \
+	"    Range of SMB protocol versions\n"                         \
+	"encryption=none|request|require\n"                            \
+	"    SMB encryption\n"                                         \
+	"config=smb.conf\n"                                            \
+	"    File with further libsmbclient settings\n"                \
+	"timeout=MS port=PORT\n"                                       \
+	"    Request timeout and server port\n"                        \
+	"buffer_memory=256M\n"                                         \
+	"    Maximum memory used for superblock buffers\n"             \
+	"huge_pages=none|transparent|explicit\n"                       \
+	"    Huge pages backing the superblock buffers\n"              \
+	"log=error,smbclient:warning\n"                                \
+	"    Log verbosity (SIGUSR1: increase, SIGUSR2: reset)\n"      \
+	"trace=FILE\n"                                                 \
+	"    Record all requests to FILE for smb_replay\n"             \
+	"Options may also be given in the query string of the URL"
 
 static int plugin_pread(void *handle, void *buf, uint32_t count,
                         uint64_t offset)
@@ -120,6 +215,31 @@ static int plugin_pwrite(void *handle, const void *buf, uint32_t count,
 	return nbdkit_smb_pwrite((nbdkit_smb *)handle, buf, count, offset);
 }
 
+static int plugin_zero(void *handle, uint32_t count, uint64_t offset,
+                       int may_trim)
+{
+	return nbdkit_smb_zero((nbdkit_smb *)handle, count, offset, may_trim);
+}
+
+static int plugin_can_trim(void *handle) { return 1; }
+
+static int plugin_trim(void *handle, uint32_t count, uint64_t offset)
+{
+	return nbdkit_smb_trim((nbdkit_smb *)handle, count, offset);
+}
+
+static int plugin_can_cache(void *handle)
+{
+	return nbdkit_smb_can_cache((nbdkit_smb *)handle) ? NBDKIT_CACHE_NATIVE
+	                                                  : NBDKIT_CACHE_NONE;
+}
+
+static int plugin_cache(void *handle, uint32_t count, uint64_t offset,
+                        uint32_t flags)
+{
+	return nbdkit_smb_cache((nbdkit_smb *)handle, count, offset);
+}
+
 static struct nbdkit_plugin plugin = {
     .name = "smb",
     .version = "1.0",
@@ -133,6 +253,11 @@ static struct nbdkit_plugin plugin = {
     .get_size = plugin_get_size,
     .pread = plugin_pread,
     .pwrite = plugin_pwrite,
+    .zero = plugin_zero,
+    .can_trim = plugin_can_trim,
+    .trim = plugin_trim,
+    .can_cache = plugin_can_cache,
+    .cache = plugin_cache,
     .errno_is_preserved = 1,
 };
 
@@ -17,18 +17,92 @@
  */
 
 #include <cerrno>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <stdexcept>
+#include <string>
 #include <system_error>
 
+#include <nbdkit_smb_plugin/log.hpp>
 #include <nbdkit_smb_plugin/plugin_binding.h>
+#include <nbdkit_smb_plugin/probes.hpp>
 #include <nbdkit_smb_plugin/smb.hpp>
+#include <nbdkit_smb_plugin/trace.hpp>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-nbdkit_smb *nbdkit_smb_open(const char *url)
+static SMB::Options options;
+static thread_local std::string error;
+
+// Trace of all operations, if enabled with the "trace" parameter
+static std::string trace_path;
+static std::mutex trace_mutex;
+static std::unique_ptr<TraceWriter> trace;
+
+static uint64_t trace_start() { return trace ? trace->now() : 0; }
+
+static void trace_record(TraceRecord::Type type, uint64_t offset,
+                         uint32_t count, uint64_t start, int error)
+{
+	if (trace) {
+		trace->record(type, offset, count, start, error);
+	}
+}
+
+// Errors other than I/O errors, e.g. failures to allocate memory or to
+// create a connection, must not escape to nbdkit
+static int unexpected_error(const std::exception &e)
+{
+	SMB_LOG(IO, ERROR, "%s", e.what());
+	return EIO;
+}
+
+const char *nbdkit_smb_error(void) { return error.c_str(); }
+
+int nbdkit_smb_config(const char *key, const char *value)
 {
-	return reinterpret_cast<nbdkit_smb *>(new SMB(url));
+	try {
+		if (std::strcmp(key, "trace") == 0) {
+			trace_path = value;
+		}
+		else {
+			options.set(key, value);
+		}
+		return 0;
+	}
+	catch (std::exception &e) {
+		error = e.what();
+		return -1;
+	}
+}
+
+nbdkit_smb *nbdkit_smb_open(const char *url, uint64_t size)
+{
+	try {
+		Log::install_signal_handlers();
+		{
+			std::lock_guard<std::mutex> lock(trace_mutex);
+			if (!trace_path.empty() && !trace) {
+				trace = std::make_unique<TraceWriter>(trace_path, size);
+			}
+		}
+		SMB::Options opts = options;
+		opts.disk_size = size;
+		return reinterpret_cast<nbdkit_smb *>(new SMB(url, opts));
+	}
+	catch (std::system_error &e) {
+		error = e.what();
+		errno = e.code().value();
+		return nullptr;
+	}
+	catch (std::exception &e) {
+		error = e.what();
+		return nullptr;
+	}
 }
 
 void nbdkit_smb_close(nbdkit_smb *smb)
@@ -40,30 +114,136 @@ int nbdkit_smb_pread(nbdkit_smb *smb, void *buf, uint32_t count,
                      uint64_t offset)
 {
 	SMB *inst = reinterpret_cast<SMB *>(smb);
+	SMB_PROBE2(pread_entry, offset, count);
+	const uint64_t start = trace_start();
+	int err = 0;
 	try {
 		inst->read_block(offset / 4096, count / 4096,
 		                 static_cast<uint8_t *>(buf));
-		return 0;
 	}
 	catch (std::system_error &e) {
-		errno = e.code().value();
+		err = e.code().value();
+	}
+	catch (std::exception &e) {
+		err = unexpected_error(e);
+	}
+	SMB_PROBE3(pread_return, offset, count, err);
+	trace_record(TraceRecord::READ, offset, count, start, err);
+	if (err) {
+		errno = err;
 		return -1;
 	}
+	return 0;
 }
 
 int nbdkit_smb_pwrite(nbdkit_smb *smb, const void *buf, uint32_t count,
                       uint64_t offset)
 {
 	SMB *inst = reinterpret_cast<SMB *>(smb);
+	SMB_PROBE2(pwrite_entry, offset, count);
+	const uint64_t start = trace_start();
+	int err = 0;
 	try {
 		inst->write_block(offset / 4096, count / 4096,
 		                  static_cast<const uint8_t *>(buf));
-		return 0;
 	}
 	catch (std::system_error &e) {
-		errno = e.code().value();
+		err = e.code().value();
+	}
+	catch (std::exception &e) {
+		err = unexpected_error(e);
+	}
+	SMB_PROBE3(pwrite_return, offset, count, err);
+	trace_record(TraceRecord::WRITE, offset, count, start, err);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int nbdkit_smb_zero(nbdkit_smb *smb, uint32_t count, uint64_t offset,
+                    int may_trim)
+{
+	// nbdkit writes zeros itself if parts of blocks are to be zeroed
+	if ((offset % 4096) || (count % 4096)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	SMB *inst = reinterpret_cast<SMB *>(smb);
+	SMB_PROBE2(zero_entry, offset, count);
+	const uint64_t start = trace_start();
+	int err = 0;
+	try {
+		inst->zero_block(offset / 4096, count / 4096, may_trim != 0);
+	}
+	catch (std::system_error &e) {
+		err = e.code().value();
+	}
+	catch (std::exception &e) {
+		err = unexpected_error(e);
+	}
+	SMB_PROBE3(zero_return, offset, count, err);
+	trace_record(TraceRecord::ZERO, offset, count, start, err);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int nbdkit_smb_trim(nbdkit_smb *smb, uint32_t count, uint64_t offset)
+{
+	// Trimming is advisory, so parts of blocks are left alone
+	SMB *inst = reinterpret_cast<SMB *>(smb);
+	const uint64_t first = (offset + 4095) / 4096;
+	const uint64_t last = (offset + count) / 4096;
+	SMB_PROBE2(trim_entry, offset, count);
+	const uint64_t start = trace_start();
+	int err = 0;
+	try {
+		if (last > first) {
+			inst->trim_block(first, last - first);
+		}
+	}
+	catch (std::system_error &e) {
+		err = e.code().value();
+	}
+	catch (std::exception &e) {
+		err = unexpected_error(e);
+	}
+	SMB_PROBE3(trim_return, offset, count, err);
+	trace_record(TraceRecord::TRIM, offset, count, start, err);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+int nbdkit_smb_can_cache(nbdkit_smb *smb)
+{
+	return reinterpret_cast<SMB *>(smb)->has_cache();
+}
+
+int nbdkit_smb_cache(nbdkit_smb *smb, uint32_t count, uint64_t offset)
+{
+	// Only queues the blocks, so this returns immediately
+	SMB *inst = reinterpret_cast<SMB *>(smb);
+	const uint64_t first = offset / 4096;
+	const uint64_t last = (offset + count + 4095) / 4096;
+	try {
+		inst->prefetch(first, last - first);
+	}
+	catch (std::bad_alloc &) {
+		errno = ENOMEM;
+		return -1;
+	}
+	catch (std::exception &e) {
+		errno = unexpected_error(e);
 		return -1;
 	}
+	return 0;
 }
 
 #ifdef __cplusplus
@@ -22,7 +22,11 @@ extern "C" {
 
 typedef struct nbdkit_smb_ nbdkit_smb;
 
-nbdkit_smb *nbdkit_smb_open(const char *url);
+const char *nbdkit_smb_error(void);
+
+int nbdkit_smb_config(const char *key, const char *value);
+
+nbdkit_smb *nbdkit_smb_open(const char *url, uint64_t size);
 
 void nbdkit_smb_close(nbdkit_smb *smb);
 
@@ -32,6 +36,15 @@ int nbdkit_smb_pread(nbdkit_smb *smb, void *buf, uint32_t count,
 int nbdkit_smb_pwrite(nbdkit_smb *smb, const void *buf, uint32_t count,
                       uint64_t offset);
 
+int nbdkit_smb_zero(nbdkit_smb *smb, uint32_t count, uint64_t offset,
+                    int may_trim);
+
+int nbdkit_smb_trim(nbdkit_smb *smb, uint32_t count, uint64_t offset);
+
+int nbdkit_smb_can_cache(nbdkit_smb *smb);
+
+int nbdkit_smb_cache(nbdkit_smb *smb, uint32_t count, uint64_t offset);
+
 #ifdef __cplusplus
 }
 #endif
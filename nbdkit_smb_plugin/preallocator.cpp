@@ -0,0 +1,128 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+
+#include <nbdkit_smb_plugin/folder.hpp>
+#include <nbdkit_smb_plugin/log.hpp>
+#include <nbdkit_smb_plugin/preallocator.hpp>
+
+Preallocator::Preallocator(ContextPool &pool, Folder &disk, size_t distance,
+                           size_t n_superblocks,
+                           std::function<bool(size_t)> wanted)
+    : m_pool(pool),
+      m_disk(disk),
+      m_distance(distance),
+      m_n_superblocks(n_superblocks),
+      m_wanted(std::move(wanted)),
+      m_done(false)
+{
+	m_thread = std::thread([this]() { worker(); });
+}
+
+Preallocator::~Preallocator()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_done = true;
+	}
+	m_cond.notify_all();
+	m_thread.join();
+}
+
+void Preallocator::written(size_t first, size_t last)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// Check whether this write continues one of the tracked writers;
+		// otherwise start tracking a new writer
+		auto it = std::find_if(m_frontiers.begin(), m_frontiers.end(),
+		                       [first](size_t frontier) {
+			                       return first == frontier ||
+			                              first == frontier + 1;
+		                       });
+		const bool sequential = it != m_frontiers.end();
+		if (sequential) {
+			m_frontiers.erase(it);
+		}
+		else if (m_frontiers.size() >= MAX_FRONTIERS) {
+			m_frontiers.pop_back();
+		}
+		m_frontiers.insert(m_frontiers.begin(), last);
+		if (!sequential) {
+			return;
+		}
+
+		// Queue the superblocks ahead of the writer. Superblocks queued for
+		// writers that have moved on are dropped.
+		for (size_t sb = last + 1; sb <= last + m_distance; sb++) {
+			if (m_n_superblocks && sb >= m_n_superblocks) {
+				break;
+			}
+			if (m_queued.insert(sb).second) {
+				m_queue.push_back(sb);
+			}
+		}
+		while (m_queue.size() > MAX_FRONTIERS * m_distance) {
+			m_queued.erase(m_queue.front());
+			m_queue.pop_front();
+		}
+	}
+	m_cond.notify_one();
+}
+
+void Preallocator::worker()
+{
+	IOClassScope scope(IOClass::BACKGROUND);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_cond.wait(lock, [this]() { return m_done || !m_queue.empty(); });
+		if (m_done) {
+			return;
+		}
+
+		// Only use contexts that are not needed by foreground requests;
+		// back off while all of them are busy
+		ContextPool::Lease ctx = m_pool.try_acquire();
+		if (!ctx) {
+			m_cond.wait_for(lock, std::chrono::milliseconds(1));
+			continue;
+		}
+
+		const size_t sb = m_queue.front();
+		m_queue.pop_front();
+		m_queued.erase(sb);
+
+		lock.unlock();
+		try {
+			if (m_wanted(sb)) {
+				SMB_LOG(PREALLOC, DEBUG, "Preallocating superblock %zu", sb);
+				m_disk.open(*ctx, sb, true);
+			}
+		}
+		catch (std::exception &e) {
+			// Not fatal; the superblock is created by the writer instead
+			SMB_LOG(PREALLOC, WARNING, "Cannot preallocate superblock %zu: %s",
+			        sb, e.what());
+		}
+		lock.lock();
+	}
+}
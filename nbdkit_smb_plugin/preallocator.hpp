@@ -0,0 +1,81 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <nbdkit_smb_plugin/context.hpp>
+
+class Folder;
+
+/**
+ * Creates superblock files ahead of sequential writers. The preallocator
+ * tracks the superblocks at which recent writes ended (the write frontiers).
+ * When a write continues at a frontier, the next superblocks are created and
+ * sized by a background thread on an otherwise idle context, so that the
+ * writer finds them ready instead of waiting for the directories and the file
+ * to be created.
+ */
+class Preallocator {
+private:
+	// Number of concurrent sequential writers that are tracked
+	static constexpr size_t MAX_FRONTIERS = 8;
+
+	ContextPool &m_pool;
+	Folder &m_disk;
+	size_t m_distance;
+	size_t m_n_superblocks;
+
+	// Returns true if the given superblock should be created
+	std::function<bool(size_t)> m_wanted;
+
+	// Last superblock written by each tracked writer, most recent first
+	std::vector<size_t> m_frontiers;
+
+	std::deque<size_t> m_queue;
+	std::set<size_t> m_queued;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_done;
+	std::thread m_thread;
+
+	void worker();
+
+public:
+	/**
+	 * Creates up to "distance" superblocks ahead of each sequential writer.
+	 * Superblocks at or beyond n_superblocks (if non-zero) and superblocks
+	 * for which wanted() returns false are never created.
+	 */
+	Preallocator(ContextPool &pool, Folder &disk, size_t distance,
+	             size_t n_superblocks, std::function<bool(size_t)> wanted);
+
+	// Stops the background thread; pending superblocks are discarded
+	~Preallocator();
+
+	// Must be called after superblocks first to last have been written
+	void written(size_t first, size_t last);
+};
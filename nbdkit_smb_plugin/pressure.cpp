@@ -0,0 +1,247 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <system_error>
+
+#include <nbdkit_smb_plugin/log.hpp>
+#include <nbdkit_smb_plugin/pressure.hpp>
+
+// Interval at which the pressure and usage are checked, and time without
+// pressure after which the cache grows by one step of GROW_STEPS
+static constexpr int POLL_INTERVAL_MS = 1000;
+static constexpr std::chrono::seconds GROW_DELAY(10);
+static constexpr size_t GROW_STEPS = 16;
+
+// Share of the time since the last check in which some task stalled on
+// memory that counts as pressure; registered as a PSI trigger (stall time
+// within a window, in microseconds) where possible
+static constexpr double STALL_THRESHOLD = 0.05;
+static const char PSI_TRIGGER[] = "some 100000 2000000";
+
+// Usage of the cgroup relative to its limit above which the cache shrinks,
+// and below which it may grow
+static constexpr double USAGE_HIGH = 0.9;
+static constexpr double USAGE_LOW = 0.8;
+
+static bool read_text(const std::string &path, std::string &data)
+{
+	std::ifstream file(path);
+	if (!file) {
+		return false;
+	}
+	std::stringstream ss;
+	ss << file.rdbuf();
+	data = ss.str();
+	return true;
+}
+
+// Reads a cgroup value; "max" and missing files are returned as zero
+static uint64_t read_value(const std::string &path)
+{
+	std::string data;
+	if (!read_text(path, data)) {
+		return 0;
+	}
+	return std::strtoull(data.c_str(), nullptr, 10);
+}
+
+/******************************************************************************
+ * Class MemoryPressure                                                       *
+ ******************************************************************************/
+
+std::string MemoryPressure::find_cgroup()
+{
+	std::ifstream file("/proc/self/cgroup");
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.compare(0, 3, "0::") != 0) {
+			continue;
+		}
+		const std::string path = "/sys/fs/cgroup" + line.substr(3);
+		if (access((path + "/memory.pressure").c_str(), R_OK) == 0) {
+			return path;
+		}
+	}
+	return std::string();
+}
+
+MemoryPressure::MemoryPressure(const std::string &cgroup, size_t min,
+                               size_t max, Resize resize)
+    : m_cgroup(cgroup),
+      m_pressure_file(cgroup.empty() ? "/proc/pressure/memory"
+                                     : cgroup + "/memory.pressure"),
+      m_min(std::min(min, max)),
+      m_max(max),
+      m_size(max),
+      m_resize(std::move(resize)),
+      m_trigger(-1),
+      m_wakeup(-1),
+      m_last_total(0),
+      m_last_check(std::chrono::steady_clock::now()),
+      m_last_change(m_last_check)
+{
+	if (access(m_pressure_file.c_str(), R_OK) != 0) {
+		throw std::system_error(errno, std::system_category(),
+		                        "Cannot monitor the memory pressure");
+	}
+
+	// Triggers wake the thread as soon as tasks stall; they require a
+	// recent kernel and may be restricted to privileged processes
+	m_trigger = open(m_pressure_file.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (m_trigger >= 0 &&
+	    write(m_trigger, PSI_TRIGGER, sizeof(PSI_TRIGGER)) < 0) {
+		close(m_trigger);
+		m_trigger = -1;
+	}
+	m_wakeup = eventfd(0, EFD_CLOEXEC);
+	if (m_wakeup < 0) {
+		const int error = errno;
+		if (m_trigger >= 0) {
+			close(m_trigger);
+		}
+		throw std::system_error(error, std::system_category());
+	}
+	SMB_LOG(MEMORY, INFO,
+	        "Adapting the cache size between %zu and %zu MiB to the memory "
+	        "pressure of %s",
+	        m_min >> 20, m_max >> 20,
+	        m_cgroup.empty() ? "the system" : m_cgroup.c_str());
+	m_thread = std::thread([this]() { worker(); });
+}
+
+MemoryPressure::~MemoryPressure()
+{
+	const uint64_t one = 1;
+	if (write(m_wakeup, &one, sizeof(one)) < 0) {
+		SMB_LOG(MEMORY, ERROR, "Cannot stop the memory pressure monitor");
+	}
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+	close(m_wakeup);
+	if (m_trigger >= 0) {
+		close(m_trigger);
+	}
+}
+
+bool MemoryPressure::under_pressure()
+{
+	// The averages decay slowly, so compare the total stall time instead
+	std::string data;
+	const std::chrono::steady_clock::time_point now =
+	    std::chrono::steady_clock::now();
+	const size_t i = read_text(m_pressure_file, data)
+	                     ? data.find("total=")
+	                     : std::string::npos;
+	if (i != std::string::npos) {
+		const uint64_t total = std::strtoull(data.c_str() + i + 6, nullptr, 10);
+		const double elapsed_us =
+		    std::chrono::duration<double, std::micro>(now - m_last_check)
+		        .count();
+		const bool stalled = m_last_total > 0 && total > m_last_total &&
+		                     total - m_last_total >= elapsed_us * STALL_THRESHOLD;
+		m_last_total = total;
+		m_last_check = now;
+		if (stalled) {
+			return true;
+		}
+	}
+	uint64_t usage, limit;
+	return usage_limit(usage, limit) && usage >= limit * USAGE_HIGH;
+}
+
+bool MemoryPressure::usage_limit(uint64_t &usage, uint64_t &limit)
+{
+	if (m_cgroup.empty()) {
+		return false;
+	}
+	const uint64_t max = read_value(m_cgroup + "/memory.max");
+	const uint64_t high = read_value(m_cgroup + "/memory.high");
+	limit = (max && high) ? std::min(max, high) : std::max(max, high);
+	usage = read_value(m_cgroup + "/memory.current");
+	return limit > 0;
+}
+
+void MemoryPressure::update(bool pressure)
+{
+	const std::chrono::steady_clock::time_point now =
+	    std::chrono::steady_clock::now();
+	size_t size = m_size;
+	if (pressure) {
+		size = std::max(m_min, m_size - m_size / 4);
+		m_last_change = now;
+	}
+	else if (m_size < m_max && now - m_last_change >= GROW_DELAY) {
+		// Only grow if the larger cache still fits below the limit
+		const size_t step = std::max<size_t>(1, m_max / GROW_STEPS);
+		uint64_t usage, limit;
+		if (!usage_limit(usage, limit) ||
+		    usage + step <= limit * USAGE_LOW) {
+			size = std::min(m_max, m_size + step);
+		}
+		m_last_change = now;
+	}
+	if (size == m_size) {
+		return;
+	}
+	if (size < m_size) {
+		SMB_LOG(MEMORY, INFO, "Memory pressure, shrinking the cache to %zu MiB",
+		        size >> 20);
+	}
+	else {
+		SMB_LOG(MEMORY, DEBUG, "Growing the cache to %zu MiB", size >> 20);
+	}
+	m_size = size;
+	m_resize(size);
+}
+
+void MemoryPressure::worker()
+{
+	struct pollfd fds[2] = {{m_wakeup, POLLIN, 0}, {m_trigger, POLLPRI, 0}};
+	while (true) {
+		const int n = poll(fds, 2, POLL_INTERVAL_MS);
+		if (n > 0 && fds[0].revents) {
+			return;
+		}
+		bool pressure = n > 0 && (fds[1].revents & POLLPRI);
+
+		// The trigger is gone, e.g. if the cgroup was removed
+		if (n > 0 && (fds[1].revents & (POLLERR | POLLNVAL))) {
+			fds[1].fd = -1;
+		}
+		try {
+			pressure = under_pressure() || pressure;
+			update(pressure);
+		}
+		catch (std::exception &e) {
+			SMB_LOG(MEMORY, WARNING, "Cannot adapt the cache size: %s",
+			        e.what());
+		}
+	}
+}
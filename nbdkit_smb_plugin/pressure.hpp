@@ -0,0 +1,88 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+/**
+ * Adapts the size of an in-process cache to the memory available to the
+ * process. The memory pressure (PSI) and usage of the cgroup v2 the process
+ * belongs to are watched; the size is reduced by a quarter whenever tasks
+ * stall on memory or the usage approaches the memory limit, and grows back
+ * in small steps once there has been no pressure for a while.
+ */
+class MemoryPressure {
+public:
+	// Applies a new cache size in bytes
+	using Resize = std::function<void(size_t size)>;
+
+private:
+	std::string m_cgroup;  // Directory of the cgroup, or empty
+	std::string m_pressure_file;
+	size_t m_min;
+	size_t m_max;
+	size_t m_size;
+	Resize m_resize;
+
+	// memory.pressure with a registered trigger, or -1 if the pressure is
+	// polled, and an eventfd that stops the thread
+	int m_trigger;
+	int m_wakeup;
+
+	// Total stall time in microseconds at the last check, and the times of
+	// the last check and of the last change of the size
+	uint64_t m_last_total;
+	std::chrono::steady_clock::time_point m_last_check;
+	std::chrono::steady_clock::time_point m_last_change;
+	std::thread m_thread;
+
+	// Returns true if tasks recently stalled on memory or the usage of the
+	// cgroup is close to its limit
+	bool under_pressure();
+
+	// Reads the memory usage and limit of the cgroup in bytes. Returns false
+	// if no limit is known.
+	bool usage_limit(uint64_t &usage, uint64_t &limit);
+
+	void update(bool pressure);
+
+	void worker();
+
+public:
+	// Returns the cgroup v2 directory of this process, or an empty string if
+	// it cannot be determined
+	static std::string find_cgroup();
+
+	/**
+	 * Keeps the cache size between min and max bytes, starting at max. Uses
+	 * the system-wide pressure if cgroup is empty. Throws if the memory
+	 * pressure cannot be monitored.
+	 */
+	MemoryPressure(const std::string &cgroup, size_t min, size_t max,
+	               Resize resize);
+	~MemoryPressure();
+
+	MemoryPressure(const MemoryPressure &) = delete;
+	MemoryPressure &operator=(const MemoryPressure &) = delete;
+};
@@ -0,0 +1,53 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+/*
+ * USDT probes of the "nbdkit_smb" provider for bpftrace, perf and
+ * SystemTap. Probes compile to a single nop and cost nothing unless a tracer
+ * is attached. Enabled with the "usdt" meson option; see tools/latency.bt.
+ *
+ * Probes and arguments:
+ *   pread_entry/pwrite_entry    offset, count
+ *   pread_return/pwrite_return  offset, count, errno (0 on success)
+ *   zero_entry/trim_entry       offset, count
+ *   zero_return/trim_return     offset, count, errno (0 on success)
+ *   chunk_entry                 superblock, offset, size, writing
+ *   chunk_return                superblock, size, writing, errno
+ *   smbc_<call>_entry           call specific, e.g. path or count
+ *   smbc_<call>_return          result, errno (0 on success)
+ */
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define SMB_PROBE1(name, a) DTRACE_PROBE1(nbdkit_smb, name, a)
+#define SMB_PROBE2(name, a, b) DTRACE_PROBE2(nbdkit_smb, name, a, b)
+#define SMB_PROBE3(name, a, b, c) DTRACE_PROBE3(nbdkit_smb, name, a, b, c)
+#define SMB_PROBE4(name, a, b, c, d) \
+	DTRACE_PROBE4(nbdkit_smb, name, a, b, c, d)
+#else
+#define SMB_PROBE1(name, a)
+#define SMB_PROBE2(name, a, b)
+#define SMB_PROBE3(name, a, b, c)
+#define SMB_PROBE4(name, a, b, c, d)
+#endif
+
+// errno after a libsmbclient call, or zero if the call succeeded
+#define SMB_PROBE_ERRNO(res) ((res) < 0 ? errno : 0)
@@ -0,0 +1,97 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <thread>
+
+#include <nbdkit_smb_plugin/qos.hpp>
+
+/******************************************************************************
+ * Class TokenBucket                                                          *
+ ******************************************************************************/
+
+TokenBucket::TokenBucket(uint64_t rate, double burst_seconds)
+    : m_rate(rate),
+      m_burst(std::max(1.0, rate * burst_seconds)),
+      m_tokens(m_burst),
+      m_last(Clock::now())
+{
+}
+
+TokenBucket::Clock::duration TokenBucket::take(uint64_t n)
+{
+	if (m_rate == 0) {
+		return Clock::duration::zero();
+	}
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const Clock::time_point now = Clock::now();
+	m_tokens = std::min(
+	    m_burst,
+	    m_tokens + std::chrono::duration<double>(now - m_last).count() * m_rate);
+	m_last = now;
+	m_tokens -= n;
+	if (m_tokens >= 0) {
+		return Clock::duration::zero();
+	}
+	return std::chrono::duration_cast<Clock::duration>(
+	    std::chrono::duration<double>(-m_tokens / m_rate));
+}
+
+/******************************************************************************
+ * Class Throttle                                                             *
+ ******************************************************************************/
+
+Throttle::Throttle(const SMB::Options &options)
+    : m_read_bytes(options.read_bps, options.burst_ms / 1000.0),
+      m_read_ops(options.read_iops, options.burst_ms / 1000.0),
+      m_write_bytes(options.write_bps, options.burst_ms / 1000.0),
+      m_write_ops(options.write_iops, options.burst_ms / 1000.0)
+{
+}
+
+bool Throttle::enabled(const SMB::Options &options)
+{
+	return options.read_bps || options.read_iops || options.write_bps ||
+	       options.write_iops;
+}
+
+void Throttle::wait(TokenBucket &bytes, TokenBucket &ops, uint64_t n,
+                    bool write)
+{
+	const auto delay = std::max(bytes.take(n), ops.take(1));
+	const uint64_t us =
+	    std::chrono::duration_cast<std::chrono::microseconds>(delay).count();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		(write ? m_stats.writes : m_stats.reads)++;
+		if (us > 0) {
+			(write ? m_stats.writes_throttled : m_stats.reads_throttled)++;
+			(write ? m_stats.write_throttled_us : m_stats.read_throttled_us) +=
+			    us;
+		}
+	}
+	if (us > 0) {
+		std::this_thread::sleep_for(delay);
+	}
+}
+
+SMB::QosStats Throttle::stats()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
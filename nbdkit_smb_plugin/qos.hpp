@@ -0,0 +1,79 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include <nbdkit_smb_plugin/smb.hpp>
+
+/**
+ * Token bucket that refills at a fixed rate up to a burst size. Taking more
+ * tokens than are available puts the bucket into debt, which the caller has
+ * to wait out; this way requests larger than the burst size still pass.
+ */
+class TokenBucket {
+private:
+	using Clock = std::chrono::steady_clock;
+
+	double m_rate;   // Tokens per second; zero for no limit
+	double m_burst;  // Maximum number of tokens
+	double m_tokens;
+	Clock::time_point m_last;
+	std::mutex m_mutex;
+
+public:
+	TokenBucket(uint64_t rate, double burst_seconds);
+
+	// Takes the given number of tokens and returns how long to wait before
+	// the request may proceed
+	Clock::duration take(uint64_t n);
+};
+
+/**
+ * Limits the bandwidth and the number of operations of reads and writes
+ * issued to the share. Each limit has its own token bucket; a request waits
+ * until all of its buckets allow it.
+ */
+class Throttle {
+private:
+	TokenBucket m_read_bytes;
+	TokenBucket m_read_ops;
+	TokenBucket m_write_bytes;
+	TokenBucket m_write_ops;
+
+	std::mutex m_mutex;
+	SMB::QosStats m_stats;
+
+	void wait(TokenBucket &bytes, TokenBucket &ops, uint64_t n, bool write);
+
+public:
+	explicit Throttle(const SMB::Options &options);
+
+	// Returns true if any limit is configured
+	static bool enabled(const SMB::Options &options);
+
+	// Block until a read or write of n bytes may be issued
+	void read(uint64_t n) { wait(m_read_bytes, m_read_ops, n, false); }
+	void write(uint64_t n) { wait(m_write_bytes, m_write_ops, n, true); }
+
+	SMB::QosStats stats();
+};
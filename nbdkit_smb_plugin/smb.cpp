@@ -17,15 +17,38 @@
  */
 
 #include <libsmbclient.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
 #include <cstring>
-#include <iostream>
+#include <map>
 #include <sstream>
 #include <stdexcept>
 #include <system_error>
+#include <unordered_map>
 #include <vector>
 
+#include <nbdkit_smb_plugin/cache.hpp>
+#include <nbdkit_smb_plugin/changes.hpp>
+#include <nbdkit_smb_plugin/context.hpp>
+#include <nbdkit_smb_plugin/executor.hpp>
+#include <nbdkit_smb_plugin/folder.hpp>
+#include <nbdkit_smb_plugin/hedge.hpp>
+#include <nbdkit_smb_plugin/journal.hpp>
+#include <nbdkit_smb_plugin/layout.hpp>
+#include <nbdkit_smb_plugin/log.hpp>
+#include <nbdkit_smb_plugin/log_store.hpp>
+#include <nbdkit_smb_plugin/mirror.hpp>
+#include <nbdkit_smb_plugin/preallocator.hpp>
+#include <nbdkit_smb_plugin/pressure.hpp>
+#include <nbdkit_smb_plugin/probes.hpp>
+#include <nbdkit_smb_plugin/qos.hpp>
 #include <nbdkit_smb_plugin/smb.hpp>
+#include <nbdkit_smb_plugin/smb2.hpp>
 #include <nbdkit_smb_plugin/url_parser.hpp>
+#include <nbdkit_smb_plugin/working_set.hpp>
+#include <nbdkit_smb_plugin/zero.hpp>
 
 /******************************************************************************
  * Struct SMB::Connection                                                     *
@@ -95,6 +118,12 @@ SMB::URL::URL(const char *url)
 	if (path_parts.size() > 1) {
 		path = join(path_parts.begin() + 1, path_parts.end(), '/');
 	}
+
+	// Keep the options in the query string; they are validated when the URL
+	// is used to open a disk
+	for (const UrlParser::KeyVal &kv : parsed_url.query()) {
+		options.emplace_back(kv.key(), kv.val());
+	}
 }
 
 std::string SMB::URL::str(bool include_credentials) const
@@ -119,259 +148,1134 @@ std::string SMB::URL::str(bool include_credentials) const
 	return ss.str();
 }
 
+/******************************************************************************
+ * Struct SMB::Options                                                        *
+ ******************************************************************************/
+
+static unsigned long long parse_uint(const std::string &key,
+                                     const std::string &value)
+{
+	size_t n = 0;
+	unsigned long long res = 0;
+	try {
+		res = std::stoull(value, &n);
+	}
+	catch (std::logic_error &) {
+		n = 0;
+	}
+	if (n == 0 || n != value.size()) {
+		throw std::invalid_argument("invalid value for '" + key + "': '" +
+		                            value + "'");
+	}
+	return res;
+}
+
+uint64_t SMB::Options::parse_size(const std::string &key,
+                                  const std::string &value)
+{
+	static const char SUFFIXES[] = "KMGT";
+	const char *suffix =
+	    value.empty() ? nullptr : std::strchr(SUFFIXES, toupper(value.back()));
+	if (!suffix || !*suffix) {
+		return parse_uint(key, value);
+	}
+	const unsigned int shift = 10 * (suffix - SUFFIXES + 1);
+	const uint64_t res = parse_uint(key, value.substr(0, value.size() - 1));
+	if (res > (UINT64_MAX >> shift)) {
+		throw std::invalid_argument("invalid value for '" + key + "': '" +
+		                            value + "'");
+	}
+	return res << shift;
+}
+
+void SMB::Options::set(const std::string &key, const std::string &value)
+{
+	if (key == "depth") {
+		depth = parse_uint(key, value);
+		if (depth > Layout::MAX_DEPTH) {
+			throw std::invalid_argument("depth must be between 0 and 3");
+		}
+	}
+	else if (key == "fanout") {
+		fanout = parse_uint(key, value);
+		Layout(1, fanout);  // Validate the fan-out
+	}
+	else if (key == "format") {
+		if (value != "superblocks" && value != "log") {
+			throw std::invalid_argument("format must be superblocks or log");
+		}
+		format = value;
+	}
+	else if (key == "base") {
+		base = value;
+	}
+	else if (key == "stripe") {
+		stripes.push_back(value);
+	}
+	else if (key == "stripe_width") {
+		stripe_width = parse_uint(key, value);
+		if (stripe_width < 1) {
+			throw std::invalid_argument("stripe_width must be at least 1");
+		}
+	}
+	else if (key == "mirror") {
+		mirror = value;
+	}
+	else if (key == "mirror_lag") {
+		mirror_lag = parse_uint(key, value);
+	}
+	else if (key == "backend") {
+		if (value != "smbclient" && value != "libsmb2") {
+			throw std::invalid_argument("backend must be smbclient or libsmb2");
+		}
+		if (value == "libsmb2" && !Smb2Connection::available()) {
+			throw std::invalid_argument(
+			    "the libsmb2 backend is not available in this build");
+		}
+		backend = value;
+	}
+	else if (key == "pool_size") {
+		pool_size = parse_uint(key, value);
+		if (pool_size < 1) {
+			throw std::invalid_argument("pool_size must be at least 1");
+		}
+	}
+	else if (key == "prealloc") {
+		prealloc = parse_uint(key, value);
+	}
+	else if (key == "journal") {
+		journal = parse_size(key, value);
+		if (journal != 0 && journal < 1024 * 1024) {
+			throw std::invalid_argument("journal must be 0 or at least 1M");
+		}
+	}
+	else if (key == "cache") {
+		cache = parse_size(key, value);
+	}
+	else if (key == "cache_min") {
+		cache_min = parse_size(key, value);
+	}
+	else if (key == "readahead") {
+		readahead = parse_size(key, value);
+	}
+	else if (key == "warm_start") {
+		const unsigned long long v = parse_uint(key, value);
+		if (v > 1) {
+			throw std::invalid_argument("warm_start must be 0 or 1");
+		}
+		warm_start = v;
+	}
+	else if (key == "hedge") {
+		hedge = parse_uint(key, value);
+		if (hedge > 99) {
+			throw std::invalid_argument("hedge must be between 0 and 99");
+		}
+	}
+	else if (key == "hedge_budget") {
+		hedge_budget = parse_uint(key, value);
+		if (hedge_budget < 1 || hedge_budget > 100) {
+			throw std::invalid_argument(
+			    "hedge_budget must be between 1 and 100");
+		}
+	}
+	else if (key == "read_bps") {
+		read_bps = parse_size(key, value);
+	}
+	else if (key == "write_bps") {
+		write_bps = parse_size(key, value);
+	}
+	else if (key == "read_iops") {
+		read_iops = parse_uint(key, value);
+	}
+	else if (key == "write_iops") {
+		write_iops = parse_uint(key, value);
+	}
+	else if (key == "burst_ms") {
+		burst_ms = parse_uint(key, value);
+	}
+	else if (key == "io_size") {
+		io_size = parse_size(key, value);
+		if (io_size < 4096) {
+			throw std::invalid_argument("io_size must be at least 4K");
+		}
+	}
+	else if (key == "superblock_size") {
+		// Given in bytes, stored in blocks
+		const unsigned long long size = parse_size(key, value);
+		if (size < 64 * 1024 || size > 256 * 1024 * 1024 ||
+		    (size & (size - 1))) {
+			throw std::invalid_argument(
+			    "superblock_size must be a power of two between 64K and 256M");
+		}
+		superblock_size = size / block_size;
+	}
+	else if (key == "protocol_min" || key == "protocol_max") {
+		static const char *PROTOCOLS[] = {"NT1",     "SMB2",    "SMB2_02",
+		                                  "SMB2_10", "SMB3",    "SMB3_00",
+		                                  "SMB3_02", "SMB3_11", nullptr};
+		const char **p = PROTOCOLS;
+		while (*p && value != *p) {
+			p++;
+		}
+		if (!*p) {
+			throw std::invalid_argument("invalid value for '" + key + "': '" +
+			                            value + "'");
+		}
+		(key == "protocol_min" ? protocol_min : protocol_max) = value;
+	}
+	else if (key == "encryption") {
+		if (value != "none" && value != "request" && value != "require") {
+			throw std::invalid_argument(
+			    "encryption must be one of none, request or require");
+		}
+		encryption = value;
+	}
+	else if (key == "config") {
+		config = value;
+	}
+	else if (key == "timeout") {
+		timeout = parse_uint(key, value);
+	}
+	else if (key == "port") {
+		port = parse_uint(key, value);
+		if (port < 1 || port > 65535) {
+			throw std::invalid_argument("port must be between 1 and 65535");
+		}
+	}
+	else if (key == "buffer_memory") {
+		buffer_memory = parse_size(key, value);
+	}
+	else if (key == "huge_pages") {
+		if (value != "none" && value != "transparent" && value != "explicit") {
+			throw std::invalid_argument(
+			    "huge_pages must be one of none, transparent or explicit");
+		}
+		huge_pages = value;
+	}
+	else if (key == "log") {
+		Log::validate(value);
+		log = value;
+	}
+	else {
+		throw std::invalid_argument("unknown parameter '" + key + "'");
+	}
+}
+
+void SMB::Options::set(const URL &url)
+{
+	for (const std::pair<std::string, std::string> &option : url.options) {
+		set(option.first, option.second);
+	}
+}
+
 /******************************************************************************
  * Struct SMB::Impl                                                           *
  ******************************************************************************/
 
 class SMB::Impl {
 private:
+	// Maximum length of a chain of overlay disks
+	static constexpr size_t MAX_BASES = 16;
+
 	URL m_url;
+	Options m_options;
 	size_t m_block_size;
 	size_t m_superblock_size;
 
-	SMBCCTX *m_ctx;
-
-	smbc_open_fn m_open;
-	smbc_close_fn m_close;
-	smbc_creat_fn m_creat;
-	smbc_lseek_fn m_lseek;
-	smbc_write_fn m_write;
-	smbc_ftruncate_fn m_ftruncate;
-	smbc_fstat_fn m_fstat;
-	smbc_read_fn m_read;
-	smbc_unlink_fn m_unlink;
-	smbc_mkdir_fn m_mkdir;
-	smbc_rmdir_fn m_rmdir;
-	smbc_opendir_fn m_opendir;
-	smbc_closedir_fn m_closedir;
-	smbc_readdir_fn m_readdir;
-	smbc_statvfs_fn m_statvfs;
-
-	class File {
-	private:
-		Impl *m_impl;
-		SMBCFILE *m_file;
+	ContextPool m_pool;
+	Executor m_executor;
 
-		void close()
-		{
-			if (m_file) {
-				int errno_tmp = errno; // Restore errno
-				m_impl->m_close(m_impl->m_ctx, m_file);
-				m_file = nullptr;
-				errno = errno_tmp;
-			}
+	// The disk folder and the chain of read-only folders it is layered over
+	std::unique_ptr<Folder> m_disk;
+	std::vector<std::unique_ptr<Folder>> m_bases;
+
+	// A further disk folder accessed over its own connections
+	struct Target {
+		std::unique_ptr<ContextPool> pool;
+		std::unique_ptr<Folder> disk;
+	};
+
+	// Further folders of a striped disk; the folder of the disk URL is
+	// stripe zero
+	std::vector<Target> m_stripes;
+
+	// Copy of a mirrored disk, and the state keeping both in sync; null
+	// unless the disk is mirrored
+	Target m_mirror_target;
+	std::unique_ptr<Mirror> m_mirror;
+
+	// Superblock-sized buffers; created once the superblock size is known
+	std::unique_ptr<Arena> m_buffers;
+
+	// Create superblocks ahead of sequential writers, one per stripe; empty
+	// if preallocation is disabled
+	std::vector<std::unique_ptr<Preallocator>> m_prealloc;
+
+	// Stores the data of log-structured disks; null for other disks
+	std::unique_ptr<LogStore> m_log;
+
+	// Journals small writes; may be null
+	std::unique_ptr<Journal> m_journal;
+
+	// Caches data read from the disk; may be null
+	std::unique_ptr<Cache> m_cache;
+
+	// Records and restores the working set of the cache; may be null
+	std::unique_ptr<WorkingSet> m_working_set;
+
+	// Adapts the size of the cache to the memory pressure; may be null
+	std::unique_ptr<MemoryPressure> m_pressure;
+
+	// Enforces the bandwidth and IOPS limits; may be null
+	std::unique_ptr<Throttle> m_throttle;
+
+	// Duplicates slow reads; may be null
+	std::unique_ptr<Hedger> m_hedger;
+
+	// Records the superblocks changed in the current backup generation; null
+	// unless changes of the disk are tracked
+	std::unique_ptr<ChangeTracker> m_changes;
+
+	// Connections of the libsmb2 backend, one per share, and the connection
+	// and share-relative path of each folder; empty with the libsmbclient
+	// backend
+	struct Smb2Folder {
+		Smb2Connection *conn;
+		std::string path;
+	};
+	std::map<std::string, std::unique_ptr<Smb2Connection>> m_smb2;
+	std::unordered_map<const Folder *, Smb2Folder> m_smb2_folders;
+
+	// Block following the last read, to detect sequential readers
+	std::atomic<size_t> m_read_next{0};
+
+	// Ranges of superblocks of an overlay disk that are being written. A
+	// copy-up must not interleave with other writes to the superblock, which
+	// may also come from the journal applying writes in the background.
+	std::mutex m_writing_mutex;
+	std::condition_variable m_writing_cond;
+	std::vector<std::pair<size_t, size_t>> m_writing;
+
+	void check_superblocks(const char *what) const
+	{
+		if (m_log) {
+			throw std::runtime_error(std::string(what) +
+			                         " is not supported for log-structured disks");
 		}
+	}
 
-	public:
-		File() : m_impl(nullptr), m_file(nullptr) {}
+	// Index of the stripe holding the given superblock
+	size_t stripe_of(size_t superblock) const
+	{
+		return (superblock / m_options.stripe_width) % (m_stripes.size() + 1);
+	}
 
-		File(Impl *impl, const char *fname, int flags, mode_t mode) noexcept
-		    : m_impl(impl)
-		{
-			m_file = m_impl->m_open(m_impl->m_ctx, fname, flags, mode);
+	Folder &disk(size_t superblock)
+	{
+		const size_t i = stripe_of(superblock);
+		return i == 0 ? *m_disk : *m_stripes[i - 1].disk;
+	}
+
+	ContextPool &pool(size_t superblock)
+	{
+		const size_t i = stripe_of(superblock);
+		return i == 0 ? m_pool : *m_stripes[i - 1].pool;
+	}
+
+	// Folder and connections of the disk folder (side 0) or of the mirror
+	// (side 1) of a mirrored disk
+	Folder &mirror_disk(size_t side)
+	{
+		return side == 0 ? *m_disk : *m_mirror_target.disk;
+	}
+
+	ContextPool &mirror_pool(size_t side)
+	{
+		return side == 0 ? m_pool : *m_mirror_target.pool;
+	}
+
+	// Number of connections over all stripes and the mirror
+	size_t n_contexts() const
+	{
+		return m_options.pool_size * (m_options.stripes.size() + 1 +
+		                              !m_options.mirror.empty());
+	}
+
+	// Superblocks present in any stripe of the disk folder
+	Bitmap disk_allocation()
+	{
+		Bitmap res = m_disk->allocation();
+		for (Target &stripe : m_stripes) {
+			res.merge(stripe.disk->allocation());
+		}
+		if (m_mirror) {
+			res.merge(m_mirror_target.disk->allocation());
+		}
+		return res;
+	}
+
+	// Prefetching uses at most half of the connections, so that foreground
+	// requests are not starved
+	void open_cache(Arena::HugePages huge_pages)
+	{
+		if (m_options.cache == 0) {
+			return;
+		}
+		const size_t page_blocks = Cache::PAGE_SIZE / m_block_size;
+
+		// Fetch consecutive pages with a single read where possible; groups
+		// of a power of two pages never cross a superblock
+		const size_t max_fetch =
+		    std::min(m_options.io_size, m_block_size * m_superblock_size);
+		size_t fetch_pages = 1;
+		while (2 * fetch_pages * Cache::PAGE_SIZE <= max_fetch) {
+			fetch_pages *= 2;
 		}
+		m_cache = std::make_unique<Cache>(
+		    m_options.cache, huge_pages, std::max<size_t>(1, n_contexts() / 2),
+		    fetch_pages,
+		    [this, page_blocks](uint64_t page, size_t count, uint8_t *buf) {
+			    if (m_throttle) {
+				    m_throttle->read(count * Cache::PAGE_SIZE);
+			    }
+			    read_uncached(page * page_blocks, count * page_blocks, buf);
+		    });
+		if (m_options.warm_start) {
+			m_working_set =
+			    std::make_unique<WorkingSet>(m_pool, *m_disk, *m_cache);
+		}
+		if (m_options.cache_min > 0 && m_options.cache_min < m_options.cache) {
+			try {
+				m_pressure = std::make_unique<MemoryPressure>(
+				    MemoryPressure::find_cgroup(), m_options.cache_min,
+				    m_options.cache,
+				    [this](size_t size) { m_cache->resize(size); });
+			}
+			catch (std::exception &e) {
+				SMB_LOG(MEMORY, WARNING, "%s; the cache keeps its size",
+				        e.what());
+			}
+		}
+	}
 
-		~File() noexcept { close(); }
+	static Options with_url_options(const Options &options, const URL &url)
+	{
+		Options res = options;
+		res.set(url);
+		return res;
+	}
 
-		File(const File &) = delete;
-		File &operator=(const File &) = delete;
+	// Marks the superblocks of the given blocks as changed before they are
+	// modified
+	void mark_changed(size_t block_index, size_t block_count)
+	{
+		if (m_changes && block_count > 0) {
+			const size_t last = block_index + block_count - 1;
+			m_changes->mark(block_index / m_superblock_size,
+			                last / m_superblock_size);
+		}
+	}
 
-		File(File &&o) noexcept : m_impl(o.m_impl), m_file(nullptr)
-		{
-			std::swap(m_file, o.m_file);
+	// Resolves the URL of a base folder. The base is either a full URL or a
+	// path on the same server. The base is accessed with the credentials of
+	// the disk URL.
+	URL resolve_base(const std::string &base) const
+	{
+		if (base.compare(0, 6, "smb://") == 0) {
+			return URL(base.c_str());
 		}
-		File &operator=(File &&o) noexcept
-		{
-			close();
-			m_impl = o.m_impl;
-			std::swap(m_file, o.m_file);
-			return *this;
+		URL res;
+		res.host = m_url.host;
+		const size_t i = base.find_first_not_of('/');
+		if (i != std::string::npos) {
+			res.path = base.substr(i);
 		}
+		return res;
+	}
 
-		operator bool() const { return m_file != nullptr; }
+	// Resolves the URL of a stripe or mirror like that of a base. Folders
+	// without credentials of their own use those of the disk URL.
+	URL resolve_target(const std::string &target) const
+	{
+		URL res = resolve_base(target);
+		if (res.user.empty()) {
+			res.workgroup = m_url.workgroup;
+			res.user = m_url.user;
+			res.password = m_url.password;
+		}
+		return res;
+	}
 
-		operator SMBCFILE *() const { return m_file; }
-	};
+	// Connects to the shares of all folders with libsmb2. Folders without
+	// credentials of their own use those of the disk URL, like their
+	// libsmbclient contexts.
+	void open_smb2()
+	{
+		std::vector<Folder *> folders{m_disk.get()};
+		for (Target &stripe : m_stripes) {
+			folders.push_back(stripe.disk.get());
+		}
+		if (m_mirror_target.disk) {
+			folders.push_back(m_mirror_target.disk.get());
+		}
+		for (const std::unique_ptr<Folder> &base : m_bases) {
+			folders.push_back(base.get());
+		}
+		for (Folder *folder : folders) {
+			URL url = folder->url();
+			if (url.user.empty()) {
+				url.workgroup = m_url.workgroup;
+				url.user = m_url.user;
+				url.password = m_url.password;
+			}
+			const std::string key =
+			    url.host + '/' + Smb2Connection::share(url) + '/' + url.user;
+			std::unique_ptr<Smb2Connection> &conn = m_smb2[key];
+			if (!conn) {
+				conn = std::make_unique<Smb2Connection>(url, m_options);
+			}
+			m_smb2_folders[folder] =
+			    Smb2Folder{conn.get(), Smb2Connection::path(url)};
+		}
+	}
 
-	template <typename T>
-	static T err(T status)
+	// Opens the further folders of a striped disk. Each stripe records its
+	// position, so that the stripes cannot be reordered by accident.
+	void open_stripes()
 	{
-		if (status < 0) {
-			throw std::system_error(errno, std::system_category());
+		for (size_t i = 0; i < m_options.stripes.size(); i++) {
+			const URL url = resolve_target(m_options.stripes[i]);
+			Options options = m_options;
+			options.stripe_index = i + 1;
+			Target stripe;
+			stripe.pool = std::make_unique<ContextPool>(url, options);
+			stripe.disk =
+			    std::make_unique<Folder>(*stripe.pool, url, options, false);
+			if (stripe.disk->superblock_bytes() != m_disk->superblock_bytes()) {
+				throw std::runtime_error(
+				    "Stripe " + url.str() + " has a different superblock size");
+			}
+			if (stripe.disk->log_structured() ||
+			    stripe.disk->base() != m_disk->base()) {
+				throw std::runtime_error("Stripe " + url.str() +
+				                         " has a different format or base");
+			}
+			m_stripes.emplace_back(std::move(stripe));
 		}
-		return status;
 	}
 
-	static void auth_data_callback(SMBCCTX *ctx, const char *server,
-	                               const char *share, char *workgroup,
-	                               int max_len_workgroup, char *username,
-	                               int max_len_username, char *password,
-	                               int max_len_password)
+	// Opens the mirror of the disk folder and resynchronizes the two in the
+	// background
+	void open_mirror()
 	{
-/*		std::cerr << "SMB: Authentication request for \\\\" << server
-		          << "\\" << share << std::endl;*/
+		if (!m_options.stripes.empty() || !m_bases.empty()) {
+			throw std::runtime_error(
+			    "Mirrored disks cannot be striped or overlays");
+		}
+		const URL url = resolve_target(m_options.mirror);
+		m_mirror_target.pool = std::make_unique<ContextPool>(url, m_options);
+		m_mirror_target.disk = std::make_unique<Folder>(
+		    *m_mirror_target.pool, url, m_options, false);
+		const Folder &mirror = *m_mirror_target.disk;
+		if (mirror.superblock_bytes() != m_disk->superblock_bytes() ||
+		    mirror.log_structured() || !mirror.base().empty()) {
+			throw std::runtime_error("Mirror " + url.str() +
+			                         " has a different format");
+		}
 
-		// Fetch a reference at the impl object
-		Impl *self = static_cast<Impl *>(smbc_getOptionUserData(ctx));
+		m_mirror = std::make_unique<Mirror>(
+		    Mirror::Side{&m_pool, m_disk.get()},
+		    Mirror::Side{m_mirror_target.pool.get(), m_mirror_target.disk.get()},
+		    m_executor, m_options, [this](size_t src, size_t dst, size_t sb) {
+			    ContextPool::Lease ctx = mirror_pool(dst).acquire();
+			    if (mirror_disk(src).is_allocated(sb)) {
+				    mirror_disk(dst).copy_from(*ctx, mirror_disk(src), sb,
+				                               *m_buffers);
+			    }
+			    else {
+				    mirror_disk(dst).remove(*ctx, sb);
+			    }
+		    });
+	}
 
-		// Reset the workgroup, username and password
-		std::memset(workgroup, 0, max_len_workgroup);
-		std::memset(username, 0, max_len_username);
-		std::memset(password, 0, max_len_password);
+	// Opens the chain of read-only folders starting at the given base
+	void open_bases(std::string base)
+	{
+		while (!base.empty()) {
+			if (m_bases.size() >= MAX_BASES) {
+				throw std::runtime_error("Too many nested base disks");
+			}
+			m_bases.emplace_back(std::make_unique<Folder>(
+			    m_pool, resolve_base(base), m_options, true));
+			base = m_bases.back()->base();
+		}
+	}
 
-		// Copy the data from the URL into the provided memory regions
-		const URL &url = self->m_url;
-		if (!url.workgroup.empty()) {
-			std::strncpy(workgroup, url.workgroup.c_str(), max_len_workgroup);
+	// Returns the topmost folder containing the given superblock. Of the two
+	// sides of a mirrored disk, only one holding the current data is used.
+	Folder *find_superblock(size_t superblock)
+	{
+		Folder &folder = m_mirror
+		                     ? mirror_disk(m_mirror->clean_side(superblock))
+		                     : disk(superblock);
+		if (folder.is_allocated(superblock)) {
+			return &folder;
 		}
-		std::strncpy(username, url.user.c_str(), max_len_username);
-		std::strncpy(password, url.password.c_str(), max_len_password);
+		for (const std::unique_ptr<Folder> &base : m_bases) {
+			if (base->is_allocated(superblock)) {
+				return base.get();
+			}
+		}
+		return nullptr;
 	}
 
-	static char nibble_to_hex(uint8_t x)
+	// Returns whether one of the base folders holds the given superblock,
+	// which must then not be deleted from the disk folder
+	bool in_base(size_t superblock) const
 	{
-		return x < 10 ? ('0' + x) : ('a' + (x - 10));
-	};
+		for (const std::unique_ptr<Folder> &base : m_bases) {
+			if (base->is_allocated(superblock)) {
+				return true;
+			}
+		}
+		return false;
+	}
 
-	bool make_block_filename(size_t idx, char *s) const
+	// Copies a superblock that only exists in one of the base folders into
+	// the disk folder before it is partially overwritten
+	void copy_up(Context &ctx, size_t superblock)
 	{
-		size_t block_idx = idx / m_superblock_size;
-		for (size_t i = 0; i < 8; i++) {
-			(*s++) = nibble_to_hex(((block_idx >> (8 * i)) & 0x0F) >> 0);
-			if (i == 1) {
-				(*s++) = '/';
+		for (const std::unique_ptr<Folder> &base : m_bases) {
+			if (base->is_allocated(superblock)) {
+				disk(superblock).copy_from(ctx, *base, superblock, *m_buffers);
+				return;
 			}
-			(*s++) = nibble_to_hex(((block_idx >> (8 * i)) & 0xF0) >> 4);
 		}
-		return (block_idx * m_superblock_size) == idx;
 	}
 
-	template <typename F>
-	void iterate_blocks(F callback, size_t block_index, size_t block_count,
-	                    int flags, mode_t mode)
-	{
-		const __off_t size = m_block_size * m_superblock_size;
-
-		// Prepare a buffer containing the block filename
-		std::string path = m_url.str() + "000/0000000000000.img";
-		char *s = const_cast<char *>(path.c_str()) + (path.size() - 21);
-
-		// Iterate over the individual blocks
-		const bool writing = (flags & O_RDWR) || (flags & O_WRONLY);
-		File file;
-		size_t i0 = 0;
-		for (size_t i = 0; i < block_count; i++) {
-			// If this is the first index or we're at a superblock boundary,
-			// open a new file
-			if (((i == 0) | make_block_filename(block_index + i, s))) {
-				if (i > 0) {
-					callback(i0, i - i0, file);
-				}
-				i0 = i;
+	// A contiguous part of a request within a single superblock
+	struct Chunk {
+		size_t superblock;
+		size_t offs;      // Byte offset within the superblock
+		size_t size;      // Number of bytes
+		size_t buf_offs;  // Byte offset within the request buffer
+	};
 
-				// Try to open the file
-				file = std::move(File(this, path.c_str(), flags, mode));
+	// Excludes other writes to the superblocks of a request on overlay disks
+	class WriteLock {
+	private:
+		Impl &m_impl;
+		std::pair<size_t, size_t> m_range;
 
-				// Opening the file failed.
-				if (!file) {
-					// The directory we're refering to does not exist.
-					if (errno == ENOENT) {
-						// Don't despair if we don't try to write. In this case
-						// just don't open the file.
-						if (writing) {
-							// Otherwise, try to create the directory.
-							s[3] = '\0';
-							int res = m_mkdir(m_ctx, path.c_str(), 0770);
-							s[3] = '/';
-
-							// It's okay if someone else created the directory
-							// for us. However, any other error is a failure.
-							if (res < 0 && errno != EEXIST) {
-								err(-1);
-							}
-
-							// Now that we've created the directory, try to open
-							// the file.
-							file = std::move(File(this, path.c_str(), flags, mode));
-							if (!file) {
-								err(-1);
-							}
-						}
-					}
-					else {
-						err(-1);
+	public:
+		WriteLock(Impl &impl, const std::vector<Chunk> &chunks)
+		    : m_impl(impl), m_range(1, 0)
+		{
+			if (m_impl.m_bases.empty() || chunks.empty()) {
+				return;
+			}
+			m_range = {chunks.front().superblock, chunks.back().superblock};
+			const auto overlaps = [this]() {
+				for (const std::pair<size_t, size_t> &r : m_impl.m_writing) {
+					if (r.first <= m_range.second && m_range.first <= r.second) {
+						return true;
 					}
 				}
+				return false;
+			};
+			std::unique_lock<std::mutex> lock(m_impl.m_writing_mutex);
+			m_impl.m_writing_cond.wait(lock, [&]() { return !overlaps(); });
+			m_impl.m_writing.push_back(m_range);
+		}
 
-				// Make sure the file has the right size
-				if (writing) {
-					struct stat st;
-					err(m_fstat(m_ctx, file, &st));
-					if (st.st_size != size) {
-						err(m_ftruncate(m_ctx, file, size));
-					}
+		~WriteLock()
+		{
+			if (m_range.first > m_range.second) {
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(m_impl.m_writing_mutex);
+				std::vector<std::pair<size_t, size_t>> &writing =
+				    m_impl.m_writing;
+				writing.erase(std::find(writing.begin(), writing.end(), m_range));
+			}
+			m_impl.m_writing_cond.notify_all();
+		}
+
+		WriteLock(const WriteLock &) = delete;
+		WriteLock &operator=(const WriteLock &) = delete;
+	};
+
+	// Splits a request into chunks of at most io_size bytes that do not
+	// cross superblock boundaries
+	std::vector<Chunk> make_chunks(size_t block_index, size_t block_count) const
+	{
+		std::vector<Chunk> res;
+		const size_t sb_bytes = m_block_size * m_superblock_size;
+		const size_t start = block_index * m_block_size;
+		const size_t end = start + block_count * m_block_size;
+		for (size_t pos = start; pos < end;) {
+			const size_t offs = pos % sb_bytes;
+			const size_t size =
+			    std::min({end - pos, sb_bytes - offs, m_options.io_size});
+			res.push_back(Chunk{pos / sb_bytes, offs, size, pos - start});
+			pos += size;
+		}
+		return res;
+	}
+
+	// Number of chunks at the given index that belong to the same superblock
+	static size_t superblock_chunks(const std::vector<Chunk> &chunks, size_t i)
+	{
+		size_t j = i;
+		while (j < chunks.size() && chunks[j].superblock == chunks[i].superblock) {
+			j++;
+		}
+		return j - i;
+	}
+
+	// Transfers a chunk of an existing superblock file over the libsmb2
+	// connection of its folder. Returns false if the chunk has to be
+	// transferred over libsmbclient instead, which also handles superblocks
+	// that do not exist yet.
+	bool transfer_smb2(Folder &folder, const Chunk &chunk, const uint8_t *src,
+	                   uint8_t *dst)
+	{
+		const auto it = m_smb2_folders.find(&folder);
+		if (it == m_smb2_folders.end() ||
+		    !folder.is_allocated(chunk.superblock)) {
+			return false;
+		}
+		const std::string path =
+		    it->second.path + folder.filename(chunk.superblock);
+		try {
+			if (src) {
+				it->second.conn->write(path, chunk.offs, src + chunk.buf_offs,
+				                       chunk.size);
+			}
+			else {
+				it->second.conn->read(path, chunk.offs, dst + chunk.buf_offs,
+				                      chunk.size);
+			}
+		}
+		catch (std::system_error &e) {
+			if (e.code().value() != ENOENT) {
+				throw;
+			}
+			return false;
+		}
+		return true;
+	}
+
+	void read_chunk(ContextPool &pool, Folder &folder, const Chunk &chunk,
+	                uint8_t *buf)
+	{
+		// Read from the topmost folder containing the superblock
+		if (!m_smb2_folders.empty()) {
+			Folder *src = &folder;
+			for (size_t j = 0; !src->is_allocated(chunk.superblock); j++) {
+				if (j == m_bases.size()) {
+					memset(buf + chunk.buf_offs, 0, chunk.size);
+					return;
 				}
+				src = m_bases[j].get();
+			}
+			if (transfer_smb2(*src, chunk, nullptr, buf)) {
+				return;
+			}
+		}
+		read_chunk(*pool.acquire(), folder, chunk, buf);
+	}
+
+	void read_chunk(Context &ctx, Folder &folder, const Chunk &chunk,
+	                uint8_t *buf)
+	{
+		// Read from the topmost folder containing the superblock
+		File file = folder.open(ctx, chunk.superblock, false);
+		for (size_t j = 0; !file && j < m_bases.size(); j++) {
+			file = m_bases[j]->open(ctx, chunk.superblock, false);
+		}
+		if (file) {
+			err(ctx.lseek(file, chunk.offs, SEEK_SET));
+			ctx.read_full(file, buf + chunk.buf_offs, chunk.size);
+		}
+		else {
+			memset(buf + chunk.buf_offs, 0, chunk.size);
+		}
+	}
+
+	void write_chunk(ContextPool &pool, Folder &folder, const Chunk &chunk,
+	                 const uint8_t *buf)
+	{
+		if (!buf || !transfer_smb2(folder, chunk, buf, nullptr)) {
+			write_chunk(*pool.acquire(), folder, chunk, buf);
+		}
+	}
+
+	void write_chunk(Context &ctx, Folder &folder, const Chunk &chunk,
+	                 const uint8_t *buf)
+	{
+		File file = folder.open(ctx, chunk.superblock, true);
+		if (buf) {
+			err(ctx.lseek(file, chunk.offs, SEEK_SET));
+			ctx.write_full(file, buf + chunk.buf_offs, chunk.size);
+		}
+	}
 
-				// Seek to the correct location in the file
-				m_lseek(m_ctx, file, ((block_index + i) * m_block_size) % size, SEEK_SET);
+	// Superblocks that are not entirely overwritten must first be copied from
+	// the base disk. This must be done before any chunk of the superblock is
+	// written.
+	void copy_up_partial(const std::vector<Chunk> &chunks)
+	{
+		if (m_bases.empty()) {
+			return;
+		}
+		std::vector<size_t> copy;
+		const size_t sb_bytes = m_block_size * m_superblock_size;
+		for (size_t i = 0, n; i < chunks.size(); i += n) {
+			n = superblock_chunks(chunks, i);
+			size_t size = 0;
+			for (size_t j = i; j < i + n; j++) {
+				size += chunks[j].size;
+			}
+			const size_t sb = chunks[i].superblock;
+			if (size < sb_bytes && !disk(sb).is_allocated(sb)) {
+				copy.push_back(sb);
 			}
 		}
-		callback(i0, block_count - i0, file);
+		m_executor.run(copy.size(), [&](size_t i) {
+			copy_up(*pool(copy[i]).acquire(), copy[i]);
+		});
 	}
 
+	// Processes the chunks of a request. Multiple chunks are transferred in
+	// parallel, each over its own context from the pool of its stripe or
+	// over the libsmb2 connection of its folder.
+	template <typename F>
+	void run_chunks(const std::vector<Chunk> &chunks,
+	                [[maybe_unused]] bool writing, F f)
+	{
+		// Only the probes use writing; errors other than I/O errors are
+		// reported as EIO
+		auto run = [&](const Chunk &chunk) {
+			SMB_PROBE4(chunk_entry, chunk.superblock, chunk.offs, chunk.size,
+			           writing);
+			try {
+				f(chunk);
+			}
+			catch (std::system_error &e) {
+				SMB_PROBE4(chunk_return, chunk.superblock, chunk.size, writing,
+				           e.code().value());
+				throw;
+			}
+			catch (...) {
+				SMB_PROBE4(chunk_return, chunk.superblock, chunk.size, writing,
+				           EIO);
+				throw;
+			}
+			SMB_PROBE4(chunk_return, chunk.superblock, chunk.size, writing, 0);
+		};
+		if (chunks.size() == 1) {
+			run(chunks[0]);
+			return;
+		}
+		m_executor.run(chunks.size(), [&](size_t i) { run(chunks[i]); });
+	}
 
-	static void log_callback(void *private_ptr, int level, const char *msg) {
-		std::cerr << "libsmbclient: " << msg << std::endl;
+	// Writes the chunks and removes the superblocks on both sides of a
+	// mirrored disk. The writes keep a copy of the data, since a side that
+	// lags behind may still write it after the request has completed.
+	void write_mirrored(const std::vector<Chunk> &chunks, const uint8_t *buf,
+	                    size_t size, const std::vector<size_t> &removes)
+	{
+		std::vector<size_t> superblocks;
+		for (const Chunk &chunk : chunks) {
+			superblocks.push_back(chunk.superblock);
+		}
+		superblocks.insert(superblocks.end(), removes.begin(), removes.end());
+		std::shared_ptr<const std::vector<uint8_t>> data;
+		if (buf) {
+			data = std::make_shared<const std::vector<uint8_t>>(buf, buf + size);
+		}
+		m_mirror->write(superblocks, [this, chunks, removes, data](size_t side,
+		                                                             size_t i) {
+			if (i < chunks.size()) {
+				write_chunk(mirror_pool(side), mirror_disk(side), chunks[i],
+				            data ? data->data() : nullptr);
+			}
+			else {
+				mirror_disk(side).remove(*mirror_pool(side).acquire(),
+				                         removes[i - chunks.size()]);
+			}
+		});
+	}
+
+	// Reads a chunk from the side of a mirrored disk that is expected to
+	// respond first, or from the side other than avoid; a failed read is
+	// retried on the other side. The side read from first is stored in
+	// chosen if given.
+	void read_mirrored(const Chunk &chunk, uint8_t *buf,
+	                   size_t avoid = Mirror::N_SIDES,
+	                   std::atomic<size_t> *chosen = nullptr)
+	{
+		while (true) {
+			const size_t side = m_mirror->read_begin(chunk.superblock, avoid);
+			if (chosen) {
+				chosen->store(side);
+				chosen = nullptr;
+			}
+			avoid = Mirror::N_SIDES;
+			const std::chrono::steady_clock::time_point start =
+			    std::chrono::steady_clock::now();
+			try {
+				read_chunk(mirror_pool(side), mirror_disk(side), chunk, buf);
+			}
+			catch (std::system_error &) {
+				m_mirror->read_done(side, start, true);
+				continue;
+			}
+			m_mirror->read_done(side, start, false);
+			return;
+		}
+	}
+
+	// Reads a chunk, duplicating the read on another connection, or on the
+	// other side of a mirrored disk, if it is slow. The duplicate counts
+	// against the bandwidth and IOPS limits.
+	void read_hedged(const Chunk &chunk, uint8_t *buf)
+	{
+		const std::shared_ptr<std::atomic<size_t>> side =
+		    std::make_shared<std::atomic<size_t>>(Mirror::N_SIDES);
+		Chunk part = chunk;
+		part.buf_offs = 0;
+		const Hedger::Read read = [this, part, side](bool hedge, uint8_t *buf) {
+			if (hedge && m_throttle) {
+				m_throttle->read(part.size);
+			}
+			if (m_mirror) {
+				read_mirrored(part, buf, hedge ? side->load() : Mirror::N_SIDES,
+				              hedge ? nullptr : side.get());
+				return;
+			}
+			read_chunk(pool(part.superblock), disk(part.superblock), part, buf);
+		};
+		m_hedger->read(chunk.size, buf + chunk.buf_offs, read);
 	}
 
 public:
-	Impl(const URL &url, size_t block_size, size_t superblock_size)
+	Impl(const URL &url, const Options &options)
 	    : m_url(url),
-	      m_block_size(block_size),
-	      m_superblock_size(superblock_size)
+	      m_options(with_url_options(options, url)),
+	      m_pool(url, m_options),
+	      m_executor(n_contexts() - 1)
 	{
-		// Create and initialize a new context
-		m_ctx = smbc_new_context();
-		if ((!m_ctx) || (smbc_init_context(m_ctx) != m_ctx)) {
-			err(-1);
+		if (!m_options.log.empty()) {
+			Log::configure(m_options.log);
+		}
+		if (Throttle::enabled(m_options)) {
+			m_throttle = std::make_unique<Throttle>(m_options);
 		}
 
-		smbc_setOptionUserData(m_ctx, this);
-		smbc_setOptionNoAutoAnonymousLogin(m_ctx, true);
-		smbc_setOptionUseCCache(m_ctx, false);
-
+		// A new overlay disk uses the superblock size of its base, so the
+		// base chain is opened first if it is given
+		if (!m_options.base.empty()) {
+			m_options.base = resolve_base(m_options.base).str();
+			open_bases(m_options.base);
+			m_options.superblock_size = m_bases[0]->superblock_size();
+		}
+		const bool striped = !m_options.stripes.empty();
+		const bool mirrored = !m_options.mirror.empty();
+		if ((striped || mirrored) && m_options.format == "log") {
+			throw std::runtime_error(
+			    "Log-structured disks cannot be striped or mirrored");
+		}
+		if (m_options.journal > 0 && m_options.format == "log") {
+			throw std::runtime_error(
+			    "Log-structured disks cannot have a journal");
+		}
+		m_disk = std::make_unique<Folder>(m_pool, m_url, m_options, false);
+		m_block_size = m_disk->block_size();
+		m_superblock_size = m_disk->superblock_size();
+		ChangeTracker::Map changes;
+		if (ChangeTracker::load(*m_pool.acquire(), m_url, changes)) {
+			if (changes.superblock_bytes != m_disk->superblock_bytes()) {
+				throw std::runtime_error(
+				    "Change map has a different superblock size");
+			}
+			m_changes = std::make_unique<ChangeTracker>(
+			    m_pool, m_url, std::move(changes), m_disk->superblock_bytes());
+		}
+		if ((striped || mirrored) && m_disk->log_structured()) {
+			throw std::runtime_error(
+			    "Log-structured disks cannot be striped or mirrored");
+		}
+		if (m_options.journal > 0 && m_disk->log_structured()) {
+			throw std::runtime_error(
+			    "Log-structured disks cannot have a journal");
+		}
+		if (striped) {
+			open_stripes();
+		}
 
-		smbc_setDebug(m_ctx, 5);
-		smbc_setLogCallback(m_ctx, nullptr, log_callback);
+		// Every context must be able to get a buffer at the same time
+		const size_t sb_bytes = m_block_size * m_superblock_size;
+		const Arena::HugePages huge_pages =
+		    m_options.huge_pages == "explicit"
+		        ? Arena::EXPLICIT
+		        : m_options.huge_pages == "transparent" ? Arena::TRANSPARENT
+		                                                : Arena::NONE;
+		m_buffers = std::make_unique<Arena>(
+		    sb_bytes,
+		    std::max(m_options.buffer_memory, n_contexts() * sb_bytes),
+		    huge_pages);
+		if (m_bases.empty()) {
+			open_bases(m_disk->base());
+		}
+		for (const std::unique_ptr<Folder> &base : m_bases) {
+			if (base->superblock_bytes() != m_disk->superblock_bytes()) {
+				throw std::runtime_error(
+				    "Base disk has a different superblock size");
+			}
+		}
 
+		if (m_disk->log_structured()) {
+			if (!m_bases.empty()) {
+				throw std::runtime_error(
+				    "Log-structured disks cannot be overlays");
+			}
+			m_log = std::make_unique<LogStore>(m_pool, *m_disk, m_options);
+			open_cache(huge_pages);
+			return;
+		}
+		if (mirrored) {
+			open_mirror();
+		}
+		if (m_options.backend == "libsmb2") {
+			open_smb2();
+		}
 
-		// Fetch all required function pointers
-		m_open = smbc_getFunctionOpen(m_ctx);
-		m_close = smbc_getFunctionClose(m_ctx);
-		m_creat = smbc_getFunctionCreat(m_ctx);
-		m_lseek = smbc_getFunctionLseek(m_ctx);
-		m_ftruncate = smbc_getFunctionFtruncate(m_ctx);
-		m_fstat = smbc_getFunctionFstat(m_ctx);
-		m_write = smbc_getFunctionWrite(m_ctx);
-		m_read = smbc_getFunctionRead(m_ctx);
-		m_unlink = smbc_getFunctionUnlink(m_ctx);
-		m_mkdir = smbc_getFunctionMkdir(m_ctx);
-		m_rmdir = smbc_getFunctionRmdir(m_ctx);
-		m_opendir = smbc_getFunctionOpendir(m_ctx);
-		m_closedir = smbc_getFunctionClosedir(m_ctx);
-		m_readdir = smbc_getFunctionReaddir(m_ctx);
-		m_statvfs = smbc_getFunctionStatVFS(m_ctx);
+		// Superblocks inherited from a base must be copied up, not created.
+		// Each stripe creates its own superblocks.
+		for (size_t i = 0; m_options.prealloc > 0 && i <= m_stripes.size();
+		     i++) {
+			m_prealloc.emplace_back(std::make_unique<Preallocator>(
+			    i == 0 ? m_pool : *m_stripes[i - 1].pool,
+			    i == 0 ? *m_disk : *m_stripes[i - 1].disk, m_options.prealloc,
+			    (m_options.disk_size + sb_bytes - 1) / sb_bytes,
+			    [this, i](size_t sb) {
+				    return stripe_of(sb) == i && !find_superblock(sb);
+			    }));
+		}
+		if (Hedger::enabled(m_options)) {
+			m_hedger = std::make_unique<Hedger>(m_options, n_contexts(),
+			                                    *m_buffers);
+		}
+		if (m_options.prealloc > 0 && m_mirror) {
+			m_prealloc.emplace_back(std::make_unique<Preallocator>(
+			    *m_mirror_target.pool, *m_mirror_target.disk,
+			    m_options.prealloc,
+			    (m_options.disk_size + sb_bytes - 1) / sb_bytes,
+			    [this](size_t sb) { return !find_superblock(sb); }));
+		}
 
-		// Set the auth data callback
-		smbc_setFunctionAuthDataWithContext(m_ctx, auth_data_callback);
+		// Writes left in the journal are applied in either case
+		const Journal::Apply apply = [this](uint64_t block, size_t count,
+		                                    const uint8_t *buf) {
+			write_direct(block, count, buf);
+		};
+		if (m_options.journal > 0) {
+			m_journal = std::make_unique<Journal>(*m_disk, m_options,
+			                                      m_options.journal, apply);
+		}
+		else {
+			Journal::recover(m_pool, *m_disk, m_options, apply);
+		}
+		open_cache(huge_pages);
 	}
 
 	~Impl()
 	{
-		if (m_ctx) {
-			smbc_free_context(m_ctx, true);
+		m_pressure.reset();
+		if (m_working_set) {
+			try {
+				m_working_set->close();
+			}
+			catch (std::exception &e) {
+				SMB_LOG(MEMORY, ERROR, "Cannot record the working set: %s",
+				        e.what());
+			}
+			m_working_set.reset();
+		}
+		if (m_cache) {
+			const CacheStats stats = m_cache->stats();
+			SMB_LOG(MEMORY, INFO,
+			        "Cache: %zu hits, %zu misses, %zu pages prefetched, "
+			        "%zu warmed, %zu evicted",
+			        stats.hits, stats.misses, stats.prefetched, stats.warmed,
+			        stats.evicted);
+			m_cache.reset();
+		}
+		if (m_hedger) {
+			const HedgeStats stats = m_hedger->stats();
+			SMB_LOG(IO, INFO,
+			        "Hedged %zu of %zu reads, %zu completed first, %zu denied "
+			        "by the budget",
+			        stats.hedged, stats.reads, stats.won, stats.denied);
+			m_hedger.reset();
+		}
+		if (m_throttle) {
+			const QosStats stats = m_throttle->stats();
+			SMB_LOG(IO, INFO,
+			        "Throttled %zu of %zu reads for %llu ms, %zu of %zu writes "
+			        "for %llu ms",
+			        stats.reads_throttled, stats.reads,
+			        (unsigned long long)stats.read_throttled_us / 1000,
+			        stats.writes_throttled, stats.writes,
+			        (unsigned long long)stats.write_throttled_us / 1000);
+		}
+		try {
+			if (m_journal) {
+				m_journal->close();
+			}
+		}
+		catch (std::exception &e) {
+			SMB_LOG(DISK, ERROR, "Cannot apply the journal: %s", e.what());
+		}
+		m_journal.reset();
+		if (m_mirror) {
+			try {
+				m_mirror->close();
+			}
+			catch (std::exception &e) {
+				SMB_LOG(DISK, ERROR, "Cannot record the mirror map: %s",
+				        e.what());
+			}
+			const MirrorStats stats = m_mirror->stats();
+			SMB_LOG(DISK, INFO,
+			        "Mirror: %zu reads from the disk, %zu from the mirror, "
+			        "%zu lagging writes, %zu superblocks resynchronized, "
+			        "%zu out of sync",
+			        stats.primary_reads, stats.mirror_reads, stats.lagged,
+			        stats.resynced, stats.dirty);
+			m_mirror.reset();
+		}
+		m_prealloc.clear();
+		try {
+			if (m_log) {
+				m_log->close();
+			}
+			m_disk->close(*m_pool.acquire());
+			for (Target &stripe : m_stripes) {
+				stripe.disk->close(*stripe.pool->acquire());
+			}
+			if (m_mirror_target.disk) {
+				m_mirror_target.disk->close(*m_mirror_target.pool->acquire());
+			}
+		}
+		catch (std::exception &e) {
+			SMB_LOG(DISK, ERROR, "Cannot save the allocation index: %s",
+			        e.what());
 		}
-		m_ctx = nullptr;
 	}
 
 	size_t block_size() const { return m_block_size; }
@@ -385,33 +1289,483 @@ public:
 
 		// Use statvfs to get information about the filesystem
 		const std::string path = m_url.str();
-		err(m_statvfs(m_ctx, const_cast<char *>(path.c_str()), &info));
+		err(m_pool.acquire()->statvfs(path.c_str(), &info));
 
 		// Copy the information to the result structure
 		const size_t block_size = size_t(info.f_bsize) * size_t(info.f_frsize);
 		res.size = block_size * size_t(info.f_blocks);
 		res.free = block_size * size_t(info.f_bfree);
 
+		// The stripes add the space of their shares
+		for (Target &stripe : m_stripes) {
+			const std::string path = stripe.disk->url().str();
+			err(stripe.pool->acquire()->statvfs(path.c_str(), &info));
+			const size_t block_size =
+			    size_t(info.f_bsize) * size_t(info.f_frsize);
+			res.size += block_size * size_t(info.f_blocks);
+			res.free += block_size * size_t(info.f_bfree);
+		}
+
 		return res;
 	}
 
 	void write_block(size_t block_index, size_t block_count, const uint8_t *buf)
 	{
-		iterate_blocks([&] (size_t i, size_t c, File &file) {
+		SMB_LOG(IO, TRACE, "%s %zu blocks at block %zu",
+		        buf ? "write" : "allocate", block_count, block_index);
+		if (buf) {
+			mark_changed(block_index, block_count);
+		}
+		if (m_throttle && buf) {
+			m_throttle->write(block_count * m_block_size);
+		}
+		if (!m_cache || !buf) {
+			write_uncached(block_index, block_count, buf);
+			return;
+		}
+		try {
+			write_uncached(block_index, block_count, buf);
+		}
+		catch (...) {
+			m_cache->invalidate(block_index * m_block_size,
+			                    block_count * m_block_size);
+			throw;
+		}
+		m_cache->write(block_index * m_block_size, block_count * m_block_size,
+		               buf);
+	}
+
+	void write_uncached(size_t block_index, size_t block_count,
+	                    const uint8_t *buf)
+	{
+		if (m_log) {
 			if (buf) {
-				m_write(m_ctx, file, &buf[m_block_size * i], m_block_size * c);
+				m_log->write(block_index, block_count, buf);
+			}
+			return;
+		}
+		if (m_journal) {
+			if (buf && m_journal->write(block_index, block_count, buf)) {
+				return;
+			}
+			m_journal->bypass(block_index, block_count);
+		}
+		write_direct(block_index, block_count, buf);
+	}
+
+	void write_direct(size_t block_index, size_t block_count,
+	                  const uint8_t *buf)
+	{
+		const std::vector<Chunk> chunks = make_chunks(block_index, block_count);
+		WriteLock lock(*this, chunks);
+		if (m_mirror) {
+			write_mirrored(chunks, buf, block_count * m_block_size, {});
+			for (const std::unique_ptr<Preallocator> &prealloc : m_prealloc) {
+				prealloc->written(chunks.front().superblock,
+				                  chunks.back().superblock);
+			}
+			return;
+		}
+		copy_up_partial(chunks);
+		run_chunks(chunks, true, [&](const Chunk &chunk) {
+			write_chunk(pool(chunk.superblock), disk(chunk.superblock), chunk,
+			            buf);
+		});
+		for (const std::unique_ptr<Preallocator> &prealloc : m_prealloc) {
+			prealloc->written(chunks.front().superblock,
+			                  chunks.back().superblock);
+		}
+	}
+
+	void zero_block(size_t block_index, size_t block_count, bool may_trim)
+	{
+		SMB_LOG(IO, TRACE, "zero %zu blocks at block %zu", block_count,
+		        block_index);
+		mark_changed(block_index, block_count);
+		if (m_throttle) {
+			m_throttle->write(0);  // Only counts as an operation
+		}
+		if (!m_cache) {
+			zero_uncached(block_index, block_count, may_trim);
+			return;
+		}
+		try {
+			zero_uncached(block_index, block_count, may_trim);
+		}
+		catch (...) {
+			m_cache->invalidate(block_index * m_block_size,
+			                    block_count * m_block_size);
+			throw;
+		}
+		m_cache->write(block_index * m_block_size, block_count * m_block_size,
+		               nullptr);
+	}
+
+	void zero_uncached(size_t block_index, size_t block_count, bool may_trim)
+	{
+		if (m_log) {
+			m_log->write(block_index, block_count, nullptr);
+			return;
+		}
+		if (m_journal) {
+			m_journal->bypass(block_index, block_count);
+		}
+		const std::vector<Chunk> chunks = make_chunks(block_index, block_count);
+		WriteLock lock(*this, chunks);
+		const size_t sb_bytes = m_block_size * m_superblock_size;
+
+		// Superblocks that do not exist already read as zeros. If trimming
+		// is allowed, superblocks that are zeroed entirely are deleted unless
+		// they hide data of a base disk; zeros are written to all others.
+		std::vector<Chunk> writes;
+		std::vector<size_t> removes;
+		for (size_t i = 0, n; i < chunks.size(); i += n) {
+			n = superblock_chunks(chunks, i);
+			const size_t sb = chunks[i].superblock;
+			Folder *folder = find_superblock(sb);
+			if (!folder) {
+				continue;
 			}
-		}, block_index, block_count, O_CREAT | O_WRONLY, 0770);
+			size_t size = 0;
+			for (size_t j = i; j < i + n; j++) {
+				size += chunks[j].size;
+			}
+			if (may_trim && size == sb_bytes && !in_base(sb)) {
+				removes.push_back(sb);
+				continue;
+			}
+			for (size_t j = i; j < i + n; j++) {
+				writes.push_back(chunks[j]);
+				writes.back().buf_offs = 0;
+			}
+		}
+
+		const std::vector<uint8_t> zeros(
+		    writes.empty() ? 0 : std::min(m_options.io_size, sb_bytes));
+		if (m_mirror) {
+			write_mirrored(writes, zeros.data(), zeros.size(), removes);
+			return;
+		}
+		m_executor.run(removes.size(), [&](size_t i) {
+			const size_t sb = removes[i];
+			disk(sb).remove(*pool(sb).acquire(), sb);
+		});
+		if (!writes.empty()) {
+			copy_up_partial(writes);
+			run_chunks(writes, true, [&](const Chunk &chunk) {
+				write_chunk(pool(chunk.superblock), disk(chunk.superblock),
+				            chunk, zeros.data());
+			});
+		}
 	}
 
-	void read_block(size_t block_index, size_t block_count, uint8_t *buf) {
-		iterate_blocks([&] (size_t i, size_t c, File &file) {
-			if (file) {
-				m_read(m_ctx, file, &buf[m_block_size * i], m_block_size * c);
-			} else {
-				memset(&buf[m_block_size * i], 0, m_block_size * c);
+	void trim_block(size_t block_index, size_t block_count)
+	{
+		SMB_LOG(IO, TRACE, "trim %zu blocks at block %zu", block_count,
+		        block_index);
+
+		// Trimming is advisory, so only superblocks that are covered entirely
+		// are discarded
+		const size_t first =
+		    (block_index + m_superblock_size - 1) / m_superblock_size;
+		const size_t last = (block_index + block_count) / m_superblock_size;
+		if (first >= last) {
+			return;
+		}
+		block_index = first * m_superblock_size;
+		block_count = (last - first) * m_superblock_size;
+		mark_changed(block_index, block_count);
+		if (m_throttle) {
+			m_throttle->write(0);  // Only counts as an operation
+		}
+		try {
+			trim_uncached(block_index, block_count);
+		}
+		catch (...) {
+			if (m_cache) {
+				m_cache->invalidate(block_index * m_block_size,
+				                    block_count * m_block_size);
 			}
-		}, block_index, block_count, O_RDONLY, 0770);
+			throw;
+		}
+		// Superblocks hiding data of a base disk are kept
+		if (m_cache) {
+			m_cache->invalidate(block_index * m_block_size,
+			                    block_count * m_block_size);
+		}
+	}
+
+	// Deletes the given whole superblocks unless they hide data of a base
+	// disk; log-structured disks record them as zeroed instead
+	void trim_uncached(size_t block_index, size_t block_count)
+	{
+		if (m_log) {
+			m_log->write(block_index, block_count, nullptr);
+			return;
+		}
+		if (m_journal) {
+			m_journal->bypass(block_index, block_count);
+		}
+		const std::vector<Chunk> chunks = make_chunks(block_index, block_count);
+		WriteLock lock(*this, chunks);
+		std::vector<size_t> removes;
+		for (size_t sb = chunks.front().superblock;
+		     sb <= chunks.back().superblock; sb++) {
+			if (find_superblock(sb) && !in_base(sb)) {
+				removes.push_back(sb);
+			}
+		}
+		if (m_mirror) {
+			if (!removes.empty()) {
+				write_mirrored({}, nullptr, 0, removes);
+			}
+			return;
+		}
+		m_executor.run(removes.size(), [&](size_t i) {
+			const size_t sb = removes[i];
+			disk(sb).remove(*pool(sb).acquire(), sb);
+		});
+	}
+
+	uint64_t reset_changes()
+	{
+		if (!m_changes) {
+			m_changes = std::make_unique<ChangeTracker>(
+			    m_pool, m_url, ChangeTracker::Map(),
+			    m_disk->superblock_bytes());
+		}
+		return m_changes->reset();
+	}
+
+	void stop_tracking_changes()
+	{
+		m_changes.reset();
+		ChangeTracker::remove(*m_pool.acquire(), m_url);
+	}
+
+	size_t copy_to(const URL &url, const Options &options)
+	{
+		check_superblocks("Copying");
+		if (m_journal) {
+			m_journal->drain();
+		}
+		Options opts = with_url_options(options, url);
+		opts.block_size = m_block_size;
+		opts.superblock_size = m_superblock_size;
+		opts.base.clear();
+		opts.stripes.clear();
+		Folder dst(m_pool, url, opts, false);
+		if (dst.superblock_bytes() != m_disk->superblock_bytes()) {
+			throw std::runtime_error(
+			    "Destination disk has a different superblock size");
+		}
+
+		// Collect the superblocks of the disk and all of its bases
+		Bitmap allocation = disk_allocation();
+		for (const std::unique_ptr<Folder> &base : m_bases) {
+			allocation.merge(base->allocation());
+		}
+		std::vector<size_t> superblocks;
+		for (size_t i = allocation.find_next(0); i != Bitmap::npos;
+		     i = allocation.find_next(i + 1)) {
+			superblocks.push_back(i);
+		}
+
+		m_executor.run(superblocks.size(), [&](size_t i) {
+			Folder *src = find_superblock(superblocks[i]);
+			if (src) {
+				dst.copy_from(*m_pool.acquire(), *src, superblocks[i],
+				              *m_buffers);
+			}
+		});
+		dst.close(*m_pool.acquire());
+		return superblocks.size();
+	}
+
+	ScrubStats scrub(bool sparsify, bool fix_sizes)
+	{
+		check_superblocks("Scrubbing");
+		if (m_journal) {
+			m_journal->drain();
+		}
+		const size_t sb_bytes = m_disk->superblock_bytes();
+		const size_t chunk_size = std::min(m_options.io_size, sb_bytes);
+		const Bitmap allocation = disk_allocation();
+		std::vector<size_t> superblocks;
+		for (size_t i = allocation.find_next(0); i != Bitmap::npos;
+		     i = allocation.find_next(i + 1)) {
+			superblocks.push_back(i);
+		}
+
+		std::mutex mutex;
+		ScrubStats res;
+		m_executor.run(superblocks.size(), [&](size_t i) {
+			const size_t sb = superblocks[i];
+			Folder &folder = disk(sb);
+			ContextPool::Lease ctx = pool(sb).acquire();
+			struct stat st;
+			bool zero = true;
+			{
+				File file = folder.open(*ctx, sb, false);
+				if (!file) {
+					return;  // The file disappeared; open() logs this
+				}
+				err(ctx->fstat(file, &st));
+
+				// Stop reading at the first chunk containing data
+				Arena::Buffer buf = m_buffers->allocate();
+				const size_t size = std::min<size_t>(st.st_size, sb_bytes);
+				for (size_t pos = 0; zero && pos < size; pos += chunk_size) {
+					const size_t n = std::min(chunk_size, size - pos);
+					ctx->read_full(file, buf.data(), n);
+					zero = is_zero(buf.data(), n);
+				}
+			}
+
+			// A zero superblock of an overlay may hide data in its base
+			bool removed = false;
+			if (zero && sparsify) {
+				removed = std::none_of(
+				    m_bases.begin(), m_bases.end(),
+				    [sb](const std::unique_ptr<Folder> &base) {
+					    return base->is_allocated(sb);
+				    });
+				if (removed) {
+					folder.remove(*ctx, sb);
+				}
+			}
+
+			const size_t size = st.st_size;
+			bool resized = false;
+			if (size != sb_bytes) {
+				SMB_LOG(DISK, WARNING, "Superblock file %s has %zu bytes",
+				        folder.filename(sb).c_str(), size);
+				if (fix_sizes && !removed) {
+					File file = folder.open(*ctx, sb, true);
+					err(ctx->ftruncate(file, sb_bytes));
+					resized = true;
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			res.superblocks++;
+			res.bytes += size;
+			res.zero += zero;
+			res.removed += removed;
+			res.short_files += size < sb_bytes;
+			res.long_files += size > sb_bytes;
+			res.resized += resized;
+		});
+		SMB_LOG(DISK, INFO,
+		        "Scrubbed %s: %zu superblocks, %zu zero, %zu removed",
+		        m_url.str().c_str(), res.superblocks, res.zero, res.removed);
+		return res;
+	}
+
+	void prefetch(size_t block_index, size_t block_count)
+	{
+		if (!m_cache) {
+			return;
+		}
+		const size_t n_blocks = m_options.disk_size / m_block_size;
+		if (n_blocks > 0) {
+			block_index = std::min(block_index, n_blocks);
+			block_count = std::min(block_count, n_blocks - block_index);
+		}
+		m_cache->prefetch(block_index * m_block_size,
+		                  block_count * m_block_size);
+	}
+
+	bool has_cache() const { return m_cache != nullptr; }
+
+	CacheStats cache_stats()
+	{
+		return m_cache ? m_cache->stats() : CacheStats();
+	}
+
+	QosStats qos_stats()
+	{
+		return m_throttle ? m_throttle->stats() : QosStats();
+	}
+
+	bool has_hedging() const { return m_hedger != nullptr; }
+
+	HedgeStats hedge_stats()
+	{
+		return m_hedger ? m_hedger->stats() : HedgeStats();
+	}
+
+	bool has_mirror() const { return m_mirror != nullptr; }
+
+	MirrorStats mirror_stats()
+	{
+		return m_mirror ? m_mirror->stats() : MirrorStats();
+	}
+
+	void read_block(size_t block_index, size_t block_count, uint8_t *buf)
+	{
+		SMB_LOG(IO, TRACE, "read %zu blocks at block %zu", block_count,
+		        block_index);
+		if (!m_cache) {
+			if (m_throttle) {
+				m_throttle->read(block_count * m_block_size);
+			}
+			read_uncached(block_index, block_count, buf);
+			return;
+		}
+
+		// Fetch the data following a sequential reader in the background
+		if (m_options.readahead > 0 &&
+		    m_read_next.exchange(block_index + block_count) == block_index) {
+			prefetch(block_index + block_count,
+			         m_options.readahead / m_block_size);
+		}
+
+		const uint64_t offs = block_index * m_block_size;
+		const size_t size = block_count * m_block_size;
+		if (m_cache->read(offs, size, buf)) {
+			return;
+		}
+		if (m_throttle) {
+			m_throttle->read(size);
+		}
+		const uint64_t generation = m_cache->generation();
+		read_uncached(block_index, block_count, buf);
+		m_cache->fill(offs, size, buf, generation);
+	}
+
+	void read_uncached(size_t block_index, size_t block_count, uint8_t *buf)
+	{
+		if (m_log) {
+			m_log->read(block_index, block_count, buf);
+			return;
+		}
+		const auto read = [&]() {
+			const std::vector<Chunk> chunks =
+			    make_chunks(block_index, block_count);
+			if (m_hedger) {
+				m_executor.run(chunks.size(), [&](size_t i) {
+					read_hedged(chunks[i], buf);
+				});
+				return;
+			}
+			if (m_mirror) {
+				m_executor.run(chunks.size(), [&](size_t i) {
+					read_mirrored(chunks[i], buf);
+				});
+				return;
+			}
+			run_chunks(chunks, false, [&](const Chunk &chunk) {
+				read_chunk(pool(chunk.superblock), disk(chunk.superblock),
+				           chunk, buf);
+			});
+		};
+		if (m_journal) {
+			m_journal->read(block_index, block_count, buf, read);
+		}
+		else {
+			read();
+		}
 	}
 };
 
@@ -419,8 +1773,10 @@ public:
  * Class SMB                                                                  *
  ******************************************************************************/
 
-SMB::SMB(const URL &url, size_t block_size, size_t superblock_size)
-    : m_impl(std::make_unique<Impl>(url, block_size, superblock_size))
+SMB::SMB(const URL &url) : SMB(url, Options()) {}
+
+SMB::SMB(const URL &url, const Options &options)
+    : m_impl(std::make_unique<Impl>(url, options))
 {
 }
 
@@ -438,15 +1794,82 @@ SMB::SizeInfo SMB::get_size_info() { return m_impl->get_size_info(); }
 void SMB::write_block(size_t block_index, size_t block_count,
                       const uint8_t *buf)
 {
+	IOClassScope scope(IOClass::WRITE);
 	m_impl->write_block(block_index, block_count, buf);
 }
 
 void SMB::read_block(size_t block_index, size_t block_count, uint8_t *buf)
 {
+	IOClassScope scope(IOClass::READ);
 	m_impl->read_block(block_index, block_count, buf);
 }
 
+void SMB::zero_block(size_t block_index, size_t block_count, bool may_trim)
+{
+	IOClassScope scope(IOClass::WRITE);
+	m_impl->zero_block(block_index, block_count, may_trim);
+}
+
 void SMB::trim_block(size_t block_index, size_t block_count)
 {
-	// TODO
-}
\ No newline at end of file
+	IOClassScope scope(IOClass::WRITE);
+	m_impl->trim_block(block_index, block_count);
+}
+
+void SMB::prefetch(size_t block_index, size_t block_count)
+{
+	m_impl->prefetch(block_index, block_count);
+}
+
+bool SMB::has_cache() const { return m_impl->has_cache(); }
+
+SMB::CacheStats SMB::cache_stats() { return m_impl->cache_stats(); }
+
+SMB::QosStats SMB::qos_stats() { return m_impl->qos_stats(); }
+
+bool SMB::has_hedging() const { return m_impl->has_hedging(); }
+
+SMB::HedgeStats SMB::hedge_stats() { return m_impl->hedge_stats(); }
+
+bool SMB::has_mirror() const { return m_impl->has_mirror(); }
+
+SMB::MirrorStats SMB::mirror_stats() { return m_impl->mirror_stats(); }
+
+SMB::Changes SMB::changes(const URL &url, const Options &options)
+{
+	Options opts = options;
+	opts.set(url);
+	Context ctx(url, opts);
+	ChangeTracker::Map map;
+	if (!ChangeTracker::load(ctx, url, map)) {
+		throw std::runtime_error("Changes of the disk are not tracked");
+	}
+
+	// Adjacent changed superblocks form one range
+	Changes res;
+	res.generation = map.generation;
+	for (size_t sb = map.changed.find_next(0); sb != Bitmap::npos;) {
+		size_t end = sb + 1;
+		while (map.changed.test(end)) {
+			end++;
+		}
+		res.extents.emplace_back(sb * map.superblock_bytes,
+		                         (end - sb) * map.superblock_bytes);
+		sb = map.changed.find_next(end);
+	}
+	return res;
+}
+
+uint64_t SMB::reset_changes() { return m_impl->reset_changes(); }
+
+void SMB::stop_tracking_changes() { m_impl->stop_tracking_changes(); }
+
+size_t SMB::copy_to(const URL &url, const Options &options)
+{
+	return m_impl->copy_to(url, options);
+}
+
+SMB::ScrubStats SMB::scrub(bool sparsify, bool fix_sizes)
+{
+	return m_impl->scrub(sparsify, fix_sizes);
+}
@@ -22,6 +22,8 @@
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 class SMB {
 private:
@@ -37,19 +39,200 @@ public:
 		std::string share;
 		std::string path;
 
+		// Options given as "key=value" pairs in the query string
+		std::vector<std::pair<std::string, std::string>> options;
+
 		URL() = default;
 		URL(const char *url);
 
 		std::string str(bool include_credentials = false) const;
 	};
 
+	struct Options {
+		size_t block_size = 4096;
+		size_t superblock_size = 256;
+
+		// Size of the disk in bytes; used to choose the directory layout of
+		// new disks. Zero if unknown.
+		size_t disk_size = 0;
+
+		// Number of directory levels and entries per directory level used
+		// when creating a new disk. A depth of zero selects the smallest
+		// depth for which no directory exceeds the fan-out.
+		unsigned int depth = 0;
+		unsigned int fanout = 256;
+
+		// On-share format of a new disk: "superblocks" writes data in place
+		// into superblock files, "log" appends it to large segment files
+		std::string format = "superblocks";
+
+		// Base disk folder of a new overlay disk, either as a URL or as a
+		// path on the same server. Superblocks not present in the overlay
+		// are read from the base, which is never modified.
+		std::string base;
+
+		// Further disk folders, as URLs or paths on the same server, across
+		// which the superblocks are striped together with the folder of the
+		// disk URL. Each stripe unit is stripe_width consecutive superblocks.
+		std::vector<std::string> stripes;
+		size_t stripe_width = 1;
+
+		// Position of the folder being opened among the stripes; set for
+		// each stripe when a striped disk is opened
+		size_t stripe_index = 0;
+
+		// Further disk folder, as a URL or a path on the same server, that
+		// holds a copy of all superblocks. Writes to the mirror may complete
+		// up to mirror_lag milliseconds after those to the disk folder (or
+		// vice versa) before the slower side is resynchronized instead.
+		std::string mirror;
+		unsigned int mirror_lag = 20;
+
+		// Library used for the SMB connections: "smbclient" (libsmbclient)
+		// or "libsmb2", which pipelines the reads and writes of superblocks
+		// over a single connection per share
+		std::string backend = "smbclient";
+
+		// Maximum number of libsmbclient contexts (i.e. connections) used
+		// concurrently, for example when scanning the disk folder
+		size_t pool_size = 8;
+
+		// Maximum number of bytes transferred by a single SMB read or write.
+		// Larger requests are split into chunks that are transferred in
+		// parallel over multiple connections.
+		size_t io_size = 1024 * 1024;
+
+		// Number of superblocks created in the background ahead of each
+		// sequential writer. Zero disables preallocation.
+		size_t prealloc = 0;
+
+		// Size of the write-ahead journal for small writes in bytes. Zero
+		// disables the journal.
+		size_t journal = 0;
+
+		// Size of the in-process read cache in bytes, and number of bytes
+		// prefetched into it ahead of sequential readers. Zero disables the
+		// cache or read-ahead, respectively.
+		size_t cache = 0;
+		size_t readahead = 0;
+
+		// Size the read cache may shrink to when memory is scarce. Zero keeps
+		// the cache at a fixed size; otherwise it shrinks while the cgroup
+		// (or the system) is under memory pressure and grows back up to cache
+		// once the pressure is gone.
+		size_t cache_min = 0;
+
+		// Whether the pages of the cache read most often are recorded in the
+		// disk folder and fetched into the cache again when it is opened
+		bool warm_start = true;
+
+		// Percentile of the recent read latencies after which a read is
+		// duplicated on another connection (or the other side of a mirror),
+		// and the percentage of reads that may be duplicated. A percentile
+		// of zero disables hedging.
+		unsigned int hedge = 0;
+		unsigned int hedge_budget = 5;
+
+		// Limits of the bytes and operations per second read from and
+		// written to the share, and the burst above these rates that is
+		// allowed after idle periods, in milliseconds at the limit rate.
+		// Zero disables a limit.
+		size_t read_bps = 0;
+		size_t write_bps = 0;
+		size_t read_iops = 0;
+		size_t write_iops = 0;
+		unsigned int burst_ms = 1000;
+
+		// Settings applied to each libsmbclient context. Empty strings and
+		// zero values keep the libsmbclient defaults.
+		std::string protocol_min;  // Minimum protocol, e.g. "SMB2_10"
+		std::string protocol_max;  // Maximum protocol, e.g. "SMB3_11"
+		std::string encryption;    // "none", "request" or "require"
+		std::string config;        // smb.conf file read by libsmbclient
+		unsigned int timeout = 0;  // Timeout of SMB requests in milliseconds
+		unsigned int port = 0;     // TCP port of the server
+
+		// Memory used at most for superblock buffers, and whether these are
+		// backed by "transparent" or "explicit" huge pages (or "none")
+		size_t buffer_memory = 256 * 1024 * 1024;
+		std::string huge_pages = "none";
+
+		// Log verbosity, see Log::configure(). Empty keeps the current one.
+		std::string log;
+
+		// Parses and validates a "key=value" option
+		void set(const std::string &key, const std::string &value);
+
+		// Applies the options given in the query string of the URL
+		void set(const URL &url);
+
+		// Parses a size with an optional K, M, G or T suffix, as used by the
+		// size options; key names the value in error messages
+		static uint64_t parse_size(const std::string &key,
+		                           const std::string &value);
+	};
+
 	struct SizeInfo {
 		size_t size;
 		size_t free;
 	};
 
-	SMB(const URL &url, size_t block_size = 4096,
-	    size_t superblock_size = 256);
+	struct ScrubStats {
+		size_t superblocks = 0;  // Superblock files examined
+		size_t bytes = 0;        // Total size of these files
+		size_t zero = 0;         // Superblocks only containing zeros
+		size_t removed = 0;      // Zero superblocks that were deleted
+		size_t short_files = 0;  // Files smaller than a superblock
+		size_t long_files = 0;   // Files larger than a superblock
+		size_t resized = 0;      // Files truncated to the superblock size
+	};
+
+	struct CacheStats {
+		size_t hits = 0;        // Reads served from the cache
+		size_t misses = 0;      // Reads served from the disk
+		size_t prefetched = 0;  // Pages fetched in the background
+		size_t warmed = 0;      // Pages fetched to restore the working set
+		size_t evicted = 0;     // Pages evicted to make room for others
+		size_t pages = 0;       // Pages currently cached
+		size_t limit = 0;       // Current size limit in bytes
+	};
+
+	struct QosStats {
+		size_t reads = 0;                 // Reads issued to the share
+		size_t writes = 0;                // Writes issued to the share
+		size_t reads_throttled = 0;       // Reads delayed by a limit
+		size_t writes_throttled = 0;      // Writes delayed by a limit
+		uint64_t read_throttled_us = 0;   // Total delay of reads
+		uint64_t write_throttled_us = 0;  // Total delay of writes
+	};
+
+	struct HedgeStats {
+		size_t reads = 0;   // Reads that could be duplicated
+		size_t hedged = 0;  // Duplicates issued for slow reads
+		size_t won = 0;     // Duplicates that completed first
+		size_t denied = 0;  // Slow reads not duplicated due to the budget
+	};
+
+	struct MirrorStats {
+		size_t primary_reads = 0;  // Reads served by the disk folder
+		size_t mirror_reads = 0;   // Reads served by the mirror
+		size_t lagged = 0;         // Writes completed without the slower side
+		size_t failures = 0;       // Sides taken offline after an error
+		size_t resynced = 0;       // Superblocks copied to a side missing them
+		size_t dirty = 0;          // Superblocks currently out of sync
+	};
+
+	struct Changes {
+		uint64_t generation = 0;  // Backup generation, see reset_changes()
+
+		// Byte ranges (offset, length) changed since the generation started,
+		// in whole superblocks
+		std::vector<std::pair<uint64_t, uint64_t>> extents;
+	};
+
+	// Options given in the URL take precedence over the given options
+	SMB(const URL &url);
+	SMB(const URL &url, const Options &options);
 	~SMB();
 
 	size_t block_size() const;
@@ -60,5 +243,56 @@ public:
 	void write_block(size_t block_index, size_t block_count,
 	                 const uint8_t *buf);
 	void read_block(size_t block_index, size_t block_count, uint8_t *buf);
+
+	// Makes the given blocks read as zeros. If may_trim is set, superblocks
+	// that are zeroed entirely are deleted instead of being written where
+	// possible.
+	void zero_block(size_t block_index, size_t block_count, bool may_trim);
+
+	// Discards the superblocks that the given blocks cover entirely, which
+	// read as zeros afterwards unless they hide data of a base disk. Other
+	// blocks are left alone, since trimming is advisory.
 	void trim_block(size_t block_index, size_t block_count);
+
+	// Fetches the given blocks into the cache in the background; does
+	// nothing if the cache is disabled
+	void prefetch(size_t block_index, size_t block_count);
+
+	bool has_cache() const;
+	CacheStats cache_stats();
+
+	// Counts of the requests delayed by the bandwidth and IOPS limits
+	QosStats qos_stats();
+
+	// Duplicated reads
+	bool has_hedging() const;
+	HedgeStats hedge_stats();
+
+	// Load balancing and resynchronization of a mirrored disk
+	bool has_mirror() const;
+	MirrorStats mirror_stats();
+
+	// Returns the ranges of the disk at the given URL that changed in the
+	// current backup generation. Only reads the change map, so the disk may
+	// be in use. Throws if changes of the disk are not tracked.
+	static Changes changes(const URL &url, const Options &options);
+
+	// Starts a new backup generation with no changes, enabling change
+	// tracking if necessary, and returns its number
+	uint64_t reset_changes();
+
+	// Deletes the change map, disabling change tracking
+	void stop_tracking_changes();
+
+	// Copies all superblocks of this disk, including those inherited from its
+	// base disks, into a new disk folder. The new disk may use a different
+	// directory layout. Copies are performed server-side where supported.
+	// Returns the number of copied superblocks.
+	size_t copy_to(const URL &url, const Options &options);
+
+	// Examines all superblock files of this disk (but not of its bases) in
+	// parallel. If sparsify is set, superblocks only containing zeros are
+	// deleted unless they hide a superblock of a base disk. If fix_sizes is
+	// set, files of the wrong size are truncated to the superblock size.
+	ScrubStats scrub(bool sparsify, bool fix_sizes);
 };
\ No newline at end of file
@@ -0,0 +1,471 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <vector>
+
+#ifdef HAVE_LIBSMB2
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <smb2/smb2.h>
+#include <smb2/libsmb2.h>
+#include <smb2/libsmb2-raw.h>
+#endif
+
+#include <nbdkit_smb_plugin/log.hpp>
+#include <nbdkit_smb_plugin/smb2.hpp>
+
+/******************************************************************************
+ * Class Smb2Connection                                                       *
+ ******************************************************************************/
+
+std::string Smb2Connection::share(const SMB::URL &url)
+{
+	return url.path.substr(0, url.path.find('/'));
+}
+
+std::string Smb2Connection::path(const SMB::URL &url)
+{
+	const size_t i = url.path.find('/');
+	std::string res = i == std::string::npos ? "" : url.path.substr(i + 1);
+	if (!res.empty() && res.back() != '/') {
+		res += '/';
+	}
+	return res;
+}
+
+#ifndef HAVE_LIBSMB2
+
+bool Smb2Connection::available() { return false; }
+
+Smb2Connection::Smb2Connection(const SMB::URL &, const SMB::Options &)
+{
+	throw std::runtime_error("The plugin was built without libsmb2");
+}
+
+Smb2Connection::~Smb2Connection() {}
+
+void Smb2Connection::read(const std::string &, uint64_t, uint8_t *, size_t)
+{
+	throw std::system_error(ENOTSUP, std::system_category());
+}
+
+void Smb2Connection::write(const std::string &, uint64_t, const uint8_t *,
+                           size_t)
+{
+	throw std::system_error(ENOTSUP, std::system_category());
+}
+
+#else
+
+// Requests of a compound that refer to the file opened by the first request
+// use this file id
+static const uint8_t RELATED_FILE_ID[SMB2_FD_SIZE] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+// Failures detected by libsmb2 itself are reported as negative errno values,
+// failures reported by the server as NT status codes
+static int status_errno(int status)
+{
+	if (status < 0 && status > -4096) {
+		return -status;
+	}
+	const int res = nterror_to_errno(uint32_t(status));
+	return res > 0 ? res : EIO;
+}
+
+struct Smb2Connection::Pdu {
+	enum Type { CREATE, TRANSFER, CLOSE };
+
+	Request *req;
+	Type type;
+	size_t offs;  // Byte offset of the transfer within the request buffer
+	size_t size;  // Number of bytes transferred
+};
+
+struct Smb2Connection::Request {
+	Smb2Connection *conn;
+	bool writing;
+	std::string path;  // Relative to the share, with backslashes
+	uint64_t offs;
+	uint8_t *buf;
+	size_t size;
+
+	std::vector<Pdu> pdus;
+	size_t n_pending = 0;  // PDUs still waiting for a reply
+	int error = 0;
+
+	bool done = false;  // Protected by the mutex of the connection
+	std::condition_variable cond;
+};
+
+bool Smb2Connection::available() { return true; }
+
+Smb2Connection::Smb2Connection(const SMB::URL &url,
+                               const SMB::Options &options)
+    : m_server(url.host),
+      m_share(share(url)),
+      m_url(url),
+      m_options(options),
+      m_smb2(nullptr),
+      m_max_read(0),
+      m_max_write(0),
+      m_wakeup(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+      m_connected(false),
+      m_connect_error(0),
+      m_done(false)
+{
+	if (m_wakeup < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	if (options.port > 0) {
+		m_server += ":" + std::to_string(options.port);
+	}
+
+	// The first connection is established right away, so that errors are
+	// reported when the disk is opened
+	m_thread = std::thread([this]() { loop(); });
+	int error;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cond.wait(lock, [this]() { return m_connected; });
+		error = m_connect_error;
+	}
+	if (error) {
+		m_thread.join();
+		::close(m_wakeup);
+		throw std::runtime_error("Cannot connect to \\\\" + m_server + "\\" +
+		                         m_share + " with libsmb2");
+	}
+}
+
+Smb2Connection::~Smb2Connection()
+{
+	if (!m_thread.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_done = true;
+	}
+	const uint64_t one = 1;
+	(void)!::write(m_wakeup, &one, sizeof(one));
+	m_thread.join();
+	::close(m_wakeup);
+}
+
+bool Smb2Connection::connect()
+{
+	m_smb2 = smb2_init_context();
+	if (!m_smb2) {
+		return false;
+	}
+	smb2_set_security_mode(m_smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
+	if (!m_url.workgroup.empty()) {
+		smb2_set_domain(m_smb2, m_url.workgroup.c_str());
+	}
+	if (!m_url.password.empty()) {
+		smb2_set_password(m_smb2, m_url.password.c_str());
+	}
+	if (m_options.encryption == "require") {
+		smb2_set_seal(m_smb2, 1);
+	}
+	if (m_options.timeout > 0) {
+		smb2_set_timeout(m_smb2, std::max(1u, m_options.timeout / 1000));
+	}
+
+	// libsmb2 only speaks SMB2 and SMB3; restrict it to SMB3 or SMB2 if the
+	// protocol range asks for it
+	if (m_options.protocol_min.compare(0, 4, "SMB3") == 0) {
+		smb2_set_version(m_smb2, SMB2_VERSION_ANY3);
+	}
+	else if (m_options.protocol_max.compare(0, 4, "SMB2") == 0) {
+		smb2_set_version(m_smb2, SMB2_VERSION_ANY2);
+	}
+
+	if (smb2_connect_share(m_smb2, m_server.c_str(), m_share.c_str(),
+	                       m_url.user.empty() ? nullptr
+	                                          : m_url.user.c_str()) < 0) {
+		SMB_LOG(SMBCLIENT, ERROR, "Cannot connect to \\\\%s\\%s: %s",
+		        m_server.c_str(), m_share.c_str(), smb2_get_error(m_smb2));
+		smb2_destroy_context(m_smb2);
+		m_smb2 = nullptr;
+		return false;
+	}
+	m_max_read = std::max<uint32_t>(smb2_get_max_read_size(m_smb2), 65536);
+	m_max_write = std::max<uint32_t>(smb2_get_max_write_size(m_smb2), 65536);
+	SMB_LOG(SMBCLIENT, DEBUG,
+	        "Connected to \\\\%s\\%s, maximum read %u, maximum write %u",
+	        m_server.c_str(), m_share.c_str(), m_max_read, m_max_write);
+	return true;
+}
+
+void Smb2Connection::disconnect(int error)
+{
+	// Destroying the context may still deliver replies; requests without a
+	// reply afterwards fail with the given error
+	smb2_destroy_context(m_smb2);
+	m_smb2 = nullptr;
+	for (Request *req : std::set<Request *>(m_outstanding)) {
+		if (!req->error) {
+			req->error = error;
+		}
+		finish(req);
+	}
+}
+
+void Smb2Connection::finish(Request *req)
+{
+	m_outstanding.erase(req);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	req->done = true;
+	req->cond.notify_one();
+}
+
+void Smb2Connection::reply(smb2_context *, int status, void *data, void *pdu)
+{
+	const Pdu &p = *static_cast<Pdu *>(pdu);
+	Request &req = *p.req;
+	if (p.type == Pdu::TRANSFER && !req.writing) {
+		// Reads past the end of the file return less data or none at all
+		uint8_t *dst = req.buf + p.offs;
+		size_t n = 0;
+		if (status == SMB2_STATUS_SUCCESS) {
+			const smb2_read_reply *rep = static_cast<smb2_read_reply *>(data);
+			n = std::min<size_t>(rep->data_length, p.size);
+			if (n > 0 && rep->data != dst) {
+				memcpy(dst, rep->data, n);
+			}
+		}
+		else if (uint32_t(status) != SMB2_STATUS_END_OF_FILE && !req.error) {
+			req.error = status_errno(status);
+		}
+		memset(dst + n, 0, p.size - n);
+	}
+	else if (p.type == Pdu::TRANSFER) {
+		if (status == SMB2_STATUS_SUCCESS) {
+			const smb2_write_reply *rep = static_cast<smb2_write_reply *>(data);
+			if (rep->count < p.size && !req.error) {
+				req.error = EIO;
+			}
+		}
+		else if (!req.error) {
+			req.error = status_errno(status);
+		}
+	}
+	else if (p.type == Pdu::CREATE && status != SMB2_STATUS_SUCCESS &&
+	         !req.error) {
+		// The other requests of the compound fail as well
+		req.error = status_errno(status);
+	}
+	if (--req.n_pending == 0) {
+		req.conn->finish(&req);
+	}
+}
+
+void Smb2Connection::send(Request *req)
+{
+	m_outstanding.insert(req);
+	if (!m_smb2 && !connect()) {
+		req->error = ECONNREFUSED;
+		finish(req);
+		return;
+	}
+
+	// Open the file, transfer the data in pieces the server accepts, and
+	// close the file again
+	const size_t max_size = req->writing ? m_max_write : m_max_read;
+	req->pdus.reserve(2 + (req->size + max_size - 1) / max_size);
+	req->pdus.push_back(Pdu{req, Pdu::CREATE, 0, 0});
+
+	smb2_create_request create;
+	memset(&create, 0, sizeof(create));
+	create.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
+	create.impersonation_level = SMB2_IMPERSONATION_IMPERSONATION;
+	create.desired_access =
+	    req->writing ? SMB2_FILE_WRITE_DATA : SMB2_FILE_READ_DATA;
+	create.share_access = SMB2_FILE_SHARE_READ | SMB2_FILE_SHARE_WRITE |
+	                      SMB2_FILE_SHARE_DELETE;
+	create.create_disposition = SMB2_FILE_OPEN;
+	create.create_options = SMB2_FILE_NON_DIRECTORY_FILE;
+	create.name = req->path.c_str();
+	smb2_pdu *first =
+	    smb2_cmd_create_async(m_smb2, &create, reply, &req->pdus.back());
+
+	for (size_t offs = 0; first && offs < req->size;) {
+		const size_t size = std::min(req->size - offs, max_size);
+		req->pdus.push_back(Pdu{req, Pdu::TRANSFER, offs, size});
+		smb2_pdu *pdu;
+		if (req->writing) {
+			smb2_write_request write;
+			memset(&write, 0, sizeof(write));
+			write.length = size;
+			write.offset = req->offs + offs;
+			write.buf = req->buf + offs;
+			memcpy(write.file_id, RELATED_FILE_ID, SMB2_FD_SIZE);
+			pdu = smb2_cmd_write_async(m_smb2, &write, reply,
+			                           &req->pdus.back());
+		}
+		else {
+			smb2_read_request read;
+			memset(&read, 0, sizeof(read));
+			read.length = size;
+			read.offset = req->offs + offs;
+			read.buf = req->buf + offs;
+			memcpy(read.file_id, RELATED_FILE_ID, SMB2_FD_SIZE);
+			pdu = smb2_cmd_read_async(m_smb2, &read, reply, &req->pdus.back());
+		}
+		if (!pdu) {
+			smb2_free_pdu(m_smb2, first);
+			first = nullptr;
+			break;
+		}
+		smb2_add_compound_pdu(m_smb2, first, pdu);
+		offs += size;
+	}
+
+	if (first) {
+		req->pdus.push_back(Pdu{req, Pdu::CLOSE, 0, 0});
+		smb2_close_request close;
+		memset(&close, 0, sizeof(close));
+		memcpy(close.file_id, RELATED_FILE_ID, SMB2_FD_SIZE);
+		smb2_pdu *pdu =
+		    smb2_cmd_close_async(m_smb2, &close, reply, &req->pdus.back());
+		if (pdu) {
+			smb2_add_compound_pdu(m_smb2, first, pdu);
+		}
+		else {
+			smb2_free_pdu(m_smb2, first);
+			first = nullptr;
+		}
+	}
+	if (!first) {
+		req->error = ENOMEM;
+		finish(req);
+		return;
+	}
+	req->n_pending = req->pdus.size();
+	smb2_queue_pdu(m_smb2, first);
+}
+
+void Smb2Connection::loop()
+{
+	const bool connected = connect();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_connected = true;
+		m_connect_error = connected ? 0 : ECONNREFUSED;
+		m_done = m_done || !connected;
+	}
+	m_cond.notify_all();
+
+	while (true) {
+		std::vector<Request *> requests;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_done && m_queue.empty() && m_outstanding.empty()) {
+				break;
+			}
+			while (!m_queue.empty() &&
+			       m_outstanding.size() + requests.size() < MAX_OUTSTANDING) {
+				requests.push_back(m_queue.front());
+				m_queue.pop_front();
+			}
+		}
+		for (Request *req : requests) {
+			send(req);
+		}
+
+		pollfd fds[2] = {{m_wakeup, POLLIN, 0}, {-1, 0, 0}};
+		if (m_smb2) {
+			fds[1].fd = smb2_get_fd(m_smb2);
+			fds[1].events = smb2_which_events(m_smb2);
+		}
+		if (poll(fds, m_smb2 ? 2 : 1, 1000) < 0 && errno != EINTR) {
+			SMB_LOG(SMBCLIENT, ERROR, "Cannot wait for \\\\%s\\%s: %s",
+			        m_server.c_str(), m_share.c_str(), strerror(errno));
+		}
+		if (fds[0].revents & POLLIN) {
+			uint64_t n;
+			(void)!::read(m_wakeup, &n, sizeof(n));
+		}
+
+		// Also called without events, so that libsmb2 times out requests
+		if (m_smb2 && smb2_service(m_smb2, fds[1].revents) < 0) {
+			SMB_LOG(SMBCLIENT, ERROR, "Lost the connection to \\\\%s\\%s: %s",
+			        m_server.c_str(), m_share.c_str(), smb2_get_error(m_smb2));
+			disconnect(EIO);
+		}
+	}
+	if (m_smb2) {
+		smb2_disconnect_share(m_smb2);
+		smb2_destroy_context(m_smb2);
+		m_smb2 = nullptr;
+	}
+}
+
+void Smb2Connection::transfer(Request &req)
+{
+	req.conn = this;
+	std::replace(req.path.begin(), req.path.end(), '/', '\\');
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_queue.push_back(&req);
+	}
+	const uint64_t one = 1;
+	(void)!::write(m_wakeup, &one, sizeof(one));
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	req.cond.wait(lock, [&req]() { return req.done; });
+	if (req.error) {
+		throw std::system_error(req.error, std::system_category());
+	}
+}
+
+void Smb2Connection::read(const std::string &path, uint64_t offs,
+                          uint8_t *buf, size_t size)
+{
+	Request req;
+	req.writing = false;
+	req.path = path;
+	req.offs = offs;
+	req.buf = buf;
+	req.size = size;
+	transfer(req);
+}
+
+void Smb2Connection::write(const std::string &path, uint64_t offs,
+                           const uint8_t *buf, size_t size)
+{
+	Request req;
+	req.writing = true;
+	req.path = path;
+	req.offs = offs;
+	req.buf = const_cast<uint8_t *>(buf);
+	req.size = size;
+	transfer(req);
+}
+
+#endif /* HAVE_LIBSMB2 */
@@ -0,0 +1,106 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+
+#include <nbdkit_smb_plugin/smb.hpp>
+
+struct smb2_context;
+
+/**
+ * A single SMB2/3 connection to a share using the asynchronous libsmb2 API.
+ * Unlike a libsmbclient context, a connection is shared by all threads: each
+ * transfer is sent as one compound request that opens the file, reads or
+ * writes it and closes it again, and many such requests are outstanding on
+ * the connection at the same time. A thread running an event loop sends the
+ * requests and dispatches the replies. A lost connection is reestablished
+ * with the next request.
+ */
+class Smb2Connection {
+private:
+	// Maximum number of compound requests outstanding at once; further
+	// requests are queued
+	static constexpr size_t MAX_OUTSTANDING = 64;
+
+	struct Request;
+	struct Pdu;
+
+	std::string m_server;
+	std::string m_share;
+	SMB::URL m_url;
+	SMB::Options m_options;
+
+	// Only accessed by the event loop
+	smb2_context *m_smb2;
+	std::set<Request *> m_outstanding;
+	uint32_t m_max_read;
+	uint32_t m_max_write;
+
+	// Requests not sent yet, and an eventfd waking the event loop
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque<Request *> m_queue;
+	int m_wakeup;
+	bool m_connected;  // The first connection attempt has finished
+	int m_connect_error;
+	bool m_done;
+	std::thread m_thread;
+
+	bool connect();
+	void disconnect(int error);
+	void send(Request *req);
+	void finish(Request *req);
+	void loop();
+
+	static void reply(smb2_context *smb2, int status, void *data, void *pdu);
+
+	void transfer(Request &req);
+
+public:
+	// Connects to the share of the URL, e.g. "share" for a URL with the path
+	// "share/disk/", with the credentials and settings of the options
+	Smb2Connection(const SMB::URL &url, const SMB::Options &options);
+	~Smb2Connection();
+
+	Smb2Connection(const Smb2Connection &) = delete;
+	Smb2Connection &operator=(const Smb2Connection &) = delete;
+
+	// Returns true if the plugin was built with libsmb2
+	static bool available();
+
+	// Name of the share and path of the URL within the share
+	static std::string share(const SMB::URL &url);
+	static std::string path(const SMB::URL &url);
+
+	// Reads or writes part of an existing file given by its path relative to
+	// the share. Data beyond the end of the file reads as zeros. Throws a
+	// std::system_error, with ENOENT if the file does not exist.
+	void read(const std::string &path, uint64_t offs, uint8_t *buf,
+	          size_t size);
+	void write(const std::string &path, uint64_t offs, const uint8_t *buf,
+	           size_t size);
+};
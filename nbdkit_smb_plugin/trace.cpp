@@ -0,0 +1,142 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <nbdkit_smb_plugin/log.hpp>
+#include <nbdkit_smb_plugin/trace.hpp>
+
+static const char TRACE_MAGIC[8] = {'N', 'B', 'D', 'S', 'M', 'B', 'T', 'R'};
+static constexpr size_t TRACE_BUFFER_SIZE = 1024 * 1024;
+static constexpr uint64_t TRACE_FLUSH_INTERVAL_NS = 1000 * 1000 * 1000;
+
+static uint64_t monotonic_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	           std::chrono::steady_clock::now().time_since_epoch())
+	    .count();
+}
+
+/******************************************************************************
+ * Class TraceWriter                                                          *
+ ******************************************************************************/
+
+TraceWriter::TraceWriter(const std::string &path, uint64_t disk_size)
+    : m_flushed(0), m_failed(false)
+{
+	m_file = fopen(path.c_str(), "wb");
+	if (!m_file) {
+		throw std::system_error(errno, std::system_category(),
+		                        "Cannot create trace file " + path);
+	}
+	setvbuf(m_file, nullptr, _IOFBF, TRACE_BUFFER_SIZE);
+
+	TraceHeader hdr;
+	std::memset(&hdr, 0, sizeof(hdr));
+	std::memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	hdr.version = 1;
+	hdr.disk_size = disk_size;
+	hdr.start_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	                     std::chrono::system_clock::now().time_since_epoch())
+	                     .count();
+	if (fwrite(&hdr, sizeof(hdr), 1, m_file) != 1) {
+		const int err = errno;
+		fclose(m_file);
+		throw std::system_error(err, std::system_category(),
+		                        "Cannot write trace file " + path);
+	}
+	m_start = monotonic_ns();
+}
+
+TraceWriter::~TraceWriter()
+{
+	if (fclose(m_file) != 0 && !m_failed) {
+		fail();
+	}
+}
+
+void TraceWriter::fail()
+{
+	SMB_LOG(IO, ERROR, "Cannot write the trace, stopping: %s",
+	        strerror(errno));
+	m_failed = true;
+}
+
+uint64_t TraceWriter::now() const { return monotonic_ns() - m_start; }
+
+void TraceWriter::record(TraceRecord::Type type, uint64_t offset,
+                         uint32_t count, uint64_t start, int error)
+{
+	TraceRecord rec;
+	std::memset(&rec, 0, sizeof(rec));
+	rec.timestamp = start;
+	rec.offset = offset;
+	rec.count = count;
+	rec.latency = (now() - start) / 1000;
+	rec.type = type;
+	rec.error = error;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_failed) {
+		return;
+	}
+	if (fwrite(&rec, sizeof(rec), 1, m_file) != 1) {
+		fail();
+		return;
+	}
+
+	// Keep the trace of a long-running server up to date
+	const uint64_t t = now();
+	if (t - m_flushed >= TRACE_FLUSH_INTERVAL_NS) {
+		m_flushed = t;
+		if (fflush(m_file) != 0) {
+			fail();
+		}
+	}
+}
+
+/******************************************************************************
+ * Class TraceReader                                                          *
+ ******************************************************************************/
+
+TraceReader::TraceReader(const std::string &path)
+{
+	m_file = fopen(path.c_str(), "rb");
+	if (!m_file) {
+		throw std::system_error(errno, std::system_category(),
+		                        "Cannot open trace file " + path);
+	}
+	setvbuf(m_file, nullptr, _IOFBF, TRACE_BUFFER_SIZE);
+	if (fread(&m_header, sizeof(m_header), 1, m_file) != 1 ||
+	    std::memcmp(m_header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+	    m_header.version != 1) {
+		fclose(m_file);
+		throw std::runtime_error("Invalid trace file " + path);
+	}
+}
+
+TraceReader::~TraceReader() { fclose(m_file); }
+
+bool TraceReader::next(TraceRecord &record)
+{
+	return fread(&record, sizeof(record), 1, m_file) == 1;
+}
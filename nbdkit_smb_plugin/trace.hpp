@@ -0,0 +1,104 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+/**
+ * Binary I/O trace format. A trace consists of a TraceHeader followed by one
+ * TraceRecord per operation in the order in which the operations completed.
+ * All fields are in host byte order.
+ */
+struct TraceHeader {
+	char magic[8];  // "NBDSMBTR"
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t disk_size;
+	uint64_t start_time;  // Wall clock time at the start in ns since epoch
+};
+
+struct TraceRecord {
+	enum Type : uint8_t { READ = 0, WRITE = 1, ZERO = 2, TRIM = 3 };
+
+	uint64_t timestamp;  // Start of the operation in ns since the trace start
+	uint64_t offset;
+	uint32_t count;
+	uint32_t latency;  // Duration of the operation in microseconds
+	uint8_t type;
+	uint8_t reserved[3];
+	int32_t error;  // errno, or zero if the operation succeeded
+};
+
+static_assert(sizeof(TraceRecord) == 32, "unexpected TraceRecord size");
+
+/**
+ * Appends records to a trace file. Records are buffered and written in
+ * large chunks, at least once per second; the file is complete once the
+ * writer is destroyed. If writing fails, the error is logged and no further
+ * records are written.
+ */
+class TraceWriter {
+private:
+	FILE *m_file;
+	uint64_t m_start;
+	std::mutex m_mutex;
+	uint64_t m_flushed;  // Time of the last flush in ns since the start
+	bool m_failed;
+
+	// Logs a failure to write the trace and stops tracing
+	void fail();
+
+public:
+	TraceWriter(const std::string &path, uint64_t disk_size);
+	~TraceWriter();
+
+	TraceWriter(const TraceWriter &) = delete;
+	TraceWriter &operator=(const TraceWriter &) = delete;
+
+	// Monotonic time in ns since the start of the trace
+	uint64_t now() const;
+
+	// Records an operation that started at the given time and ends now
+	void record(TraceRecord::Type type, uint64_t offset, uint32_t count,
+	            uint64_t start, int error);
+};
+
+/**
+ * Reads a trace file written by TraceWriter.
+ */
+class TraceReader {
+private:
+	FILE *m_file;
+	TraceHeader m_header;
+
+public:
+	TraceReader(const std::string &path);
+	~TraceReader();
+
+	TraceReader(const TraceReader &) = delete;
+	TraceReader &operator=(const TraceReader &) = delete;
+
+	const TraceHeader &header() const { return m_header; }
+
+	// Returns false at the end of the trace
+	bool next(TraceRecord &record);
+};
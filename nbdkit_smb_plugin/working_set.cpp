@@ -0,0 +1,148 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+
+#include <nbdkit_smb_plugin/checksum.hpp>
+#include <nbdkit_smb_plugin/folder.hpp>
+#include <nbdkit_smb_plugin/io_class.hpp>
+#include <nbdkit_smb_plugin/log.hpp>
+#include <nbdkit_smb_plugin/working_set.hpp>
+
+struct HotIndexHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t page_size;
+	uint64_t n_pages;
+	uint64_t checksum;  // Of the header and the page numbers
+};
+
+static const char HOT_MAGIC[8] = {'N', 'B', 'D', 'S', 'M', 'B', 'H', 'P'};
+
+static const char *HOT_FILE = "hot.idx";
+
+// Interval at which the working set is recorded while the disk is in use
+static constexpr std::chrono::minutes SAVE_INTERVAL(5);
+
+/******************************************************************************
+ * Class WorkingSet                                                           *
+ ******************************************************************************/
+
+WorkingSet::WorkingSet(ContextPool &pool, Folder &disk, Cache &cache)
+    : m_pool(pool), m_disk(disk), m_cache(cache), m_done(false)
+{
+	m_thread = std::thread([this]() { worker(); });
+}
+
+WorkingSet::~WorkingSet()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_done = true;
+	}
+	m_cond.notify_all();
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+}
+
+void WorkingSet::close()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_done = true;
+	}
+	m_cond.notify_all();
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+	save();
+}
+
+void WorkingSet::load()
+{
+	std::string data;
+	if (!m_disk.read_file(*m_pool.acquire(), HOT_FILE, data)) {
+		return;
+	}
+	HotIndexHeader hdr;
+	if (!read_header(data, hdr) ||
+	    memcmp(hdr.magic, HOT_MAGIC, sizeof(HOT_MAGIC)) != 0 ||
+	    hdr.version != 1 || hdr.page_size != Cache::PAGE_SIZE ||
+	    data.size() != sizeof(hdr) + hdr.n_pages * sizeof(uint64_t)) {
+		SMB_LOG(MEMORY, WARNING, "Ignoring invalid %s in %s", HOT_FILE,
+		        m_disk.url().str().c_str());
+		return;
+	}
+	std::vector<uint64_t> pages(hdr.n_pages);
+	memcpy(pages.data(), data.data() + sizeof(hdr),
+	       pages.size() * sizeof(uint64_t));
+	SMB_LOG(MEMORY, INFO, "Restoring a working set of %zu cache pages",
+	        pages.size());
+	m_cache.warm(std::move(pages));
+}
+
+void WorkingSet::save()
+{
+	// An idle disk keeps the working set recorded earlier
+	const std::vector<uint64_t> pages = m_cache.hot_pages();
+	if (pages.empty()) {
+		return;
+	}
+	HotIndexHeader hdr;
+	memcpy(hdr.magic, HOT_MAGIC, sizeof(HOT_MAGIC));
+	hdr.version = 1;
+	hdr.page_size = Cache::PAGE_SIZE;
+	hdr.n_pages = pages.size();
+	std::string data(sizeof(hdr) + pages.size() * sizeof(uint64_t), '\0');
+	memcpy(&data[sizeof(hdr)], pages.data(), pages.size() * sizeof(uint64_t));
+	write_header(data, hdr);
+	m_disk.write_file(*m_pool.acquire(), HOT_FILE, data);
+}
+
+void WorkingSet::worker()
+{
+	IOClassScope scope(IOClass::BACKGROUND);
+	try {
+		load();
+	}
+	catch (std::exception &e) {
+		SMB_LOG(MEMORY, WARNING, "Cannot restore the working set: %s",
+		        e.what());
+	}
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_done) {
+		if (m_cond.wait_for(lock, SAVE_INTERVAL, [this]() { return m_done; })) {
+			break;
+		}
+		lock.unlock();
+		try {
+			save();
+		}
+		catch (std::exception &e) {
+			SMB_LOG(MEMORY, WARNING, "Cannot record the working set: %s",
+			        e.what());
+		}
+		lock.lock();
+	}
+}
@@ -0,0 +1,64 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <nbdkit_smb_plugin/cache.hpp>
+#include <nbdkit_smb_plugin/context.hpp>
+
+class Folder;
+
+/**
+ * Restores the working set of the read cache after a restart. The pages read
+ * most often are recorded in the disk folder periodically and on clean
+ * shutdown; when the disk is opened, the recorded pages are fetched into the
+ * cache in the background, after any pages prefetched for the client.
+ */
+class WorkingSet {
+private:
+	ContextPool &m_pool;
+	Folder &m_disk;
+	Cache &m_cache;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_done;
+	std::thread m_thread;
+
+	// Queues the recorded pages for warming
+	void load();
+
+	// Records the pages currently read most often
+	void save();
+
+	void worker();
+
+public:
+	// Starts restoring the recorded working set
+	WorkingSet(ContextPool &pool, Folder &disk, Cache &cache);
+
+	// Stops the background thread; must be preceded by close()
+	~WorkingSet();
+
+	// Records the working set; must be called on clean shutdown
+	void close();
+};
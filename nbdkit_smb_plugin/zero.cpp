@@ -0,0 +1,91 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define ZERO_X86 1
+#endif
+
+#include <nbdkit_smb_plugin/zero.hpp>
+
+// Number of bytes tested at once before checking for a non-zero byte
+static constexpr size_t STRIDE = 256;
+
+static bool is_zero_tail(const uint8_t *buf, size_t size)
+{
+	for (; size >= 8; buf += 8, size -= 8) {
+		uint64_t v;
+		memcpy(&v, buf, 8);
+		if (v) {
+			return false;
+		}
+	}
+	for (; size > 0; buf++, size--) {
+		if (*buf) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#ifdef ZERO_X86
+static bool is_zero_sse2(const uint8_t *buf, size_t size)
+{
+	for (; size >= STRIDE; buf += STRIDE, size -= STRIDE) {
+		__m128i acc = _mm_setzero_si128();
+		for (size_t i = 0; i < STRIDE; i += 16) {
+			acc = _mm_or_si128(
+			    acc, _mm_loadu_si128(reinterpret_cast<const __m128i *>(buf + i)));
+		}
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) !=
+		    0xFFFF) {
+			return false;
+		}
+	}
+	return is_zero_tail(buf, size);
+}
+
+__attribute__((target("avx2"))) static bool is_zero_avx2(const uint8_t *buf,
+                                                         size_t size)
+{
+	for (; size >= STRIDE; buf += STRIDE, size -= STRIDE) {
+		__m256i acc = _mm256_setzero_si256();
+		for (size_t i = 0; i < STRIDE; i += 32) {
+			acc = _mm256_or_si256(
+			    acc,
+			    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(buf + i)));
+		}
+		if (!_mm256_testz_si256(acc, acc)) {
+			return false;
+		}
+	}
+	return is_zero_tail(buf, size);
+}
+#endif
+
+bool is_zero(const uint8_t *buf, size_t size)
+{
+#ifdef ZERO_X86
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	return avx2 ? is_zero_avx2(buf, size) : is_zero_sse2(buf, size);
+#else
+	return is_zero_tail(buf, size);
+#endif
+}
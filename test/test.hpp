@@ -0,0 +1,55 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <unistd.h>
+
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <string>
+
+// Aborts the test with the location of the failed condition
+#define TEST_ASSERT(cond)                                            \
+	do {                                                             \
+		if (!(cond)) {                                               \
+			std::cerr << __FILE__ << ":" << __LINE__                 \
+			          << ": Assertion failed: " #cond << std::endl;  \
+			std::exit(1);                                            \
+		}                                                            \
+	} while (0)
+
+// Returns the URL of a new folder for a test that needs a share, named after
+// the test within the share folder given by NBDKIT_SMB_TEST_SHARE. If that
+// is not set, the test exits with 77, which meson reports as skipped.
+inline std::string test_share_folder(const std::string &name)
+{
+	const char *share = std::getenv("NBDKIT_SMB_TEST_SHARE");
+	if (!share || !*share) {
+		std::cout << "NBDKIT_SMB_TEST_SHARE is not set, skipping" << std::endl;
+		std::exit(77);
+	}
+	std::string res = share;
+	if (res.back() != '/') {
+		res += '/';
+	}
+	return res + name + "-" + std::to_string(std::time(nullptr)) + "-" +
+	       std::to_string(getpid()) + "/";
+}
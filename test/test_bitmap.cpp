@@ -0,0 +1,108 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstddef>
+#include <iostream>
+#include <set>
+
+#include <nbdkit_smb_plugin/bitmap.hpp>
+#include <test/test.hpp>
+
+// Checks that the bitmap holds exactly the given bits
+static void check(const Bitmap &bitmap, const std::set<size_t> &bits)
+{
+	TEST_ASSERT(bitmap.count() == bits.size());
+	size_t i = bitmap.find_next(0);
+	for (size_t bit : bits) {
+		TEST_ASSERT(i == bit);
+		TEST_ASSERT(bitmap.test(bit));
+		i = bitmap.find_next(i + 1);
+	}
+	TEST_ASSERT(i == Bitmap::npos);
+}
+
+static void test_set_reset()
+{
+	Bitmap bitmap;
+	TEST_ASSERT(bitmap.size() == 0);
+	TEST_ASSERT(!bitmap.test(0));
+	TEST_ASSERT(bitmap.find_next(0) == Bitmap::npos);
+
+	// Setting bits grows the bitmap
+	const std::set<size_t> bits = {0, 1, 63, 64, 127, 128, 1000};
+	for (size_t bit : bits) {
+		TEST_ASSERT(!bitmap.set(bit));
+	}
+	TEST_ASSERT(bitmap.size() == 1001);
+	TEST_ASSERT(bitmap.set(64));
+	check(bitmap, bits);
+
+	TEST_ASSERT(bitmap.reset(63));
+	TEST_ASSERT(!bitmap.reset(63));
+	TEST_ASSERT(!bitmap.reset(5000));
+	check(bitmap, {0, 1, 64, 127, 128, 1000});
+
+	bitmap.clear();
+	TEST_ASSERT(bitmap.size() == 1001);
+	check(bitmap, {});
+}
+
+static void test_resize()
+{
+	Bitmap bitmap(130);
+	bitmap.set(3);
+	bitmap.set(100);
+	bitmap.set(129);
+
+	// Shrinking drops the bits beyond the new size, also when growing again
+	bitmap.resize(100);
+	check(bitmap, {3});
+	bitmap.resize(200);
+	check(bitmap, {3});
+	TEST_ASSERT(bitmap.n_words() == 4);
+}
+
+static void test_merge()
+{
+	Bitmap a, b;
+	a.set(1);
+	a.set(70);
+	b.set(70);
+	b.set(300);
+	a.merge(b);
+	TEST_ASSERT(a.size() == 301);
+	check(a, {1, 70, 300});
+	check(b, {70, 300});
+
+	// Merging a smaller bitmap keeps the size
+	Bitmap c(10);
+	c.set(2);
+	a.merge(c);
+	TEST_ASSERT(a.size() == 301);
+	check(a, {1, 2, 70, 300});
+}
+
+int main()
+{
+	test_set_reset();
+	test_resize();
+	test_merge();
+	std::cout << "OK" << std::endl;
+	return 0;
+}
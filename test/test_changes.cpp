@@ -0,0 +1,144 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <nbdkit_smb_plugin/changes.hpp>
+#include <nbdkit_smb_plugin/context.hpp>
+#include <test/test.hpp>
+
+static constexpr uint64_t SUPERBLOCK_BYTES = 1024 * 1024;
+
+static ChangeTracker::Map load(ContextPool &pool, const SMB::URL &url)
+{
+	ChangeTracker::Map map;
+	TEST_ASSERT(ChangeTracker::load(*pool.acquire(), url, map));
+	TEST_ASSERT(map.superblock_bytes == SUPERBLOCK_BYTES);
+	return map;
+}
+
+static std::set<size_t> changed(const ChangeTracker::Map &map)
+{
+	std::set<size_t> res;
+	for (size_t sb = map.changed.find_next(0); sb != Bitmap::npos;
+	     sb = map.changed.find_next(sb + 1)) {
+		res.insert(sb);
+	}
+	return res;
+}
+
+int main(int argc, const char *argv[])
+{
+	if (argc > 2) {
+		std::cout << "Usage: " << argv[0] << " [URL OF A NEW DISK FOLDER]"
+		          << std::endl;
+		return 1;
+	}
+	const std::string path =
+	    argc == 2 ? argv[1] : test_share_folder("changes");
+	const SMB::URL url(path.c_str());
+	const SMB::Options options;
+	ContextPool pool(url, options);
+	err(pool.acquire()->mkdir(url.str().c_str(), 0770));
+
+	// Changes are only tracked once a map exists
+	ChangeTracker::Map map;
+	TEST_ASSERT(!ChangeTracker::load(*pool.acquire(), url, map));
+	uint64_t generation;
+	{
+		ChangeTracker tracker(pool, url, map, SUPERBLOCK_BYTES);
+		generation = tracker.reset();
+		TEST_ASSERT(changed(load(pool, url)).empty());
+		TEST_ASSERT(load(pool, url).generation == generation);
+
+		// Marks are recorded before mark() returns
+		tracker.mark(2, 4);
+		tracker.mark(100, 100);
+		tracker.mark(3, 3);
+		TEST_ASSERT(changed(load(pool, url)) ==
+		            std::set<size_t>({2, 3, 4, 100}));
+	}
+
+	// A tracker continues the loaded map; concurrent marks are all recorded
+	map = load(pool, url);
+	TEST_ASSERT(map.generation == generation);
+	std::set<size_t> expected = {2, 3, 4, 100};
+	{
+		ChangeTracker tracker(pool, url, map, SUPERBLOCK_BYTES);
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < 4; t++) {
+			threads.emplace_back([&tracker, t]() {
+				for (size_t i = 0; i < 50; i++) {
+					tracker.mark(200 + 4 * i + t, 200 + 4 * i + t);
+				}
+			});
+			for (size_t i = 0; i < 50; i++) {
+				expected.insert(200 + 4 * i + t);
+			}
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+	}
+	map = load(pool, url);
+	TEST_ASSERT(changed(map) == expected);
+	TEST_ASSERT(map.generation == generation);
+
+	// A torn map falls back to the previous one
+	{
+		ChangeTracker tracker(pool, url, map, SUPERBLOCK_BYTES);
+		tracker.mark(1000, 1000);
+	}
+	map = load(pool, url);
+	TEST_ASSERT(changed(map).count(1000));
+	{
+		ContextPool::Lease ctx = pool.acquire();
+		const std::string path =
+		    url.str() + "changes." + std::to_string(map.sequence % 2) + ".map";
+		std::string data;
+		TEST_ASSERT(ctx->read_file(path, data));
+		data.back() ^= 1;
+		ctx->write_file(path, data);
+	}
+	const ChangeTracker::Map previous = load(pool, url);
+	TEST_ASSERT(previous.sequence == map.sequence - 1);
+	TEST_ASSERT(changed(previous) == expected);
+
+	// Starting the next generation clears the map
+	{
+		ChangeTracker tracker(pool, url, previous, SUPERBLOCK_BYTES);
+		TEST_ASSERT(tracker.reset() == generation + 1);
+	}
+	map = load(pool, url);
+	TEST_ASSERT(map.generation == generation + 1);
+	TEST_ASSERT(changed(map).empty());
+
+	ChangeTracker::remove(*pool.acquire(), url);
+	TEST_ASSERT(!ChangeTracker::load(*pool.acquire(), url, map));
+	ChangeTracker::remove(*pool.acquire(), url);
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
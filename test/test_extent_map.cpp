@@ -0,0 +1,141 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <nbdkit_smb_plugin/extent_map.hpp>
+#include <test/test.hpp>
+
+static constexpr uint64_t BLOCK_SIZE = 512;
+static constexpr uint64_t N_BLOCKS = 200;
+
+// Address of each block, or npos
+using Model = std::vector<uint64_t>;
+
+static void check(const ExtentMap &map, const Model &model)
+{
+	// Lookups report consecutive parts that agree with the model
+	uint64_t pos = 10;
+	map.lookup(10, N_BLOCKS - 20, [&](uint64_t block, uint64_t count,
+	                                  uint64_t addr) {
+		TEST_ASSERT(block == pos && count > 0);
+		for (uint64_t i = 0; i < count; i++) {
+			TEST_ASSERT(model[block + i] ==
+			            (addr == ExtentMap::npos ? addr
+			                                     : addr + i * BLOCK_SIZE));
+		}
+		pos += count;
+	});
+	TEST_ASSERT(pos == N_BLOCKS - 10);
+
+	// Extents are ordered, do not overlap and are merged where possible
+	uint64_t end = 0, end_addr = ExtentMap::npos;
+	size_t n = 0;
+	map.for_each([&](const ExtentMap::Extent &e) {
+		TEST_ASSERT(e.block >= end && e.count > 0);
+		TEST_ASSERT(e.block > end || e.addr != end_addr);
+		for (uint64_t i = 0; i < e.count; i++) {
+			TEST_ASSERT(model[e.block + i] == e.addr + i * BLOCK_SIZE);
+		}
+		end = e.block + e.count;
+		end_addr = e.addr + e.count * BLOCK_SIZE;
+		n++;
+	});
+	TEST_ASSERT(n == map.size());
+	for (uint64_t i = end; i < N_BLOCKS; i++) {
+		TEST_ASSERT(model[i] == ExtentMap::npos);
+	}
+}
+
+static void test_merge()
+{
+	ExtentMap map(BLOCK_SIZE);
+	const auto ignore = [](uint64_t, uint64_t) {};
+	map.assign(0, 4, 0, ignore);
+	map.assign(4, 4, 4 * BLOCK_SIZE, ignore);
+	TEST_ASSERT(map.size() == 1);
+
+	// Adjacent blocks at a non-adjacent address are not merged
+	map.assign(8, 1, 100 * BLOCK_SIZE, ignore);
+	TEST_ASSERT(map.size() == 2);
+
+	// Overwriting the middle splits the extent and reports the old address
+	uint64_t removed_addr = 0, removed_count = 0;
+	map.assign(2, 2, ExtentMap::npos, [&](uint64_t addr, uint64_t count) {
+		removed_addr = addr;
+		removed_count = count;
+	});
+	TEST_ASSERT(removed_addr == 2 * BLOCK_SIZE && removed_count == 2);
+	TEST_ASSERT(map.size() == 3);
+}
+
+static void test_random()
+{
+	std::mt19937 rng(1);
+	ExtentMap map(BLOCK_SIZE);
+	Model model(N_BLOCKS, ExtentMap::npos);
+	uint64_t next_addr = 0;
+	for (size_t n = 0; n < 20000; n++) {
+		const uint64_t block = rng() % N_BLOCKS;
+		const uint64_t count = rng() % std::min<uint64_t>(16, N_BLOCKS - block);
+		uint64_t addr = ExtentMap::npos;
+		if (rng() % 4) {
+			addr = next_addr;
+			next_addr += count * BLOCK_SIZE;
+		}
+		if (rng() % 8 == 0) {
+			next_addr += BLOCK_SIZE;  // Leaves a gap in the address space
+		}
+
+		// Each previously mapped block is reported as removed exactly once
+		uint64_t n_mapped = 0, n_removed = 0;
+		for (uint64_t i = block; i < block + count; i++) {
+			n_mapped += model[i] != ExtentMap::npos;
+		}
+		map.assign(block, count, addr, [&](uint64_t old, uint64_t k) {
+			for (uint64_t i = 0; i < k; i++) {
+				bool found = false;
+				for (uint64_t j = block; j < block + count; j++) {
+					found = found || model[j] == old + i * BLOCK_SIZE;
+				}
+				TEST_ASSERT(found);
+			}
+			n_removed += k;
+		});
+		TEST_ASSERT(n_removed == n_mapped);
+
+		for (uint64_t i = 0; i < count; i++) {
+			model[block + i] =
+			    addr == ExtentMap::npos ? addr : addr + i * BLOCK_SIZE;
+		}
+		check(map, model);
+	}
+}
+
+int main()
+{
+	test_merge();
+	test_random();
+	std::cout << "OK" << std::endl;
+	return 0;
+}
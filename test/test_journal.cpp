@@ -0,0 +1,267 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <nbdkit_smb_plugin/context.hpp>
+#include <nbdkit_smb_plugin/folder.hpp>
+#include <nbdkit_smb_plugin/journal.hpp>
+#include <test/test.hpp>
+
+static constexpr size_t BLOCK_SIZE = 4096;
+
+// Sizes of the journal header and of a record header in journal.cpp
+static constexpr size_t HEADER_SIZE = 24;
+static constexpr size_t RECORD_SIZE = 40;
+
+struct Write {
+	uint64_t block;
+	size_t count;
+	std::vector<uint8_t> data;
+};
+
+static std::vector<uint8_t> pattern(size_t count, uint8_t seed)
+{
+	std::vector<uint8_t> res(count * BLOCK_SIZE);
+	for (size_t i = 0; i < res.size(); i++) {
+		res[i] = uint8_t(seed + i * 7);
+	}
+	return res;
+}
+
+static void fail(uint64_t, size_t, const uint8_t *)
+{
+	throw std::runtime_error("write failed");
+}
+
+// Journals the given writes while none can be applied, so that all of them
+// are left in the journal
+static void write_unapplied(Folder &folder, const SMB::Options &options,
+                            const std::vector<Write> &writes)
+{
+	Journal journal(folder, options, options.journal, fail);
+	for (const Write &w : writes) {
+		TEST_ASSERT(journal.write(w.block, w.count, w.data.data()));
+	}
+}
+
+static Journal::Apply record(std::vector<Write> &applied)
+{
+	return [&applied](uint64_t block, size_t count, const uint8_t *buf) {
+		applied.push_back(
+		    Write{block, count,
+		          std::vector<uint8_t>(buf, buf + count * BLOCK_SIZE)});
+	};
+}
+
+// Modifies the journal file in place
+template <typename F>
+static void modify_journal(ContextPool &pool, Folder &folder, F f)
+{
+	ContextPool::Lease ctx = pool.acquire();
+	const std::string path = folder.url().str() + "journal.log";
+	File file(*ctx, path.c_str(), O_RDWR, 0);
+	TEST_ASSERT(file);
+	f(*ctx, file);
+}
+
+static void test_replay(ContextPool &pool, Folder &folder,
+                        const SMB::Options &options)
+{
+	const std::vector<Write> writes = {{0, 1, pattern(1, 1)},
+	                                   {10, 2, pattern(2, 2)},
+	                                   {300, 1, pattern(1, 3)},
+	                                   {5, 1, pattern(1, 4)}};
+
+	// Replay stops at the first record whose data does not match its
+	// checksum; the later records are not applied either
+	write_unapplied(folder, options, writes);
+	modify_journal(pool, folder, [](Context &ctx, SMBCFILE *file) {
+		const size_t offs = HEADER_SIZE + 3 * RECORD_SIZE + 3 * BLOCK_SIZE + 17;
+		const uint8_t x = 0xff;
+		TEST_ASSERT(ctx.lseek(file, offs, SEEK_SET) == off_t(offs));
+		TEST_ASSERT(ctx.write(file, &x, 1) == 1);
+	});
+	std::vector<Write> applied;
+	{
+		Journal journal(folder, options, options.journal, record(applied));
+		journal.close();
+	}
+	TEST_ASSERT(applied.size() == 2);
+	for (size_t i = 0; i < applied.size(); i++) {
+		TEST_ASSERT(applied[i].block == writes[i].block);
+		TEST_ASSERT(applied[i].count == writes[i].count);
+		TEST_ASSERT(applied[i].data == writes[i].data);
+	}
+
+	// Records of earlier epochs are not applied again
+	applied.clear();
+	{
+		Journal journal(folder, options, options.journal, record(applied));
+	}
+	TEST_ASSERT(applied.empty());
+
+	// A torn record at the end is ignored when recovering the journal of a
+	// disk opened without one, after which the journal is deleted
+	write_unapplied(folder, options, writes);
+	modify_journal(pool, folder, [](Context &ctx, SMBCFILE *file) {
+		struct stat st;
+		TEST_ASSERT(ctx.fstat(file, &st) == 0);
+		TEST_ASSERT(ctx.ftruncate(file, st.st_size - 1) == 0);
+	});
+	Journal::recover(pool, folder, options, record(applied));
+	TEST_ASSERT(applied.size() == 3);
+	TEST_ASSERT(applied[2].block == writes[2].block);
+	TEST_ASSERT(applied[2].data == writes[2].data);
+	applied.clear();
+	Journal::recover(pool, folder, options, record(applied));
+	TEST_ASSERT(applied.empty());
+}
+
+// Waiting for a write that cannot be applied fails instead of hanging
+static void test_drain_error(Folder &folder, const SMB::Options &options)
+{
+	Journal journal(folder, options, options.journal, fail);
+	const std::vector<uint8_t> data = pattern(1, 5);
+	TEST_ASSERT(journal.write(7, 1, data.data()));
+	bool thrown = false;
+	try {
+		journal.drain();
+	}
+	catch (std::runtime_error &e) {
+		thrown = std::string(e.what()) == "write failed";
+	}
+	TEST_ASSERT(thrown);
+}
+
+// Once the journal fills up, writes bypass it instead of waiting for the
+// journaled ones to be applied
+static void test_full(Folder &folder, SMB::Options options)
+{
+	options.journal = 64 * 1024;
+	Journal journal(folder, options, options.journal, fail);
+	const std::vector<uint8_t> data = pattern(1, 6);
+	uint64_t block = 0;
+	while (journal.write(block, 1, data.data())) {
+		block++;
+	}
+	TEST_ASSERT(block > 0 && block < options.journal / BLOCK_SIZE);
+	TEST_ASSERT(!journal.write(block, 1, data.data()));
+	journal.bypass(block, 1);
+}
+
+// Reads must see the latest journaled data while the background thread
+// applies writes and the journal starts over with new epochs, and writes
+// bypass the journal while it is drained
+static void test_concurrency(Folder &folder, SMB::Options options)
+{
+	static constexpr size_t N_THREADS = 4;
+	static constexpr size_t BLOCKS_PER_THREAD = 64;
+	static constexpr size_t N_WRITES = 300;
+
+	std::mutex disk_mutex;
+	std::vector<uint8_t> disk(N_THREADS * BLOCKS_PER_THREAD * BLOCK_SIZE);
+	const auto apply = [&](uint64_t block, size_t count, const uint8_t *buf) {
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+		std::lock_guard<std::mutex> lock(disk_mutex);
+		memcpy(disk.data() + block * BLOCK_SIZE, buf, count * BLOCK_SIZE);
+	};
+
+	// A small journal starts over frequently
+	options.journal = 64 * 1024;
+	std::vector<uint8_t> expected(disk.size());
+	{
+		Journal journal(folder, options, options.journal, apply);
+		std::vector<std::thread> threads;
+		for (size_t t = 0; t < N_THREADS; t++) {
+			threads.emplace_back([&, t]() {
+				std::mt19937 rng(t);
+				std::vector<uint8_t> buf(4 * BLOCK_SIZE);
+				for (size_t i = 0; i < N_WRITES; i++) {
+					const size_t count = 1 + rng() % 4;
+					const uint64_t block = t * BLOCKS_PER_THREAD +
+					                       rng() % (BLOCKS_PER_THREAD - count);
+					const size_t size = count * BLOCK_SIZE;
+					for (size_t j = 0; j < size; j++) {
+						buf[j] = uint8_t(rng());
+					}
+					if (!journal.write(block, count, buf.data())) {
+						journal.bypass(block, count);
+						std::lock_guard<std::mutex> lock(disk_mutex);
+						memcpy(disk.data() + block * BLOCK_SIZE, buf.data(),
+						       size);
+					}
+					memcpy(expected.data() + block * BLOCK_SIZE, buf.data(),
+					       size);
+
+					std::vector<uint8_t> res(size);
+					journal.read(block, count, res.data(), [&]() {
+						std::lock_guard<std::mutex> lock(disk_mutex);
+						memcpy(res.data(), disk.data() + block * BLOCK_SIZE,
+						       size);
+					});
+					TEST_ASSERT(memcmp(res.data(), buf.data(), size) == 0);
+				}
+			});
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		journal.close();
+	}
+	TEST_ASSERT(disk == expected);
+}
+
+int main(int argc, const char *argv[])
+{
+	if (argc > 2) {
+		std::cout << "Usage: " << argv[0] << " [URL OF A NEW DISK FOLDER]"
+		          << std::endl;
+		return 1;
+	}
+	const std::string path =
+	    argc == 2 ? argv[1] : test_share_folder("journal");
+	const SMB::URL url(path.c_str());
+	SMB::Options options;
+	options.block_size = BLOCK_SIZE;
+	options.journal = 1024 * 1024;
+	ContextPool pool(url, options);
+	Folder folder(pool, url, options, false);
+
+	test_replay(pool, folder, options);
+	test_drain_error(folder, options);
+	test_concurrency(folder, options);
+	test_full(folder, options);
+	folder.close(*pool.acquire());
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <cstdint>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <nbdkit_smb_plugin/layout.hpp>
+#include <test/test.hpp>
+
+static std::string format(const Layout &layout, uint64_t superblock)
+{
+	std::string res(layout.name_length(), '\0');
+	layout.format(superblock, &res[0]);
+	return res;
+}
+
+static void test_round_trip(const Layout &layout)
+{
+	const uint64_t superblocks[] = {0,      1,          0xff,
+	                                0x100,  0x123456,   0xdeadbeefcafe,
+	                                ~0ULL,  1ULL << 63, 0x0123456789abcdef};
+	for (uint64_t sb : superblocks) {
+		const std::string name = format(layout, sb);
+		uint64_t res = 0;
+		TEST_ASSERT(layout.parse(name.data(), name.size(), res));
+		TEST_ASSERT(res == sb);
+
+		// Every directory level ends with a slash
+		for (unsigned int level = 0; level < layout.depth(); level++) {
+			TEST_ASSERT(name[layout.dir_length(level)] == '/');
+		}
+	}
+}
+
+static void test_names()
+{
+	TEST_ASSERT(format(Layout::legacy(), 0x123) == "321/0000000000000.img");
+	TEST_ASSERT(format(Layout(1, 256), 0x123) == "23/00000000000001.img");
+	TEST_ASSERT(format(Layout(2, 16), 0x123) == "3/2/00000000000001.img");
+	TEST_ASSERT(format(Layout(3, 4096), 0x123) ==
+	            "123/000/000/0000000.img");
+}
+
+static void test_parse_rejects()
+{
+	const Layout layout(2, 256);
+	uint64_t sb;
+	const std::string valid = format(layout, 42);
+	TEST_ASSERT(!layout.parse(valid.data(), valid.size() - 1, sb));
+
+	std::string name = valid;
+	name[0] = 'g';
+	TEST_ASSERT(!layout.parse(name.data(), name.size(), sb));
+	name = valid;
+	name[layout.dir_length(0)] = 'a';
+	TEST_ASSERT(!layout.parse(name.data(), name.size(), sb));
+	name = valid;
+	name[name.size() - 1] = 'x';
+	TEST_ASSERT(!layout.parse(name.data(), name.size(), sb));
+
+	// Names of another layout are not superblocks of this one
+	const std::string other = format(Layout(1, 256), 42);
+	TEST_ASSERT(!layout.parse(other.data(), other.size(), sb));
+}
+
+static void test_for_disk()
+{
+	TEST_ASSERT(Layout::for_disk(0) == Layout(1, 256));
+	TEST_ASSERT(Layout::for_disk(256 * 256) == Layout(1, 256));
+	TEST_ASSERT(Layout::for_disk(256 * 256 + 256) == Layout(2, 256));
+	TEST_ASSERT(Layout::for_disk(1ULL << 40) == Layout(3, 256));
+	TEST_ASSERT(Layout::for_disk(16 * 16 * 17, 16) == Layout(3, 16));
+	TEST_ASSERT(Layout::legacy() != Layout(1, 4096));
+}
+
+static void test_invalid()
+{
+	bool thrown = false;
+	try {
+		Layout(1, 64);
+	}
+	catch (std::invalid_argument &) {
+		thrown = true;
+	}
+	TEST_ASSERT(thrown);
+
+	thrown = false;
+	try {
+		Layout(Layout::MAX_DEPTH + 1);
+	}
+	catch (std::invalid_argument &) {
+		thrown = true;
+	}
+	TEST_ASSERT(thrown);
+}
+
+int main()
+{
+	test_round_trip(Layout::legacy());
+	for (unsigned int depth = 1; depth <= Layout::MAX_DEPTH; depth++) {
+		for (unsigned int fanout : {16, 256, 4096}) {
+			test_round_trip(Layout(depth, fanout));
+		}
+	}
+	test_names();
+	test_parse_rejects();
+	test_for_disk();
+	test_invalid();
+	std::cout << "OK" << std::endl;
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+#include <nbdkit_smb_plugin/log.hpp>
+#include <test/test.hpp>
+
+static bool is_valid(const std::string &spec)
+{
+	try {
+		Log::validate(spec);
+	}
+	catch (std::invalid_argument &) {
+		return false;
+	}
+	return true;
+}
+
+static void test_levels()
+{
+	Log::configure("warning");
+	TEST_ASSERT(Log::enabled(Log::IO, Log::ERROR));
+	TEST_ASSERT(Log::enabled(Log::IO, Log::WARNING));
+	TEST_ASSERT(!Log::enabled(Log::IO, Log::INFO));
+	TEST_ASSERT(!Log::enabled(Log::MEMORY, Log::INFO));
+
+	// Levels of other subsystems are kept
+	Log::configure("io:trace");
+	TEST_ASSERT(Log::enabled(Log::IO, Log::TRACE));
+	TEST_ASSERT(Log::enabled(Log::DISK, Log::WARNING));
+	TEST_ASSERT(!Log::enabled(Log::DISK, Log::INFO));
+
+	// Later items override earlier ones; levels may be given as numbers
+	Log::configure("debug,disk:none,prealloc:1");
+	TEST_ASSERT(Log::enabled(Log::IO, Log::DEBUG));
+	TEST_ASSERT(!Log::enabled(Log::IO, Log::TRACE));
+	TEST_ASSERT(!Log::enabled(Log::DISK, Log::ERROR));
+	TEST_ASSERT(Log::enabled(Log::PREALLOC, Log::ERROR));
+	TEST_ASSERT(!Log::enabled(Log::PREALLOC, Log::WARNING));
+
+	Log::configure("smbclient:debug");
+	TEST_ASSERT(Log::smbclient_debug_level() == 6);
+	Log::configure("smbclient:0");
+	TEST_ASSERT(Log::smbclient_debug_level() == 0);
+}
+
+static void test_invalid()
+{
+	TEST_ASSERT(is_valid("error"));
+	TEST_ASSERT(is_valid("5"));
+	TEST_ASSERT(is_valid("info,memory:trace"));
+	TEST_ASSERT(!is_valid(""));
+	TEST_ASSERT(!is_valid("verbose"));
+	TEST_ASSERT(!is_valid("6"));
+	TEST_ASSERT(!is_valid("io:"));
+	TEST_ASSERT(!is_valid("cache:debug"));
+	TEST_ASSERT(!is_valid("info,"));
+
+	// Validating does not change the verbosity, neither does a malformed
+	// specification
+	Log::configure("error");
+	const unsigned int generation = Log::generation();
+	Log::validate("trace");
+	TEST_ASSERT(!is_valid("trace,io:foo"));
+	try {
+		Log::configure("trace,io:foo");
+	}
+	catch (std::invalid_argument &) {
+	}
+	TEST_ASSERT(!Log::enabled(Log::IO, Log::WARNING));
+	TEST_ASSERT(Log::generation() == generation);
+}
+
+int main()
+{
+	test_levels();
+	test_invalid();
+	std::cout << "OK" << std::endl;
+	return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <nbdkit_smb_plugin/context.hpp>
+#include <nbdkit_smb_plugin/folder.hpp>
+#include <nbdkit_smb_plugin/log_store.hpp>
+#include <test/test.hpp>
+
+static constexpr size_t BLOCK_SIZE = 4096;
+static constexpr size_t N_BLOCKS = 64;
+
+struct Disk {
+	ContextPool pool;
+	Folder folder;
+	LogStore log;
+
+	Disk(const SMB::URL &url, const SMB::Options &options)
+	    : pool(url, options),
+	      folder(pool, url, options, false),
+	      log(pool, folder, options)
+	{
+	}
+};
+
+// Expected contents of the disk
+using Model = std::vector<uint8_t>;
+
+static void check(Disk &disk, const Model &model)
+{
+	std::vector<uint8_t> buf(N_BLOCKS * BLOCK_SIZE);
+	disk.log.read(0, N_BLOCKS, buf.data());
+	TEST_ASSERT(buf == model);
+
+	// Reads of single blocks are served from the same records
+	disk.log.read(N_BLOCKS / 2, 1, buf.data());
+	TEST_ASSERT(memcmp(buf.data(), model.data() + N_BLOCKS / 2 * BLOCK_SIZE,
+	                   BLOCK_SIZE) == 0);
+}
+
+// Writes or unmaps random ranges of blocks
+static void write_random(Disk &disk, Model &model, std::mt19937 &rng,
+                         size_t n)
+{
+	std::vector<uint8_t> buf;
+	for (size_t i = 0; i < n; i++) {
+		const size_t block = rng() % N_BLOCKS;
+		const size_t count = 1 + rng() % std::min<size_t>(8, N_BLOCKS - block);
+		uint8_t *dst = model.data() + block * BLOCK_SIZE;
+		if (rng() % 5 == 0) {
+			disk.log.write(block, count, nullptr);
+			std::fill(dst, dst + count * BLOCK_SIZE, 0);
+			continue;
+		}
+		buf.resize(count * BLOCK_SIZE);
+		for (uint8_t &x : buf) {
+			x = rng();
+		}
+		disk.log.write(block, count, buf.data());
+		std::copy(buf.begin(), buf.end(), dst);
+	}
+}
+
+// Returns the segment files of the disk in the order they were created
+static std::vector<std::string> segments(Disk &disk)
+{
+	std::vector<std::string> files, dirs;
+	TEST_ASSERT(
+	    disk.folder.list_dir(*disk.pool.acquire(), "segments/", files, dirs));
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+// Waits until the collector has moved the data of all older segments to the
+// head segment, which happens whenever a new head segment is started
+static void wait_compacted(Disk &disk)
+{
+	for (size_t i = 0; segments(disk).size() > 1; i++) {
+		TEST_ASSERT(i < 1000);
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+}
+
+// Cuts the given number of bytes off the head segment, as if the last
+// append had been torn
+static void tear_head(Disk &disk, size_t n)
+{
+	ContextPool::Lease ctx = disk.pool.acquire();
+	const std::string path =
+	    disk.folder.url().str() + "segments/" + segments(disk).back();
+	File file(*ctx, path.c_str(), O_RDWR, 0);
+	TEST_ASSERT(file);
+	struct stat st;
+	TEST_ASSERT(ctx->fstat(file, &st) == 0 && size_t(st.st_size) > n);
+	TEST_ASSERT(ctx->ftruncate(file, st.st_size - n) == 0);
+}
+
+int main(int argc, const char *argv[])
+{
+	if (argc > 2) {
+		std::cout << "Usage: " << argv[0] << " [URL OF A NEW DISK FOLDER]"
+		          << std::endl;
+		return 1;
+	}
+	const std::string path =
+	    argc == 2 ? argv[1] : test_share_folder("log_store");
+	const SMB::URL url(path.c_str());
+	SMB::Options options;
+	options.block_size = BLOCK_SIZE;
+	options.format = "log";
+	options.pool_size = 2;
+
+	std::mt19937 rng(1);
+	Model model(N_BLOCKS * BLOCK_SIZE, 0);
+	{
+		Disk disk(url, options);
+		TEST_ASSERT(disk.folder.log_structured());
+		check(disk, model);
+		write_random(disk, model, rng, 200);
+		check(disk, model);
+		disk.log.close();
+	}
+
+	// The map is loaded from the checkpoint written on close. Records
+	// appended afterwards are replayed after a crash.
+	{
+		Disk disk(url, options);
+		check(disk, model);
+		write_random(disk, model, rng, 200);
+		check(disk, model);
+	}
+	{
+		Disk disk(url, options);
+		check(disk, model);
+	}
+
+	// A torn record at the end of the log is ignored, and the log continues
+	// after the last intact record. Nothing may be appended after the torn
+	// record, so the collector must be done before.
+	Model intact;
+	{
+		Disk disk(url, options);
+		write_random(disk, model, rng, 1);
+		wait_compacted(disk);
+		intact = model;
+		write_random(disk, model, rng, 1);
+		TEST_ASSERT(model != intact);
+		tear_head(disk, 1);
+	}
+	model = intact;
+	{
+		Disk disk(url, options);
+		check(disk, model);
+		write_random(disk, model, rng, 50);
+		check(disk, model);
+		disk.log.close();
+	}
+	{
+		Disk disk(url, options);
+		check(disk, model);
+		disk.log.close();
+	}
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
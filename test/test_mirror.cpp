@@ -0,0 +1,160 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <nbdkit_smb_plugin/context.hpp>
+#include <nbdkit_smb_plugin/executor.hpp>
+#include <nbdkit_smb_plugin/folder.hpp>
+#include <nbdkit_smb_plugin/mirror.hpp>
+#include <test/test.hpp>
+
+struct Target {
+	ContextPool pool;
+	Folder folder;
+
+	Target(const SMB::URL &url, const SMB::Options &options)
+	    : pool(url, options), folder(pool, url, options, false)
+	{
+	}
+
+	Mirror::Side side() { return Mirror::Side{&pool, &folder}; }
+};
+
+// Records the superblocks copied by the background thread
+class Resyncs {
+private:
+	using Copy = std::tuple<size_t, size_t, size_t>;
+
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::vector<Copy> m_copies;
+
+public:
+	Mirror::Resync resync()
+	{
+		return [this](size_t src, size_t dst, size_t superblock) {
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_copies.emplace_back(src, dst, superblock);
+			m_cond.notify_all();
+		};
+	}
+
+	// Waits for the given number of copies and returns them
+	std::vector<Copy> wait(size_t n)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		TEST_ASSERT(m_cond.wait_for(lock, std::chrono::seconds(10), [&]() {
+			return m_copies.size() >= n;
+		}));
+		return m_copies;
+	}
+};
+
+static void fail_resync(size_t, size_t, size_t)
+{
+	throw std::runtime_error("resync failed");
+}
+
+int main(int argc, const char *argv[])
+{
+	if (argc != 1 && argc != 3) {
+		std::cout << "Usage: " << argv[0]
+		          << " [URL OF A NEW DISK FOLDER] [URL OF A NEW MIRROR FOLDER]"
+		          << std::endl;
+		return 1;
+	}
+	SMB::Options options;
+	const std::string path_a =
+	    argc == 3 ? argv[1] : test_share_folder("mirror_a");
+	const std::string path_b =
+	    argc == 3 ? argv[2] : test_share_folder("mirror_b");
+	Target a(SMB::URL(path_a.c_str()), options);
+	Target b(SMB::URL(path_b.c_str()), options);
+	Executor executor(4);
+
+	// A write that fails on the mirror marks the superblock as dirty for the
+	// mirror, which is recorded in the map of the primary side
+	{
+		Mirror mirror(a.side(), b.side(), executor, options, fail_resync);
+		mirror.write({3}, [](size_t side, size_t) {
+			if (side == 1) {
+				throw std::runtime_error("write failed");
+			}
+		});
+		TEST_ASSERT(mirror.clean_side(3) == 0);
+		mirror.close();
+	}
+
+	// The map is loaded when the disk is opened again, also with the sides
+	// swapped, and the superblock is copied from the side holding it
+	{
+		Resyncs resyncs;
+		Mirror mirror(b.side(), a.side(), executor, options, resyncs.resync());
+		const auto copies = resyncs.wait(1);
+		TEST_ASSERT(copies.size() == 1);
+		TEST_ASSERT(copies[0] ==
+		            std::make_tuple(size_t(1), size_t(0), size_t(3)));
+		mirror.close();
+	}
+
+	// Superblocks being written when the disk was not closed cleanly are
+	// copied to the mirror
+	{
+		Resyncs resyncs;
+		{
+			Mirror mirror(a.side(), b.side(), executor, options,
+			              resyncs.resync());
+			mirror.write({5, 6}, [](size_t, size_t) {});
+		}
+		TEST_ASSERT(resyncs.wait(0).empty());
+		Mirror mirror(a.side(), b.side(), executor, options, resyncs.resync());
+		const auto copies = resyncs.wait(2);
+		TEST_ASSERT(copies.size() == 2);
+		TEST_ASSERT(copies[0] ==
+		            std::make_tuple(size_t(0), size_t(1), size_t(5)));
+		TEST_ASSERT(copies[1] ==
+		            std::make_tuple(size_t(0), size_t(1), size_t(6)));
+		mirror.close();
+	}
+
+	// After a clean close, nothing is copied
+	{
+		Resyncs resyncs;
+		Mirror mirror(a.side(), b.side(), executor, options, resyncs.resync());
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		TEST_ASSERT(resyncs.wait(0).empty());
+		mirror.close();
+	}
+
+	a.folder.close(*a.pool.acquire());
+	b.folder.close(*b.pool.acquire());
+	std::cout << "OK" << std::endl;
+	return 0;
+}
@@ -0,0 +1,75 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <nbdkit_smb_plugin/qos.hpp>
+#include <test/test.hpp>
+
+// Waiting time in seconds
+static double take(TokenBucket &bucket, uint64_t n)
+{
+	return std::chrono::duration<double>(bucket.take(n)).count();
+}
+
+// Tokens refill while the test runs, so waits are never longer than
+// expected, but may be slightly shorter
+static bool near(double x, double expected)
+{
+	return x >= expected - 0.05 && x <= expected + 1e-6;
+}
+
+int main()
+{
+	// Without a rate, nothing is limited
+	TokenBucket unlimited(0, 1.0);
+	TEST_ASSERT(take(unlimited, uint64_t(1) << 40) == 0.0);
+
+	// The burst passes at once; requests beyond it accumulate debt, which
+	// has to be waited out at the limit rate
+	TokenBucket bucket(1000, 1.0);
+	TEST_ASSERT(take(bucket, 1000) == 0.0);
+	TEST_ASSERT(near(take(bucket, 500), 0.5));
+	TEST_ASSERT(near(take(bucket, 500), 1.0));
+
+	// The debt is paid off over time
+	std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	const double wait = take(bucket, 0);
+	TEST_ASSERT(wait > 0.5 && wait <= 0.8);
+
+	// Requests larger than the burst still pass
+	TokenBucket large(1000, 1.0);
+	TEST_ASSERT(near(take(large, 5000), 4.0));
+
+	// Idle periods do not accumulate more than the burst
+	TokenBucket capped(1000 * 1000, 0.01);
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	TEST_ASSERT(take(capped, 10 * 1000) == 0.0);
+	TEST_ASSERT(take(capped, 10 * 1000) > 0.005);
+
+	// The burst is at least a single token
+	TokenBucket slow(1, 0.0);
+	TEST_ASSERT(take(slow, 1) == 0.0);
+	TEST_ASSERT(near(take(slow, 1), 1.0));
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <nbdkit_smb_plugin/zero.hpp>
+#include <test/test.hpp>
+
+static bool is_zero_reference(const uint8_t *buf, size_t size)
+{
+	return std::all_of(buf, buf + size, [](uint8_t x) { return x == 0; });
+}
+
+int main()
+{
+	// Covers buffers shorter and longer than a vector stride, at all
+	// alignments of a vector register, with a non-zero byte at each position
+	static constexpr size_t MAX_SIZE = 1100;
+	static constexpr size_t MAX_OFFS = 32;
+	std::vector<uint8_t> buf(MAX_OFFS + MAX_SIZE);
+	for (size_t offs = 0; offs < MAX_OFFS; offs++) {
+		for (size_t size = 0; size <= MAX_SIZE; size += (size < 80 ? 1 : 17)) {
+			const uint8_t *p = buf.data() + offs;
+			TEST_ASSERT(is_zero(p, size));
+			for (size_t i = 0; i < size; i++) {
+				buf[offs + i] = 1 << (i % 8);
+				TEST_ASSERT(!is_zero(p, size));
+				TEST_ASSERT(is_zero(p, i));
+				buf[offs + i] = 0;
+			}
+		}
+	}
+
+	// Sparse random data, as found in partially written superblocks
+	std::mt19937 rng(42);
+	for (size_t n = 0; n < 10000; n++) {
+		const size_t offs = rng() % MAX_OFFS, size = rng() % MAX_SIZE;
+		std::fill(buf.begin(), buf.end(), 0);
+		for (size_t i = rng() % 3; i > 0; i--) {
+			buf[rng() % buf.size()] = rng() % 256;
+		}
+		const uint8_t *p = buf.data() + offs;
+		TEST_ASSERT(is_zero(p, size) == is_zero_reference(p, size));
+	}
+
+	// Non-zero bytes just outside of the buffer are ignored
+	buf.assign(buf.size(), 0xff);
+	std::fill(buf.begin() + 1, buf.begin() + 1 + 512, 0);
+	TEST_ASSERT(is_zero(buf.data() + 1, 512));
+	TEST_ASSERT(!is_zero(buf.data(), 513));
+	TEST_ASSERT(!is_zero(buf.data() + 1, 513));
+
+	std::cout << "OK" << std::endl;
+	return 0;
+}
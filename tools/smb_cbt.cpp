@@ -0,0 +1,98 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <nbdkit_smb_plugin/smb.hpp>
+
+static int usage(const char *name)
+{
+	std::cout
+	    << "Usage: " << name << " list [KEY=VALUE...] <URL>\n"
+	    << "       " << name << " reset [KEY=VALUE...] <URL>\n"
+	    << "       " << name << " disable [KEY=VALUE...] <URL>\n\n"
+	    << "Manages the changed-block tracking of the disk at URL. \"list\" "
+	       "prints the\n"
+	    << "byte ranges changed in the current backup generation as OFFSET "
+	       "LENGTH\n"
+	    << "pairs and may be used while the disk is in use. \"reset\" starts "
+	       "a new\n"
+	    << "generation, enabling change tracking if necessary, and "
+	       "\"disable\" stops\n"
+	    << "tracking changes; the disk must not be in use for either.\n";
+	return 1;
+}
+
+int main(int argc, const char *argv[])
+{
+	if (argc < 2) {
+		return usage(argv[0]);
+	}
+	const std::string mode = argv[1];
+	if (mode != "list" && mode != "reset" && mode != "disable") {
+		return usage(argv[0]);
+	}
+
+	SMB::Options options;
+	std::vector<const char *> args;
+	try {
+		for (int i = 2; i < argc; i++) {
+			const char *eq = std::strchr(argv[i], '=');
+			if (eq && std::strncmp(argv[i], "smb://", 6) != 0) {
+				options.set(std::string(argv[i], eq), eq + 1);
+			}
+			else {
+				args.push_back(argv[i]);
+			}
+		}
+		if (args.size() != 1) {
+			return usage(argv[0]);
+		}
+
+		if (mode == "list") {
+			const SMB::Changes changes = SMB::changes(args[0], options);
+			uint64_t total = 0;
+			for (const std::pair<uint64_t, uint64_t> &extent :
+			     changes.extents) {
+				std::cout << extent.first << ' ' << extent.second << '\n';
+				total += extent.second;
+			}
+			std::cerr << "Generation " << changes.generation << ": "
+			          << (total >> 20) << " MiB changed in "
+			          << changes.extents.size() << " ranges" << std::endl;
+		}
+		else if (mode == "reset") {
+			SMB smb(args[0], options);
+			std::cout << "Started generation " << smb.reset_changes()
+			          << std::endl;
+		}
+		else {
+			SMB smb(args[0], options);
+			smb.stop_tracking_changes();
+		}
+	}
+	catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,84 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include <nbdkit_smb_plugin/smb.hpp>
+
+static int usage(const char *name)
+{
+	std::cout << "Usage: " << name
+	          << " [--overlay] [KEY=VALUE...] <SRC URL> <DST URL>\n\n"
+	          << "Copies the disk at SRC URL into a new disk folder at DST "
+	             "URL. Superblocks\n"
+	          << "are copied on the server if possible. KEY=VALUE options "
+	             "(e.g. depth=2)\n"
+	          << "apply to the new disk and can be used to change its "
+	             "directory layout.\n\n"
+	          << "  --overlay  Create a copy-on-write overlay of SRC URL "
+	             "instead of copying\n"
+	          << "             any data.\n";
+	return 1;
+}
+
+int main(int argc, const char *argv[])
+{
+	bool overlay = false;
+	SMB::Options options;
+	const char *urls[2];
+	int n_urls = 0;
+	try {
+		for (int i = 1; i < argc; i++) {
+			const char *eq = std::strchr(argv[i], '=');
+			if (std::strcmp(argv[i], "--overlay") == 0) {
+				overlay = true;
+			}
+			else if (eq && std::strncmp(argv[i], "smb://", 6) != 0) {
+				options.set(std::string(argv[i], eq), eq + 1);
+			}
+			else if (n_urls < 2) {
+				urls[n_urls++] = argv[i];
+			}
+			else {
+				return usage(argv[0]);
+			}
+		}
+		if (n_urls != 2) {
+			return usage(argv[0]);
+		}
+
+		if (overlay) {
+			options.base = urls[0];
+			SMB dst(urls[1], options);
+			std::cout << "Created overlay disk" << std::endl;
+		}
+		else {
+			SMB src(urls[0], options);
+			const size_t n = src.copy_to(urls[1], options);
+			std::cout << "Copied " << n << " superblocks" << std::endl;
+		}
+	}
+	catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,292 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <nbdkit_smb_plugin/smb.hpp>
+#include <nbdkit_smb_plugin/zero.hpp>
+
+static int usage(const char *name)
+{
+	std::cout
+	    << "Usage: " << name << " import [KEY=VALUE...] <FILE> <URL>\n"
+	    << "       " << name << " export [KEY=VALUE...] size=SIZE <URL> <FILE>\n\n"
+	    << "Copies a raw disk image into the disk at URL or vice versa, "
+	       "transferring\n"
+	    << "pool_size superblocks in parallel. Superblocks only containing "
+	       "zeros are not\n"
+	    << "transferred: on import they are deleted from the disk, on export "
+	       "they are\n"
+	    << "left as holes in FILE if it is a regular file. The disk must not "
+	       "be in use.\n";
+	return 1;
+}
+
+template <typename T>
+static T check(T res)
+{
+	if (res < 0) {
+		throw std::system_error(errno, std::system_category());
+	}
+	return res;
+}
+
+static void pread_full(int fd, uint8_t *buf, size_t count, off_t offs)
+{
+	while (count > 0) {
+		const ssize_t n = check(pread(fd, buf, count, offs));
+		if (n == 0) {
+			memset(buf, 0, count);  // Beyond the end of the image
+			return;
+		}
+		buf += n;
+		count -= n;
+		offs += n;
+	}
+}
+
+static void pwrite_full(int fd, const uint8_t *buf, size_t count, off_t offs)
+{
+	while (count > 0) {
+		const ssize_t n = check(pwrite(fd, buf, count, offs));
+		buf += n;
+		count -= n;
+		offs += n;
+	}
+}
+
+// Returns true if the given range of the file is a hole
+static bool is_hole(int fd, off_t offs, size_t count)
+{
+	const off_t data = lseek(fd, offs, SEEK_DATA);
+	if (data < 0) {
+		return errno == ENXIO;  // No data up to the end of the file
+	}
+	return data >= off_t(offs + count);
+}
+
+/**
+ * Transfers the disk one superblock at a time in a number of threads and
+ * keeps track of the progress.
+ */
+class Transfer {
+private:
+	SMB &m_smb;
+	int m_fd;
+	uint64_t m_size;
+	size_t m_sb_bytes;
+	size_t m_n_threads;
+
+	std::atomic<size_t> m_next{0};
+	std::atomic<uint64_t> m_copied{0};
+	std::atomic<uint64_t> m_skipped{0};
+	std::mutex m_mutex;
+	std::exception_ptr m_error;
+
+	template <typename F>
+	void run(F f)
+	{
+		auto worker = [&]() {
+			std::vector<uint8_t> buf(m_sb_bytes);
+			size_t i;
+			while ((i = m_next++) * m_sb_bytes < m_size) {
+				const uint64_t offs = i * m_sb_bytes;
+				const size_t count = std::min<uint64_t>(m_sb_bytes, m_size - offs);
+				try {
+					f(offs, count, buf.data());
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(m_mutex);
+					if (!m_error) {
+						m_error = std::current_exception();
+					}
+					m_next = m_size / m_sb_bytes + 1;  // Stop all threads
+				}
+			}
+		};
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < m_n_threads; i++) {
+			threads.emplace_back(worker);
+		}
+		for (std::thread &thread : threads) {
+			thread.join();
+		}
+		if (m_error) {
+			std::rethrow_exception(m_error);
+		}
+	}
+
+public:
+	Transfer(SMB &smb, int fd, uint64_t size, size_t n_threads)
+	    : m_smb(smb),
+	      m_fd(fd),
+	      m_size(size),
+	      m_sb_bytes(smb.block_size() * smb.superblock_size()),
+	      m_n_threads(n_threads)
+	{
+	}
+
+	uint64_t copied() const { return m_copied; }
+	uint64_t skipped() const { return m_skipped; }
+
+	void import()
+	{
+		const size_t bs = m_smb.block_size();
+		run([&](uint64_t offs, size_t count, uint8_t *buf) {
+			// The last block is padded with zeros
+			const size_t n_blocks = (count + bs - 1) / bs;
+			bool zero = is_hole(m_fd, offs, count);
+			if (!zero) {
+				pread_full(m_fd, buf, n_blocks * bs, offs);
+				zero = is_zero(buf, n_blocks * bs);
+			}
+			if (zero) {
+				m_smb.zero_block(offs / bs, n_blocks, true);
+				m_skipped += count;
+			}
+			else {
+				m_smb.write_block(offs / bs, n_blocks, buf);
+				m_copied += count;
+			}
+		});
+	}
+
+	void export_(bool sparse)
+	{
+		const size_t bs = m_smb.block_size();
+		run([&](uint64_t offs, size_t count, uint8_t *buf) {
+			m_smb.read_block(offs / bs, (count + bs - 1) / bs, buf);
+			if (sparse && is_zero(buf, count)) {
+				m_skipped += count;
+			}
+			else {
+				pwrite_full(m_fd, buf, count, offs);
+				m_copied += count;
+			}
+		});
+	}
+};
+
+int main(int argc, const char *argv[])
+{
+	if (argc < 2) {
+		return usage(argv[0]);
+	}
+	const std::string mode = argv[1];
+	if (mode != "import" && mode != "export") {
+		return usage(argv[0]);
+	}
+
+	SMB::Options options;
+	uint64_t size = 0;
+	std::vector<const char *> args;
+	int fd = -1;
+	try {
+		for (int i = 2; i < argc; i++) {
+			const char *eq = std::strchr(argv[i], '=');
+			if (eq && std::strncmp(argv[i], "smb://", 6) != 0) {
+				const std::string key(argv[i], eq);
+				if (key == "size") {
+					size = SMB::Options::parse_size(key, eq + 1);
+				}
+				else {
+					options.set(key, eq + 1);
+				}
+			}
+			else {
+				args.push_back(argv[i]);
+			}
+		}
+		if (args.size() != 2) {
+			return usage(argv[0]);
+		}
+		const bool importing = mode == "import";
+		const char *file = importing ? args[0] : args[1];
+		const char *url = importing ? args[1] : args[0];
+
+		struct stat st;
+		if (importing) {
+			fd = check(open(file, O_RDONLY));
+			check(fstat(fd, &st));
+			if (S_ISBLK(st.st_mode)) {
+				size = check(lseek(fd, 0, SEEK_END));
+			}
+			else if (size == 0) {
+				size = st.st_size;
+			}
+		}
+		else {
+			if (size == 0) {
+				throw std::invalid_argument("The size of the disk is required");
+			}
+			fd = check(open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+			check(fstat(fd, &st));
+			if (S_ISREG(st.st_mode)) {
+				check(ftruncate(fd, size));
+			}
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		options.disk_size = size;
+		SMB smb(url, options);
+		Transfer transfer(smb, fd, size, options.pool_size);
+		if (importing) {
+			transfer.import();
+		}
+		else {
+			// Holes can only be left in regular files, which were truncated
+			// to the disk size before
+			transfer.export_(S_ISREG(st.st_mode));
+			check(fsync(fd));
+		}
+		const double secs = std::chrono::duration<double>(
+		                        std::chrono::steady_clock::now() - start)
+		                        .count();
+
+		std::cout << std::fixed << std::setprecision(1) << "Copied "
+		          << (transfer.copied() >> 20) << " MiB, skipped "
+		          << (transfer.skipped() >> 20) << " MiB of zeros in " << secs
+		          << " s (" << (secs > 0 ? (size >> 20) / secs : 0.0)
+		          << " MiB/s)" << std::endl;
+	}
+	catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
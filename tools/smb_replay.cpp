@@ -0,0 +1,495 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <nbdkit_smb_plugin/smb.hpp>
+#include <nbdkit_smb_plugin/trace.hpp>
+
+static int usage(const char *name)
+{
+	std::cout
+	    << "Usage: " << name
+	    << " [OPTIONS] [KEY=VALUE...] <TRACE> [URL]\n\n"
+	    << "Replays a trace recorded with the trace=FILE plugin parameter "
+	       "against the disk\n"
+	    << "at URL and reports latencies and throughput. Writes overwrite "
+	       "the disk with\n"
+	    << "generated data; replay against a scratch disk, e.g. an overlay "
+	       "created with\n"
+	    << "smb_clone --overlay. Without URL, only the trace statistics and "
+	       "the cache\n"
+	    << "simulation are printed.\n\n"
+	    << "  --max-speed         Issue operations as fast as possible "
+	       "instead of at the\n"
+	    << "                      recorded times\n"
+	    << "  --concurrency=N     Number of operations in flight (default 1)\n"
+	    << "  --cache=SIZE,...    Simulate read caches of the given sizes "
+	       "(e.g. 256M,1G)\n"
+	    << "  --policy=P,...      Simulated replacement policies: lru, fifo, "
+	       "clock\n"
+	    << "                      (default all)\n"
+	    << "  --cache-block=SIZE  Cache granularity (default 1M)\n";
+	return 1;
+}
+
+static std::vector<std::string> split_list(const std::string &value)
+{
+	std::vector<std::string> res;
+	size_t start = 0;
+	while (start <= value.size()) {
+		size_t end = value.find(',', start);
+		if (end == std::string::npos) {
+			end = value.size();
+		}
+		res.push_back(value.substr(start, end - start));
+		start = end + 1;
+	}
+	return res;
+}
+
+/******************************************************************************
+ * Cache simulation                                                           *
+ ******************************************************************************/
+
+/**
+ * Simulated cache of fixed-size blocks. access() returns true on a hit and
+ * inserts the block on a miss.
+ */
+class CacheSim {
+protected:
+	size_t m_capacity;
+
+public:
+	CacheSim(size_t capacity) : m_capacity(capacity) {}
+	virtual ~CacheSim() = default;
+	virtual bool access(uint64_t block) = 0;
+};
+
+class LRUSim : public CacheSim {
+private:
+	std::list<uint64_t> m_order;  // Most recently used first
+	std::unordered_map<uint64_t, std::list<uint64_t>::iterator> m_map;
+
+public:
+	using CacheSim::CacheSim;
+
+	bool access(uint64_t block) override
+	{
+		auto it = m_map.find(block);
+		if (it != m_map.end()) {
+			m_order.splice(m_order.begin(), m_order, it->second);
+			return true;
+		}
+		if (m_map.size() >= m_capacity) {
+			m_map.erase(m_order.back());
+			m_order.pop_back();
+		}
+		m_order.push_front(block);
+		m_map[block] = m_order.begin();
+		return false;
+	}
+};
+
+class FIFOSim : public CacheSim {
+private:
+	std::list<uint64_t> m_order;  // Oldest first
+	std::unordered_map<uint64_t, std::list<uint64_t>::iterator> m_map;
+
+public:
+	using CacheSim::CacheSim;
+
+	bool access(uint64_t block) override
+	{
+		if (m_map.count(block)) {
+			return true;
+		}
+		if (m_map.size() >= m_capacity) {
+			m_map.erase(m_order.front());
+			m_order.pop_front();
+		}
+		m_order.push_back(block);
+		m_map[block] = std::prev(m_order.end());
+		return false;
+	}
+};
+
+class ClockSim : public CacheSim {
+private:
+	struct Slot {
+		uint64_t block;
+		bool referenced;
+	};
+	std::vector<Slot> m_slots;
+	std::unordered_map<uint64_t, size_t> m_map;
+	size_t m_hand = 0;
+
+public:
+	using CacheSim::CacheSim;
+
+	bool access(uint64_t block) override
+	{
+		auto it = m_map.find(block);
+		if (it != m_map.end()) {
+			m_slots[it->second].referenced = true;
+			return true;
+		}
+		if (m_slots.size() < m_capacity) {
+			m_map[block] = m_slots.size();
+			m_slots.push_back(Slot{block, false});
+			return false;
+		}
+		while (m_slots[m_hand].referenced) {
+			m_slots[m_hand].referenced = false;
+			m_hand = (m_hand + 1) % m_slots.size();
+		}
+		m_map.erase(m_slots[m_hand].block);
+		m_slots[m_hand] = Slot{block, false};
+		m_map[block] = m_hand;
+		m_hand = (m_hand + 1) % m_slots.size();
+		return false;
+	}
+};
+
+static std::unique_ptr<CacheSim> make_cache_sim(const std::string &policy,
+                                                size_t capacity)
+{
+	if (policy == "lru") {
+		return std::make_unique<LRUSim>(capacity);
+	}
+	if (policy == "fifo") {
+		return std::make_unique<FIFOSim>(capacity);
+	}
+	if (policy == "clock") {
+		return std::make_unique<ClockSim>(capacity);
+	}
+	throw std::invalid_argument("Unknown cache policy '" + policy + "'");
+}
+
+// Reads hit if all of their blocks are cached; writes populate the cache
+static void simulate_cache(const std::vector<TraceRecord> &records,
+                           const std::vector<uint64_t> &sizes,
+                           const std::vector<std::string> &policies,
+                           uint64_t block_size)
+{
+	std::cout << "\nCache simulation (" << block_size / 1024
+	          << " KiB blocks, hit ratio of reads/blocks read)\n";
+	for (const std::string &policy : policies) {
+		for (uint64_t size : sizes) {
+			std::unique_ptr<CacheSim> sim =
+			    make_cache_sim(policy, std::max<uint64_t>(1, size / block_size));
+			size_t reads = 0, read_hits = 0, blocks = 0, block_hits = 0;
+			for (const TraceRecord &rec : records) {
+				if (rec.count == 0 || rec.type > TraceRecord::WRITE) {
+					continue;
+				}
+				const uint64_t first = rec.offset / block_size;
+				const uint64_t last = (rec.offset + rec.count - 1) / block_size;
+				bool hit = true;
+				for (uint64_t b = first; b <= last; b++) {
+					const bool block_hit = sim->access(b);
+					if (rec.type == TraceRecord::READ) {
+						blocks++;
+						block_hits += block_hit;
+						hit = hit && block_hit;
+					}
+				}
+				if (rec.type == TraceRecord::READ) {
+					reads++;
+					read_hits += hit;
+				}
+			}
+			std::cout << "  " << std::setw(5) << std::left << policy
+			          << std::right << std::setw(8) << (size >> 20) << " MiB  "
+			          << std::fixed << std::setprecision(1) << std::setw(5)
+			          << (reads ? 100.0 * read_hits / reads : 0.0) << "% / "
+			          << std::setw(5)
+			          << (blocks ? 100.0 * block_hits / blocks : 0.0) << "%\n";
+		}
+	}
+}
+
+/******************************************************************************
+ * Replay                                                                     *
+ ******************************************************************************/
+
+static constexpr int N_TYPES = 4;
+
+struct Latencies {
+	std::vector<uint32_t> us[N_TYPES];  // Indexed by TraceRecord::Type
+	size_t bytes[N_TYPES] = {0, 0, 0, 0};
+	size_t errors = 0;
+};
+
+static void print_latencies(const char *what, Latencies &lat)
+{
+	static const char *NAMES[N_TYPES] = {"read", "write", "zero", "trim"};
+	std::cout << "\n" << what << "\n";
+	for (int t = 0; t < N_TYPES; t++) {
+		std::vector<uint32_t> &v = lat.us[t];
+		if (v.empty()) {
+			continue;
+		}
+		std::sort(v.begin(), v.end());
+		auto pct = [&](double p) { return v[size_t(p * (v.size() - 1))]; };
+		std::cout << "  " << std::setw(5) << std::left << NAMES[t]
+		          << std::right << std::setw(9) << v.size() << " ops "
+		          << std::setw(9) << (lat.bytes[t] >> 20) << " MiB   "
+		          << "p50 " << pct(0.5) << " us, p95 " << pct(0.95)
+		          << " us, p99 " << pct(0.99) << " us, max " << v.back()
+		          << " us\n";
+	}
+	if (lat.errors) {
+		std::cout << "  " << lat.errors << " failed operations\n";
+	}
+}
+
+static void replay(SMB &smb, const std::vector<TraceRecord> &records,
+                   bool max_speed, size_t concurrency)
+{
+	using clock = std::chrono::steady_clock;
+	std::atomic<size_t> next(0);
+	std::mutex mutex;
+	Latencies total;
+
+	const clock::time_point start = clock::now();
+	auto worker = [&]() {
+		Latencies lat;
+		std::vector<uint8_t> buf;
+		size_t i;
+		while ((i = next++) < records.size()) {
+			const TraceRecord &rec = records[i];
+			if (!max_speed) {
+				std::this_thread::sleep_until(
+				    start + std::chrono::nanoseconds(rec.timestamp));
+			}
+			if (rec.type <= TraceRecord::WRITE && buf.size() < rec.count) {
+				buf.resize(rec.count);
+			}
+			if (rec.type == TraceRecord::WRITE) {
+				// Fill the buffer with data identifying the written block
+				for (size_t j = 0; j + 8 <= rec.count; j += 8) {
+					const uint64_t v = rec.offset + j;
+					std::memcpy(&buf[j], &v, 8);
+				}
+			}
+
+			const clock::time_point t0 = clock::now();
+			try {
+				switch (rec.type) {
+					case TraceRecord::READ:
+						smb.read_block(rec.offset / 4096, rec.count / 4096,
+						               buf.data());
+						break;
+					case TraceRecord::WRITE:
+						smb.write_block(rec.offset / 4096, rec.count / 4096,
+						                buf.data());
+						break;
+					case TraceRecord::ZERO:
+						// Traces do not record may_trim, which clients
+						// usually set
+						smb.zero_block(rec.offset / 4096, rec.count / 4096,
+						               true);
+						break;
+					case TraceRecord::TRIM: {
+						// Parts of blocks are not trimmed, as in the plugin
+						const uint64_t first = (rec.offset + 4095) / 4096;
+						const uint64_t last = (rec.offset + rec.count) / 4096;
+						if (last > first) {
+							smb.trim_block(first, last - first);
+						}
+						break;
+					}
+				}
+			}
+			catch (std::exception &) {
+				// Also count failures other than I/O errors, which must not
+				// end the worker thread
+				lat.errors++;
+			}
+			lat.us[rec.type].push_back(
+			    std::chrono::duration_cast<std::chrono::microseconds>(
+			        clock::now() - t0)
+			        .count());
+			lat.bytes[rec.type] += rec.count;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		for (int t = 0; t < N_TYPES; t++) {
+			total.us[t].insert(total.us[t].end(), lat.us[t].begin(),
+			                   lat.us[t].end());
+			total.bytes[t] += lat.bytes[t];
+		}
+		total.errors += lat.errors;
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < concurrency; i++) {
+		threads.emplace_back(worker);
+	}
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+	const double secs =
+	    std::chrono::duration<double>(clock::now() - start).count();
+
+	print_latencies("Replay", total);
+	const size_t bytes = total.bytes[TraceRecord::READ] +
+	                     total.bytes[TraceRecord::WRITE];
+	std::cout << "  " << std::fixed << std::setprecision(2) << secs << " s, "
+	          << (secs > 0 ? records.size() / secs : 0.0) << " IOPS, "
+	          << (secs > 0 ? bytes / secs / (1 << 20) : 0.0) << " MiB/s\n";
+}
+
+int main(int argc, const char *argv[])
+{
+	bool max_speed = false;
+	size_t concurrency = 1;
+	std::vector<uint64_t> cache_sizes;
+	std::vector<std::string> policies = {"lru", "fifo", "clock"};
+	uint64_t cache_block = 1024 * 1024;
+	SMB::Options options;
+	std::vector<const char *> args;
+	try {
+		for (int i = 1; i < argc; i++) {
+			const std::string arg = argv[i];
+			const size_t eq = arg.find('=');
+			const std::string value =
+			    eq == std::string::npos ? "" : arg.substr(eq + 1);
+			if (arg == "--max-speed") {
+				max_speed = true;
+			}
+			else if (arg.compare(0, 14, "--concurrency=") == 0) {
+				concurrency = std::max<size_t>(1, std::stoul(value));
+			}
+			else if (arg.compare(0, 8, "--cache=") == 0) {
+				for (const std::string &size : split_list(value)) {
+					cache_sizes.push_back(SMB::Options::parse_size("--cache", size));
+				}
+			}
+			else if (arg.compare(0, 9, "--policy=") == 0) {
+				policies = split_list(value);
+			}
+			else if (arg.compare(0, 14, "--cache-block=") == 0) {
+				cache_block = std::max<uint64_t>(
+				    4096, SMB::Options::parse_size("--cache-block", value));
+			}
+			else if (arg.compare(0, 2, "--") == 0) {
+				return usage(argv[0]);
+			}
+			else if (eq != std::string::npos && arg.compare(0, 6, "smb://")) {
+				options.set(arg.substr(0, eq), value);
+			}
+			else {
+				args.push_back(argv[i]);
+			}
+		}
+		if (args.empty() || args.size() > 2) {
+			return usage(argv[0]);
+		}
+		for (const std::string &policy : policies) {
+			make_cache_sim(policy, 1);  // Validate the policy names
+		}
+
+		// Load the trace in the order in which the operations were issued
+		TraceReader reader(args[0]);
+		std::vector<TraceRecord> records;
+		TraceRecord rec;
+		Latencies recorded;
+		while (reader.next(rec)) {
+			if (rec.type >= N_TYPES) {
+				continue;
+			}
+			records.push_back(rec);
+			recorded.us[rec.type].push_back(rec.latency);
+			recorded.bytes[rec.type] += rec.count;
+			recorded.errors += rec.error != 0;
+		}
+		std::stable_sort(records.begin(), records.end(),
+		                 [](const TraceRecord &a, const TraceRecord &b) {
+			                 return a.timestamp < b.timestamp;
+		                 });
+		std::cout << "Trace of " << records.size() << " operations over "
+		          << std::fixed << std::setprecision(2)
+		          << (records.empty() ? 0.0 : records.back().timestamp * 1e-9)
+		          << " s on a " << (reader.header().disk_size >> 20)
+		          << " MiB disk\n";
+		print_latencies("Recorded", recorded);
+
+		if (!cache_sizes.empty()) {
+			simulate_cache(records, cache_sizes, policies, cache_block);
+		}
+
+		if (args.size() == 2) {
+			options.disk_size = reader.header().disk_size;
+			SMB smb(args[1], options);
+			replay(smb, records, max_speed, concurrency);
+			if (smb.has_cache()) {
+				const SMB::CacheStats stats = smb.cache_stats();
+				std::cout << "  cache: " << stats.hits << " hits, "
+				          << stats.misses << " misses, " << stats.prefetched
+				          << " pages prefetched, " << stats.warmed
+				          << " warmed, " << stats.evicted << " evicted, "
+				          << (stats.limit >> 20) << " MiB limit\n";
+			}
+			const SMB::QosStats qos = smb.qos_stats();
+			if (qos.reads_throttled + qos.writes_throttled > 0) {
+				std::cout << "  throttled: " << qos.reads_throttled << " of "
+				          << qos.reads << " reads for "
+				          << qos.read_throttled_us / 1000 << " ms, "
+				          << qos.writes_throttled << " of " << qos.writes
+				          << " writes for " << qos.write_throttled_us / 1000
+				          << " ms\n";
+			}
+			if (smb.has_hedging()) {
+				const SMB::HedgeStats stats = smb.hedge_stats();
+				std::cout << "  hedged: " << stats.hedged << " of "
+				          << stats.reads << " reads, " << stats.won
+				          << " completed first, " << stats.denied
+				          << " denied by the budget\n";
+			}
+			if (smb.has_mirror()) {
+				const SMB::MirrorStats stats = smb.mirror_stats();
+				std::cout << "  mirror: " << stats.primary_reads
+				          << " reads from the disk, " << stats.mirror_reads
+				          << " from the mirror, " << stats.lagged
+				          << " lagging writes, " << stats.dirty
+				          << " superblocks out of sync\n";
+			}
+		}
+	}
+	catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ *  nbdkit-smb-plugin
+ *  Copyright (C) 2020  Andreas Stöckel
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU Affero General Public License as
+ *  published by the Free Software Foundation, either version 3 of the
+ *  License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Affero General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Affero General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <nbdkit_smb_plugin/smb.hpp>
+
+static int usage(const char *name)
+{
+	std::cout << "Usage: " << name
+	          << " [--sparsify] [--fix-sizes] [KEY=VALUE...] <URL>\n\n"
+	          << "Reads all superblock files of the disk at URL in parallel "
+	             "and reports\n"
+	          << "allocation statistics. The disk must not be in use. Use "
+	             "pool_size=N to\n"
+	          << "choose the number of connections.\n\n"
+	          << "  --sparsify   Delete superblocks that only contain zeros\n"
+	          << "  --fix-sizes  Truncate superblock files of the wrong size\n";
+	return 1;
+}
+
+int main(int argc, const char *argv[])
+{
+	bool sparsify = false, fix_sizes = false;
+	SMB::Options options;
+	const char *url = nullptr;
+	try {
+		for (int i = 1; i < argc; i++) {
+			const char *eq = std::strchr(argv[i], '=');
+			if (std::strcmp(argv[i], "--sparsify") == 0) {
+				sparsify = true;
+			}
+			else if (std::strcmp(argv[i], "--fix-sizes") == 0) {
+				fix_sizes = true;
+			}
+			else if (eq && std::strncmp(argv[i], "smb://", 6) != 0) {
+				options.set(std::string(argv[i], eq), eq + 1);
+			}
+			else if (!url && argv[i][0] != '-') {
+				url = argv[i];
+			}
+			else {
+				return usage(argv[0]);
+			}
+		}
+		if (!url) {
+			return usage(argv[0]);
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		SMB smb(url, options);
+		const SMB::ScrubStats stats = smb.scrub(sparsify, fix_sizes);
+		const double secs = std::chrono::duration<double>(
+		                        std::chrono::steady_clock::now() - start)
+		                        .count();
+
+		const size_t sb_bytes = smb.block_size() * smb.superblock_size();
+		std::cout << std::fixed << std::setprecision(1)
+		          << "Superblocks:       " << stats.superblocks << " ("
+		          << (stats.bytes >> 20) << " MiB)\n"
+		          << "Only zeros:        " << stats.zero << " ("
+		          << (stats.superblocks ? 100.0 * stats.zero / stats.superblocks
+		                                : 0.0)
+		          << "%, " << ((stats.zero * sb_bytes) >> 20) << " MiB)\n"
+		          << "Deleted:           " << stats.removed << "\n"
+		          << "Short files:       " << stats.short_files << "\n"
+		          << "Oversized files:   " << stats.long_files << "\n"
+		          << "Resized files:     " << stats.resized << "\n"
+		          << "Elapsed:           " << secs << " s ("
+		          << (secs > 0 ? (stats.bytes >> 20) / secs : 0.0)
+		          << " MiB/s allocated)\n";
+	}
+	catch (std::exception &e) {
+		std::cerr << "Error: " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}